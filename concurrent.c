@@ -15,19 +15,186 @@
 #if PG_VERSION_NUM >= 130000
 #include "access/heaptoast.h"
 #endif
+#if PG_VERSION_NUM >= 130000
+#include "common/hashfn.h"
+#else
+#include "access/hash.h"
+#endif
+#include "access/heapam_xlog.h"
+#include "access/nbtree.h"
+#include "access/rmgr.h"
+#include "common/pg_lzcompress.h"
 #include "executor/executor.h"
+#include "lib/stringinfo.h"
+#include "pgstat.h"
 #include "replication/decode.h"
+#include "replication/reorderbuffer.h"
+#include "replication/snapbuild.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "tcop/tcopprot.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/sortsupport.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
 
 #if PG_VERSION_NUM < 150000
 extern PGDLLIMPORT int wal_segment_size;
 #endif
 
+/* Initial size of the memory arena of ChangeBuffer. */
+#define CHANGE_BUFFER_MIN_SIZE	(64 * 1024)
+
+/*
+ * If the ChangeBuffer file is compressed, the records are written in chunks
+ * of approximately this size. (A single record can exceed it.)
+ */
+#define CHANGE_CHUNK_SIZE		(256 * 1024)
+
+/*
+ * Header of a compressed chunk. If compsize equals rawsize, the chunk is
+ * stored uncompressed.
+ */
+typedef struct ChangeChunkHeader
+{
+	uint32		rawsize;
+	uint32		compsize;
+} ChangeChunkHeader;
+
+/* A change processed by coalesce_concurrent_changes(). */
+typedef struct CoalesceItem
+{
+	ConcurrentChange *change;
+	int			pos;			/* the order in which it was decoded */
+	Datum	   *keys;			/* values of the identity key */
+} CoalesceItem;
+
+typedef struct CoalesceState
+{
+	int			nkeys;
+	SortSupport ssup;			/* one per key */
+} CoalesceState;
+
+/*
+ * Maximum number of entries of TidCache. When the limit is reached, the cache
+ * is emptied and filled again from scratch.
+ */
+#define TID_CACHE_MAX_ENTRIES	32768
+
+/*
+ * Binary representation of the identity key. Two keys having the same
+ * representation are surely equal. The opposite is not guaranteed, (e.g. the
+ * numeric data type), but in such a case we only miss the cache.
+ */
+typedef struct TidCacheKey
+{
+	char	   *data;
+	Size		len;
+} TidCacheKey;
+
+typedef struct TidCacheEntry
+{
+	TidCacheKey key;			/* must be the first */
+	ItemPointerData tid;
+} TidCacheEntry;
+
+/*
+ * Location of the rows that we inserted or updated while applying the
+ * concurrent changes, so that subsequent UPDATE / DELETE of the same row does
+ * not have to scan the identity index.
+ *
+ * The cache is not always kept up-to-date (e.g. if the key has a different
+ * binary representation in the DELETE record), so each entry needs to be
+ * checked for visibility before use. That's sufficient because, within our
+ * transaction, the TID of a row we deleted (or updated) cannot be used by
+ * another row.
+ */
+typedef struct TidCache
+{
+	MemoryContext mcxt;			/* the hash table and the keys */
+	HTAB	   *htab;
+
+	TupleDesc	tupdesc;
+	int			nkeys;
+	AttrNumber *attnos;			/* heap attributes of the identity key */
+
+	StringInfoData buf;			/* the key being looked up */
+} TidCache;
+
+/* Size of the queue through which the decoding worker sends the changes. */
+#define DECODING_QUEUE_SIZE		(256 * 1024)
+
+/*
+ * The number of changes received from the decoding worker before they are
+ * applied. Less if no more changes are available at the moment.
+ */
+#define PIPELINE_BATCH_CHANGES	1024
+
+/*
+ * Information passed to the decoding worker. The queue is located right
+ * after this structure in the DSM segment.
+ */
+typedef struct DecodingWorkerShared
+{
+	Oid			dbid;
+	Oid			roleid;
+	Oid			relid;
+	NameData	slotname;
+	RepOriginId rorigin;
+
+	/* Decode the changes up to this position. */
+	XLogRecPtr	end_of_wal;
+
+	slock_t		mutex;
+
+	/* Set when all the changes have been sent. */
+	bool		done;
+
+	/* Bytes of WAL the worker has decoded. */
+	uint64		wal_decoded;
+
+	/* The reason of failure, if the worker could not finish. */
+	char		error_msg[ERROR_MESSAGE_MAX_SIZE];
+} DecodingWorkerShared;
+
+static void receive_concurrent_changes(shm_mq_handle *mqh,
+									   DecodingOutputState *dstate,
+									   CatalogState *cat_state,
+									   Relation rel_dst, ScanKey ident_key,
+									   int ident_key_nentries,
+									   IndexInsertState *iistate);
 static void apply_concurrent_changes(DecodingOutputState *dstate,
 									 Relation relation, ScanKey key,
 									 int nkeys, IndexInsertState *iistate,
 									 struct timeval *must_complete);
+static bool is_foreign_heap_record(XLogReaderState *record,
+								   DecodingOutputState *dstate);
+static void skip_heap_record(LogicalDecodingContext *ctx,
+							 XLogReaderState *record);
 static bool processing_time_elapsed(struct timeval *utmost);
+static bool can_coalesce_changes(DecodingOutputState *dstate,
+								 IndexInsertState *iistate);
+static int	coalesce_compare_keys(const CoalesceItem *a, const CoalesceItem *b,
+								  CoalesceState *state);
+static int	coalesce_item_cmp(const void *a, const void *b, void *arg);
+static void coalesce_concurrent_changes(DecodingOutputState *dstate,
+										IndexInsertState *iistate);
+static TidCache *tid_cache_create(Relation relation, Relation ident_index);
+static void tid_cache_reset(TidCache *cache);
+static void tid_cache_free(TidCache *cache);
+static uint32 tid_cache_hash(const void *key, Size keysize);
+static int	tid_cache_match(const void *key1, const void *key2, Size keysize);
+static bool tid_cache_make_key(TidCache *cache, HeapTuple tup,
+							   TidCacheKey *key);
+static bool tid_cache_lookup(TidCache *cache, Relation relation,
+							 HeapTuple tup_key, TupleTableSlot *slot,
+							 ItemPointer tid);
+static void tid_cache_store(TidCache *cache, HeapTuple tup, ItemPointer tid);
+static void tid_cache_remove(TidCache *cache, HeapTuple tup_key);
 
 static void plugin_startup(LogicalDecodingContext *ctx,
 						   OutputPluginOptions *opt, bool is_init);
@@ -40,13 +207,27 @@ static void plugin_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
 						  Relation rel, ReorderBufferChange *change);
 static void store_change(LogicalDecodingContext *ctx,
 						 ConcurrentChangeKind kind, HeapTuple tuple);
-static HeapTuple get_changed_tuple(ConcurrentChange *change);
+static HeapTuple form_identity_tuple(DecodingOutputState *dstate,
+									 HeapTuple tuple);
+static void send_change(DecodingOutputState *dstate,
+						ConcurrentChange *change, HeapTuple tuple);
+static char *change_buffer_alloc(ChangeBuffer *cb, Size size);
+static void change_buffer_spill(ChangeBuffer *cb);
+static void change_buffer_write_chunk(ChangeBuffer *cb, char *data,
+									  Size size);
+static void change_buffer_write(ChangeBuffer *cb, void *ptr, Size size);
+static ConcurrentChange *change_buffer_next(ChangeBuffer *cb);
+static void change_buffer_read_chunk(ChangeBuffer *cb);
+static void change_buffer_read(ChangeBuffer *cb, void *ptr, Size size);
+static void change_buffer_reserve(char **buf, Size *buf_size, Size size,
+								  MemoryContext mcxt);
+static void change_buffer_reset(ChangeBuffer *cb);
 static bool plugin_filter(LogicalDecodingContext *ctx, RepOriginId origin_id);
 
 /*
  * Decode and apply concurrent changes. If there are too many of them, split
  * the processing into multiple iterations so that the intermediate storage
- * (tuplestore) is not likely to be written to disk.
+ * (ChangeBuffer) is not likely to be written to disk.
  *
  * See check_catalog_changes() for explanation of lock_held argument.
  *
@@ -68,7 +249,7 @@ process_concurrent_changes(LogicalDecodingContext *ctx,
 
 	/*
 	 * If some changes could not be applied due to time constraint, make sure
-	 * the tuplestore is empty before we insert new tuples into it.
+	 * the buffer is empty before we add new changes to it.
 	 */
 	if (dstate->nchanges > 0)
 		apply_concurrent_changes(dstate, rel_dst, ident_key,
@@ -94,7 +275,7 @@ process_concurrent_changes(LogicalDecodingContext *ctx,
 
 		/*
 		 * XXX Consider if it's possible to check *must_complete and stop
-		 * processing partway through. Partial cleanup of the tuplestore seems
+		 * processing partway through. Partial cleanup of the buffer seems
 		 * non-trivial.
 		 */
 		apply_concurrent_changes(dstate, rel_dst, ident_key,
@@ -108,6 +289,416 @@ process_concurrent_changes(LogicalDecodingContext *ctx,
 	return true;
 }
 
+/*
+ * Like process_concurrent_changes() called with NoLock and w/o time
+ * constraint, but let a background worker do the decoding, so that the
+ * changes can be applied while the worker is reading WAL.
+ *
+ * The worker needs our replication slot, so the decoding context is freed
+ * before the worker starts and a new one is created when the worker is done.
+ * The new context starts at the confirmed_flush position of the slot, which
+ * the worker advanced up to the last change it has sent. *ctx_p receives the
+ * new context.
+ *
+ * If the worker cannot be started, decode the changes ourselves.
+ */
+void
+process_concurrent_changes_pipelined(LogicalDecodingContext **ctx_p,
+									 XLogRecPtr end_of_wal,
+									 CatalogState *cat_state,
+									 Relation rel_dst, ScanKey ident_key,
+									 int ident_key_nentries,
+									 IndexInsertState *iistate)
+{
+	LogicalDecodingContext *ctx = *ctx_p;
+	DecodingOutputState *dstate;
+	Size		size;
+	dsm_segment *seg;
+	DecodingWorkerShared *shared;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus status;
+	bool		done;
+	char		error_msg[ERROR_MESSAGE_MAX_SIZE];
+
+	dstate = (DecodingOutputState *) ctx->output_writer_private;
+
+	/* The buffer must be empty before we start adding the changes. */
+	if (dstate->nchanges > 0)
+		apply_concurrent_changes(dstate, rel_dst, ident_key,
+								 ident_key_nentries, iistate, NULL);
+	Assert(dstate->nchanges == 0);
+
+	size = add_size(MAXALIGN(sizeof(DecodingWorkerShared)),
+					DECODING_QUEUE_SIZE);
+	seg = dsm_create(size, 0);
+	shared = (DecodingWorkerShared *) dsm_segment_address(seg);
+	shared->dbid = MyDatabaseId;
+	shared->roleid = GetUserId();
+	shared->relid = dstate->relid;
+	namestrcpy(&shared->slotname, NameStr(MyReplicationSlot->data.name));
+	shared->rorigin = dstate->rorigin;
+	shared->end_of_wal = end_of_wal;
+	SpinLockInit(&shared->mutex);
+	shared->done = false;
+	shared->wal_decoded = 0;
+	shared->error_msg[0] = '\0';
+
+	mq = shm_mq_create((char *) shared + MAXALIGN(sizeof(DecodingWorkerShared)),
+					   DECODING_QUEUE_SIZE);
+	shm_mq_set_receiver(mq, MyProc);
+
+	/*
+	 * Hand over the slot. The changes decoded so far have been applied, so
+	 * the worker must not decode them again.
+	 */
+	LogicalConfirmReceivedLocation(ctx->reader->EndRecPtr);
+	FreeDecodingContext(ctx);
+	*ctx_p = NULL;
+	ReplicationSlotRelease();
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	sprintf(worker.bgw_library_name, "pg_squeeze");
+	sprintf(worker.bgw_function_name, "squeeze_decoding_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN,
+			 "pg_squeeze decoding worker for relation %u", dstate->relid);
+	snprintf(worker.bgw_type, BGW_MAXLEN, "squeeze decoding worker");
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+	worker.bgw_notify_pid = MyProcPid;
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+	{
+		ereport(DEBUG1,
+				(errmsg("pg_squeeze: could not start decoding worker, decoding the changes locally")));
+		dsm_detach(seg);
+
+		ReplicationSlotAcquire(NameStr(MyWorkerTask->repl_slot.name), true);
+		ctx = create_decoding_context();
+		ctx->output_writer_private = dstate;
+		*ctx_p = ctx;
+
+		process_concurrent_changes(ctx, end_of_wal, cat_state, rel_dst,
+								   ident_key, ident_key_nentries, iistate,
+								   NoLock, NULL);
+		return;
+	}
+
+	/* Passing the handle makes us notice if the worker fails to start. */
+	mqh = shm_mq_attach(mq, seg, handle);
+
+	PG_TRY();
+	{
+		receive_concurrent_changes(mqh, dstate, cat_state, rel_dst,
+								   ident_key, ident_key_nentries, iistate);
+	}
+	PG_CATCH();
+	{
+		/* The worker must not keep the slot. */
+		HOLD_INTERRUPTS();
+		TerminateBackgroundWorker(handle);
+		WaitForBackgroundWorkerShutdown(handle);
+		RESUME_INTERRUPTS();
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* The worker has released the slot, but make sure it has exited. */
+	status = WaitForBackgroundWorkerShutdown(handle);
+	if (status == BGWH_POSTMASTER_DIED)
+		ereport(FATAL,
+				(errcode(ERRCODE_ADMIN_SHUTDOWN),
+				 errmsg("the postmaster died before the decoding worker could finish")));
+
+	SpinLockAcquire(&shared->mutex);
+	done = shared->done;
+	dstate->wal_decoded += shared->wal_decoded;
+	strlcpy(error_msg, shared->error_msg, ERROR_MESSAGE_MAX_SIZE);
+	SpinLockRelease(&shared->mutex);
+	dsm_detach(seg);
+
+	if (!done)
+	{
+		if (strlen(error_msg) > 0)
+			ereport(ERROR,
+					(errmsg("pg_squeeze decoding worker failed"),
+					 errdetail("%s", error_msg)));
+		else
+			ereport(ERROR,
+					(errmsg("pg_squeeze decoding worker exited prematurely")));
+	}
+
+	/* Continue the decoding where the worker has stopped. */
+	ReplicationSlotAcquire(NameStr(MyWorkerTask->repl_slot.name), true);
+	ctx = create_decoding_context();
+	ctx->output_writer_private = dstate;
+	*ctx_p = ctx;
+}
+
+/*
+ * Receive the changes from the decoding worker and apply them, until the
+ * worker detaches from the queue.
+ */
+static void
+receive_concurrent_changes(shm_mq_handle *mqh, DecodingOutputState *dstate,
+						   CatalogState *cat_state, Relation rel_dst,
+						   ScanKey ident_key, int ident_key_nentries,
+						   IndexInsertState *iistate)
+{
+	bool		detached = false;
+
+	while (!detached)
+	{
+		shm_mq_result res;
+		Size		nbytes;
+		void	   *data;
+
+		exit_if_requested();
+
+		res = shm_mq_receive(mqh, &nbytes, &data, true);
+		if (res == SHM_MQ_SUCCESS)
+		{
+			ConcurrentChange *change;
+			Size		len;
+
+			/* See send_change() for the format. */
+			if (nbytes < sizeof(ConcurrentChange))
+				elog(ERROR, "invalid message from decoding worker");
+			len = nbytes - sizeof(ConcurrentChange);
+			change = (ConcurrentChange *)
+				change_buffer_alloc(dstate->changes, CHANGE_RECORD_SIZE(len));
+			memcpy(change, data, sizeof(ConcurrentChange));
+			memcpy((char *) change + CHANGE_HEADER_SIZE,
+				   (char *) data + sizeof(ConcurrentChange), len);
+			dstate->nchanges++;
+
+			if (dstate->nchanges < PIPELINE_BATCH_CHANGES)
+				continue;
+		}
+		else if (res == SHM_MQ_WOULD_BLOCK)
+		{
+			/* Apply what we have, or wait for the worker. */
+			if (dstate->nchanges == 0)
+			{
+				(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH,
+								 0,
+								 squeeze_wait_event(SQUEEZE_WAIT_DECODING_WORKER));
+				ResetLatch(MyLatch);
+				CHECK_FOR_INTERRUPTS();
+				continue;
+			}
+		}
+		else
+		{
+			Assert(res == SHM_MQ_DETACHED);
+			detached = true;
+		}
+
+		if (dstate->nchanges == 0)
+			continue;
+
+		/* Make sure the changes are still applicable. */
+		check_catalog_changes(cat_state, NoLock);
+
+		apply_concurrent_changes(dstate, rel_dst, ident_key,
+								 ident_key_nentries, iistate, NULL);
+	}
+}
+
+/*
+ * Entry point of the background worker that decodes the changes for
+ * process_concurrent_changes_pipelined().
+ */
+void
+squeeze_decoding_worker_main(Datum main_arg)
+{
+	dsm_segment *seg;
+	DecodingWorkerShared *shared;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	CurrentResourceOwner = ResourceOwnerCreate(NULL,
+											   "pg_squeeze decoding worker");
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+	shared = (DecodingWorkerShared *) dsm_segment_address(seg);
+	mq = (shm_mq *) ((char *) shared + MAXALIGN(sizeof(DecodingWorkerShared)));
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	BackgroundWorkerInitializeConnectionByOid(shared->dbid, shared->roleid, 0);
+
+	PG_TRY();
+	{
+		LogicalDecodingContext *ctx;
+		DecodingOutputState *dstate;
+		Relation	rel;
+
+		/* The decoding uses catalog snapshots, like in the squeeze worker. */
+		StartTransactionCommand();
+
+		dstate = palloc0(sizeof(DecodingOutputState));
+		dstate->relid = shared->relid;
+		dstate->rorigin = shared->rorigin;
+		dstate->mqh = mqh;
+		dstate->resowner = ResourceOwnerCreate(CurrentResourceOwner,
+											   "logical decoding");
+
+		/* store_change() needs the descriptor to flatten the tuples. */
+		rel = table_open(shared->relid, AccessShareLock);
+		dstate->tupdesc = CreateTupleDescCopy(RelationGetDescr(rel));
+		set_relfilenode_filter(dstate, rel);
+		table_close(rel, AccessShareLock);
+
+		ReplicationSlotAcquire(NameStr(shared->slotname), true);
+		ctx = create_decoding_context();
+		ctx->output_writer_private = dstate;
+
+		decode_concurrent_changes(ctx, shared->end_of_wal, NULL);
+
+		/*
+		 * All the transactions that committed before the current position
+		 * have been sent, so the squeeze worker should not decode them
+		 * again.
+		 */
+		LogicalConfirmReceivedLocation(ctx->reader->EndRecPtr);
+
+		FreeDecodingContext(ctx);
+		ReplicationSlotRelease();
+
+		CommitTransactionCommand();
+
+		SpinLockAcquire(&shared->mutex);
+		shared->done = true;
+		shared->wal_decoded = dstate->wal_decoded;
+		SpinLockRelease(&shared->mutex);
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		edata = CopyErrorData();
+		SpinLockAcquire(&shared->mutex);
+		strlcpy(shared->error_msg, edata->message, ERROR_MESSAGE_MAX_SIZE);
+		SpinLockRelease(&shared->mutex);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* The squeeze worker will see that there are no more changes. */
+	shm_mq_detach(mqh);
+}
+
+/*
+ * Create the decoding context for the replication slot we have acquired.
+ * The decoding starts at the slot's restart_lsn, but the changes of
+ * transactions committed before confirmed_flush are skipped.
+ */
+LogicalDecodingContext *
+create_decoding_context(void)
+{
+	LogicalDecodingContext *ctx;
+	XLogRecPtr	restart_lsn;
+
+	restart_lsn = MyReplicationSlot->data.restart_lsn;
+
+	/* Restart the decoding context at slot's confirmed_flush */
+	ctx = CreateDecodingContext(InvalidXLogRecPtr,
+								NIL,
+								false,
+#if PG_VERSION_NUM >= 130000
+								XL_ROUTINE(.page_read = read_local_xlog_page,
+										   .segment_open = wal_segment_open,
+										   .segment_close = wal_segment_close),
+#else
+								logical_read_local_xlog_page,
+#endif
+								NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 130000
+	/* decode_concurrent_changes() handles the older versions. */
+	XLogBeginRead(ctx->reader, restart_lsn);
+#endif
+
+	XLByteToSeg(restart_lsn, squeeze_current_segment, wal_segment_size);
+
+	return ctx;
+}
+
+/*
+ * Tell decode_concurrent_changes() which storage the changes of 'rel' are
+ * written to.
+ *
+ * The relfilenodes cannot change while we're decoding: that would be caught
+ * by check_catalog_changes().
+ */
+void
+set_relfilenode_filter(DecodingOutputState *dstate, Relation rel)
+{
+	Oid			toastrelid = rel->rd_rel->reltoastrelid;
+
+#if PG_VERSION_NUM >= 160000
+	dstate->locator = rel->rd_locator;
+#else
+	dstate->locator = rel->rd_node;
+#endif
+	if (OidIsValid(toastrelid))
+	{
+		Relation	toastrel;
+
+		toastrel = table_open(toastrelid, AccessShareLock);
+#if PG_VERSION_NUM >= 160000
+		dstate->toast_locator = toastrel->rd_locator;
+#else
+		dstate->toast_locator = toastrel->rd_node;
+#endif
+		table_close(toastrel, AccessShareLock);
+	}
+	else
+		memset(&dstate->toast_locator, 0, sizeof(RelFileLocator));
+
+	/*
+	 * With REPLICA IDENTITY FULL, the old tuple contains all the columns,
+	 * but the identity index (see squeeze_table_internal()) is still the
+	 * primary key. RelationGetIndexList() makes sure rd_pkindex is valid.
+	 */
+	list_free(RelationGetIndexList(rel));
+	if (dstate->ident_attrs)
+	{
+		bms_free(dstate->ident_attrs);
+		dstate->ident_attrs = NULL;
+	}
+	if (rel->rd_rel->relreplident == REPLICA_IDENTITY_FULL &&
+		OidIsValid(rel->rd_pkindex))
+	{
+		Relation	ident_index;
+		MemoryContext old_cxt;
+
+		ident_index = index_open(rel->rd_pkindex, AccessShareLock);
+		old_cxt = MemoryContextSwitchTo(GetMemoryChunkContext(dstate));
+		for (int i = 0; i < ident_index->rd_index->indnkeyatts; i++)
+			dstate->ident_attrs =
+				bms_add_member(dstate->ident_attrs,
+							   ident_index->rd_index->indkey.values[i]);
+		MemoryContextSwitchTo(old_cxt);
+		index_close(ident_index, AccessShareLock);
+	}
+
+	dstate->filter_relfilenodes = true;
+}
+
 /*
  * Decode logical changes from the XLOG sequence up to end_of_wal.
  *
@@ -121,9 +712,8 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 {
 	DecodingOutputState *dstate;
 	ResourceOwner resowner_old;
+	uint32		wait_event;
 #if PG_VERSION_NUM < 130000
-	/* Workaround for XLogBeginRead() in setup_decoding(). */
-	static	bool	first_time = true;
 	XLogRecPtr	startptr;
 #endif
 
@@ -144,6 +734,10 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 	resowner_old = CurrentResourceOwner;
 	CurrentResourceOwner = dstate->resowner;
 
+	pgstat_progress_update_param(PROGRESS_SQUEEZE_LSN_TARGET, end_of_wal);
+
+	wait_event = squeeze_wait_event(SQUEEZE_WAIT_DECODING);
+
 	PG_TRY();
 	{
 		while (ctx->reader->EndRecPtr < end_of_wal)
@@ -154,11 +748,12 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 			XLogRecPtr	end_lsn;
 
 #if PG_VERSION_NUM < 130000
-			if (first_time)
-			{
+			/*
+			 * Workaround for XLogBeginRead() in create_decoding_context():
+			 * the reader of a new context has not read anything yet.
+			 */
+			if (XLogRecPtrIsInvalid(ctx->reader->EndRecPtr))
 				startptr = MyReplicationSlot->data.restart_lsn;
-				first_time = false;
-			}
 			else
 				startptr = InvalidXLogRecPtr;
 #endif
@@ -172,7 +767,25 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 				elog(ERROR, "%s", errm);
 
 			if (record != NULL)
-				LogicalDecodingProcessRecord(ctx, ctx->reader);
+			{
+				dstate->wal_decoded += ctx->reader->EndRecPtr -
+					ctx->reader->ReadRecPtr;
+
+				/*
+				 * Reading of WAL reports its own wait event and resets it
+				 * when done, so only set ours now, for the processing of the
+				 * record.
+				 */
+				pgstat_report_wait_start(wait_event);
+				if (is_foreign_heap_record(ctx->reader, dstate))
+					skip_heap_record(ctx, ctx->reader);
+				else
+					LogicalDecodingProcessRecord(ctx, ctx->reader);
+				pgstat_report_wait_end();
+			}
+
+			pgstat_progress_update_param(PROGRESS_SQUEEZE_LSN_DECODED,
+										 ctx->reader->EndRecPtr);
 
 			if (processing_time_elapsed(must_complete))
 				break;
@@ -192,6 +805,7 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 			}
 
 			exit_if_requested();
+			CHECK_FOR_INTERRUPTS();
 		}
 		InvalidateSystemCaches();
 		CurrentResourceOwner = resowner_old;
@@ -206,6 +820,9 @@ decode_concurrent_changes(LogicalDecodingContext *ctx,
 
 	elog(DEBUG1, "pg_squeeze: %.0f changes decoded but not applied yet",
 		 dstate->nchanges);
+	pgstat_progress_update_param(PROGRESS_SQUEEZE_CHANGES_PENDING,
+								 (int64) dstate->nchanges);
+	progress_sample_memory();
 
 	return ctx->reader->EndRecPtr >= end_of_wal;
 }
@@ -228,10 +845,15 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 	int2vector *ident_indkey;
 	HeapTuple	tup_old = NULL;
 	BulkInsertState bistate = NULL;
+	ConcurrentChange *change;
+	IndexScanDesc scan;
 
 	if (dstate->nchanges == 0)
 		return;
 
+	if (can_coalesce_changes(dstate, iistate))
+		coalesce_concurrent_changes(dstate, iistate);
+
 	/* Info needed to retrieve key values from heap tuple. */
 	ident_form = iistate->ident_index->rd_index;
 	ident_indkey = &ident_form->indkey;
@@ -249,31 +871,21 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 	 */
 	PushActiveSnapshot(GetTransactionSnapshot());
 
-	while (tuplestore_gettupleslot(dstate->tstore, true, false,
-								   dstate->tsslot))
+	/*
+	 * The same scan is used to find all the rows to be updated / deleted.
+	 * UpdateActiveSnapshotCommandId() below updates the snapshot in place,
+	 * so the scan also sees our own changes.
+	 */
+	scan = index_beginscan(relation, iistate->ident_index,
+						   GetActiveSnapshot(), nkeys, 0);
+
+	while ((change = change_buffer_next(dstate->changes)) != NULL)
 	{
-		bool		shouldFree;
-		HeapTuple	tup_change,
-					tup,
-					tup_exist;
-		char	   *change_raw;
-		ConcurrentChange *change;
-		bool		isnull[1];
-		Datum		values[1];
+		HeapTuple	tup;
 
 		Assert(dstate->nchanges > 0);
 		dstate->nchanges--;
 
-		/* Get the change from the single-column tuple. */
-		tup_change = ExecFetchSlotHeapTuple(dstate->tsslot, false, &shouldFree);
-		heap_deform_tuple(tup_change, dstate->tupdesc_change, values, isnull);
-		Assert(!isnull[0]);
-
-		/* This is bytea, but char* is easier to work with. */
-		change_raw = (char *) DatumGetByteaP(values[0]);
-
-		change = (ConcurrentChange *) VARDATA(change_raw);
-
 		/*
 		 * Do not keep buffer pinned for insert if the current change is
 		 * something else.
@@ -284,12 +896,16 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 			bistate = NULL;
 		}
 
-		tup = get_changed_tuple(change);
+		/*
+		 * The tuple is used in place, so it's only valid until the next
+		 * change is retrieved.
+		 */
+		tup = &change->tup_data;
 
 		if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_OLD)
 		{
 			Assert(tup_old == NULL);
-			tup_old = tup;
+			tup_old = heap_copytuple(tup);
 		}
 		else if (change->kind == PG_SQUEEZE_CHANGE_INSERT)
 		{
@@ -333,19 +949,16 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 			 * here are already committed.)
 			 */
 			list_free(recheck);
-			pfree(tup);
+
+			tid_cache_store(iistate->tid_cache, tup, &tup->t_self);
 
 			/* Update the progress information. */
-			SpinLockAcquire(&MyWorkerSlot->mutex);
-			MyWorkerSlot->progress.ins += 1;
-			SpinLockRelease(&MyWorkerSlot->mutex);
+			progress_add(&MyWorkerSlot->progress.ins, 1);
 		}
 		else if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW ||
 				 change->kind == PG_SQUEEZE_CHANGE_DELETE)
 		{
 			HeapTuple	tup_key;
-			IndexScanDesc scan;
-			int			i;
 			ItemPointerData ctid;
 
 			if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW)
@@ -359,7 +972,8 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 			}
 
 			/*
-			 * Find the tuple to be updated or deleted.
+			 * Find the tuple to be updated or deleted. If we inserted or
+			 * updated the row recently, the cache should know the location.
 			 *
 			 * XXX As no other transactions are engaged, SnapshotSelf might
 			 * seem to prevent us from wasting values of the command counter
@@ -367,42 +981,45 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 			 * the reason to increment the counter). However, heap_update()
 			 * does require CommandCounterIncrement().
 			 */
-			scan = index_beginscan(relation, iistate->ident_index,
-								   GetActiveSnapshot(), nkeys, 0);
+			if (!tid_cache_lookup(iistate->tid_cache, relation, tup_key,
+								  ind_slot, &ctid))
+			{
+				HeapTuple	tup_exist;
 
-			index_rescan(scan, key, nkeys, NULL, 0);
+				index_rescan(scan, key, nkeys, NULL, 0);
 
-			/* Use the incoming tuple to finalize the scan key. */
-			for (i = 0; i < scan->numberOfKeys; i++)
-			{
-				ScanKey		entry;
-				bool		isnull;
-				int16		attno_heap;
-
-				entry = &scan->keyData[i];
-				attno_heap = ident_indkey->values[i];
-				entry->sk_argument = heap_getattr(tup_key,
-												  attno_heap,
-												  relation->rd_att,
-												  &isnull);
-				Assert(!isnull);
-			}
-			if (index_getnext_slot(scan, ForwardScanDirection, ind_slot))
-			{
-				bool		shouldFreeInd;
+				/* Use the incoming tuple to finalize the scan key. */
+				for (int i = 0; i < scan->numberOfKeys; i++)
+				{
+					ScanKey		entry;
+					bool		isnull;
+					int16		attno_heap;
+
+					entry = &scan->keyData[i];
+					attno_heap = ident_indkey->values[i];
+					entry->sk_argument = heap_getattr(tup_key,
+													  attno_heap,
+													  relation->rd_att,
+													  &isnull);
+					Assert(!isnull);
+				}
+				if (index_getnext_slot(scan, ForwardScanDirection, ind_slot))
+				{
+					bool		shouldFreeInd;
 
-				tup_exist = ExecFetchSlotHeapTuple(ind_slot, false,
-												   &shouldFreeInd);
-				/* TTSOpsBufferHeapTuple has .get_heap_tuple != NULL. */
-				Assert(!shouldFreeInd);
-			}
-			else
-				tup_exist = NULL;
+					tup_exist = ExecFetchSlotHeapTuple(ind_slot, false,
+													   &shouldFreeInd);
+					/* TTSOpsBufferHeapTuple has .get_heap_tuple != NULL. */
+					Assert(!shouldFreeInd);
+				}
+				else
+					tup_exist = NULL;
 
-			if (tup_exist == NULL)
-				elog(ERROR, "Failed to find target tuple");
-			ItemPointerCopy(&tup_exist->t_self, &ctid);
-			index_endscan(scan);
+				if (tup_exist == NULL)
+					elog(ERROR, "Failed to find target tuple");
+				ItemPointerCopy(&tup_exist->t_self, &ctid);
+			}
+			ExecClearTuple(ind_slot);
 
 			if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW)
 			{
@@ -462,19 +1079,21 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 					list_free(recheck);
 				}
 
+				/* simple_heap_update() has set t_self. */
+				if (tup_old != NULL)
+					tid_cache_remove(iistate->tid_cache, tup_old);
+				tid_cache_store(iistate->tid_cache, tup, &tup->t_self);
+
 				/* Update the progress information. */
-				SpinLockAcquire(&MyWorkerSlot->mutex);
-				MyWorkerSlot->progress.upd += 1;
-				SpinLockRelease(&MyWorkerSlot->mutex);
+				progress_add(&MyWorkerSlot->progress.upd, 1);
 			}
 			else
 			{
 				simple_heap_delete(relation, &ctid);
+				tid_cache_remove(iistate->tid_cache, tup_key);
 
 				/* Update the progress information. */
-				SpinLockAcquire(&MyWorkerSlot->mutex);
-				MyWorkerSlot->progress.del += 1;
-				SpinLockRelease(&MyWorkerSlot->mutex);
+				progress_add(&MyWorkerSlot->progress.del, 1);
 			}
 
 			if (tup_old != NULL)
@@ -482,8 +1101,6 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 				pfree(tup_old);
 				tup_old = NULL;
 			}
-
-			pfree(tup);
 		}
 		else
 			elog(ERROR, "Unrecognized kind of change: %d", change->kind);
@@ -495,10 +1112,6 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 			UpdateActiveSnapshotCommandId();
 		}
 
-		/* TTSOpsMinimalTuple has .get_heap_tuple==NULL. */
-		Assert(shouldFree);
-		pfree(tup_change);
-
 		/*
 		 * If there is a limit on the time of completion, check it
 		 * now. However, make sure the loop does not break if tup_old was set
@@ -513,8 +1126,11 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 
 	/* If we could not apply all the changes, the next call will do. */
 	if (dstate->nchanges == 0)
-		tuplestore_clear(dstate->tstore);
+		change_buffer_reset(dstate->changes);
+	pgstat_progress_update_param(PROGRESS_SQUEEZE_CHANGES_PENDING,
+								 (int64) dstate->nchanges);
 
+	index_endscan(scan);
 	PopActiveSnapshot();
 
 	/* Cleanup. */
@@ -524,30 +1140,356 @@ apply_concurrent_changes(DecodingOutputState *dstate, Relation relation,
 	ExecDropSingleTupleTableSlot(ind_slot);
 }
 
+/*
+ * Check if the changes in the buffer can be passed to
+ * coalesce_concurrent_changes().
+ */
 static bool
-processing_time_elapsed(struct timeval *utmost)
+can_coalesce_changes(DecodingOutputState *dstate, IndexInsertState *iistate)
 {
-	struct timeval now;
+	ChangeBuffer *cb = dstate->changes;
+	ResultRelInfo *rri = iistate->rri;
 
-	if (utmost == NULL)
+	if (!squeeze_coalesce_changes || dstate->nchanges < 2)
 		return false;
 
-	gettimeofday(&now, NULL);
-
-	if (now.tv_sec < utmost->tv_sec)
+	/*
+	 * Changes of a partially applied batch must be applied in the order they
+	 * were decoded. Also only process changes that fit into memory.
+	 */
+	if (cb->reading || cb->file_size > 0)
 		return false;
 
-	if (now.tv_sec > utmost->tv_sec)
-		return true;
+	/*
+	 * The net changes are not applied in the original order, so a unique
+	 * index other than the identity index could report a conflict that did
+	 * not happen on the source table.
+	 */
+	for (int i = 0; i < rri->ri_NumIndices; i++)
+	{
+		Relation	ind = rri->ri_IndexRelationDescs[i];
 
-	return now.tv_usec >= utmost->tv_usec;
+		if (ind == iistate->ident_index)
+			continue;
+
+		if (ind->rd_index->indisunique ||
+			rri->ri_IndexRelationInfo[i]->ii_ExclusionOps != NULL)
+			return false;
+	}
+
+	return true;
 }
 
-IndexInsertState *
-get_index_insert_state(Relation relation, Oid ident_index_id)
+/*
+ * Compare the identity keys of two changes.
+ */
+static int
+coalesce_compare_keys(const CoalesceItem *a, const CoalesceItem *b,
+					  CoalesceState *state)
 {
-	EState	   *estate;
-	int			i;
+	for (int i = 0; i < state->nkeys; i++)
+	{
+		int			cmp;
+
+		cmp = ApplySortComparator(a->keys[i], false, b->keys[i], false,
+								  &state->ssup[i]);
+		if (cmp != 0)
+			return cmp;
+	}
+
+	return 0;
+}
+
+/*
+ * qsort_arg() comparator that sorts the changes by the identity key, and
+ * those of the same key in the order they were decoded.
+ */
+static int
+coalesce_item_cmp(const void *a, const void *b, void *arg)
+{
+	const CoalesceItem *item_a = (const CoalesceItem *) a;
+	const CoalesceItem *item_b = (const CoalesceItem *) b;
+	int			cmp;
+
+	cmp = coalesce_compare_keys(item_a, item_b, (CoalesceState *) arg);
+	if (cmp != 0)
+		return cmp;
+
+	if (item_a->pos < item_b->pos)
+		return -1;
+	return item_a->pos > item_b->pos ? 1 : 0;
+}
+
+/*
+ * Replace the changes in the buffer with their net effect per identity key:
+ *
+ * - INSERT followed by DELETE: nothing
+ * - INSERT followed by UPDATEs: INSERT of the final tuple
+ * - UPDATE or DELETE followed by anything but DELETE: UPDATE to the final
+ *	 tuple
+ * - UPDATE or DELETE followed by DELETE: DELETE
+ *
+ * Nothing is done if an UPDATE changed the identity key, because then the
+ * changes of the old and new key would have to be applied in the original
+ * order.
+ */
+static void
+coalesce_concurrent_changes(DecodingOutputState *dstate,
+							IndexInsertState *iistate)
+{
+	ChangeBuffer *cb = dstate->changes;
+	ChangeBuffer *cb_new;
+	Relation	ident_index = iistate->ident_index;
+	int2vector *ident_indkey = &ident_index->rd_index->indkey;
+	CoalesceState state;
+	CoalesceItem *items;
+	int			nitems = 0;
+	ConcurrentChange *change_old = NULL;
+	double		nchanges = 0;
+	MemoryContext coalesce_cxt,
+				old_cxt;
+
+	coalesce_cxt = AllocSetContextCreate(CurrentMemoryContext,
+										 "pg_squeeze coalesce cxt",
+										 ALLOCSET_DEFAULT_SIZES);
+	old_cxt = MemoryContextSwitchTo(coalesce_cxt);
+
+	state.nkeys = ident_index->rd_index->indnkeyatts;
+	state.ssup = (SortSupport) palloc0(state.nkeys * sizeof(SortSupportData));
+	for (int i = 0; i < state.nkeys; i++)
+	{
+		SortSupport ssup = &state.ssup[i];
+
+		ssup->ssup_cxt = coalesce_cxt;
+		ssup->ssup_collation = ident_index->rd_indcollation[i];
+		ssup->ssup_nulls_first = false;
+		/* The index attribute, as opposed to the table attribute. */
+		ssup->ssup_attno = i + 1;
+		ssup->abbreviate = false;
+		PrepareSortSupportFromIndexRel(ident_index, BTLessStrategyNumber,
+									   ssup);
+	}
+
+	items = (CoalesceItem *) MemoryContextAllocHuge(coalesce_cxt,
+													(Size) dstate->nchanges *
+													sizeof(CoalesceItem));
+
+	/* All the changes are in memory, see can_coalesce_changes(). */
+	for (Size pos = 0; pos < cb->used;)
+	{
+		ConcurrentChange *change;
+		CoalesceItem *item;
+
+		change = (ConcurrentChange *) (cb->data + pos);
+		change->tup_data.t_data = (HeapTupleHeader) ((char *) change +
+													 CHANGE_HEADER_SIZE);
+		pos += CHANGE_RECORD_SIZE(change->tup_data.t_len);
+
+		/* The next change is the new tuple. */
+		if (change->kind == PG_SQUEEZE_CHANGE_UPDATE_OLD)
+		{
+			change_old = change;
+			continue;
+		}
+
+		item = &items[nitems];
+		item->change = change;
+		item->pos = nitems;
+		item->keys = (Datum *) palloc(state.nkeys * sizeof(Datum));
+		for (int i = 0; i < state.nkeys; i++)
+		{
+			bool		isnull;
+
+			item->keys[i] = heap_getattr(&change->tup_data,
+										 ident_indkey->values[i],
+										 dstate->tupdesc, &isnull);
+			Assert(!isnull);
+		}
+
+		/*
+		 * If the old tuple is there due to REPLICA IDENTITY FULL, the key
+		 * could still be the same.
+		 */
+		if (change_old)
+		{
+			Assert(change->kind == PG_SQUEEZE_CHANGE_UPDATE_NEW);
+
+			for (int i = 0; i < state.nkeys; i++)
+			{
+				Datum		key_old;
+				bool		isnull;
+
+				key_old = heap_getattr(&change_old->tup_data,
+									   ident_indkey->values[i],
+									   dstate->tupdesc, &isnull);
+				Assert(!isnull);
+				if (ApplySortComparator(key_old, false, item->keys[i], false,
+										&state.ssup[i]) != 0)
+				{
+					elog(DEBUG1,
+						 "pg_squeeze: identity key changed, changes not coalesced");
+					MemoryContextSwitchTo(old_cxt);
+					MemoryContextDelete(coalesce_cxt);
+					return;
+				}
+			}
+			change_old = NULL;
+		}
+
+		nitems++;
+	}
+
+	qsort_arg(items, nitems, sizeof(CoalesceItem), coalesce_item_cmp,
+			  &state);
+
+	MemoryContextSwitchTo(cb->mcxt);
+	cb_new = change_buffer_begin(cb->max_size, cb->compression);
+	MemoryContextSwitchTo(coalesce_cxt);
+
+	for (int i = 0, j; i < nitems; i = j)
+	{
+		CoalesceItem *first = &items[i];
+		CoalesceItem *last;
+		ConcurrentChangeKind kind;
+		bool		existed;
+		Size		size;
+		char	   *dst;
+
+		for (j = i + 1; j < nitems; j++)
+		{
+			if (coalesce_compare_keys(&items[j], first, &state) != 0)
+				break;
+		}
+		last = &items[j - 1];
+
+		existed = first->change->kind != PG_SQUEEZE_CHANGE_INSERT;
+		if (last->change->kind == PG_SQUEEZE_CHANGE_DELETE)
+		{
+			if (!existed)
+				continue;
+			kind = PG_SQUEEZE_CHANGE_DELETE;
+		}
+		else
+			kind = existed ? PG_SQUEEZE_CHANGE_UPDATE_NEW :
+				PG_SQUEEZE_CHANGE_INSERT;
+
+		size = CHANGE_RECORD_SIZE(last->change->tup_data.t_len);
+		dst = change_buffer_alloc(cb_new, size);
+		memcpy(dst, last->change, size);
+		((ConcurrentChange *) dst)->kind = kind;
+		nchanges++;
+	}
+
+	elog(DEBUG1, "pg_squeeze: %.0f changes coalesced into %.0f",
+		 dstate->nchanges, nchanges);
+
+	MemoryContextSwitchTo(old_cxt);
+	MemoryContextDelete(coalesce_cxt);
+
+	change_buffer_end(cb);
+	dstate->changes = cb_new;
+	dstate->nchanges = nchanges;
+}
+
+/*
+ * Is 'record' a heap change that only affects storage other than that of
+ * the relation we're decoding?
+ *
+ * plugin_change() would discard such a change anyway, but only after the
+ * reorder buffer has reconstructed the tuple, kept it in memory (or spilled
+ * it to disk) and waited for the commit record. Records that don't have the
+ * storage in the first block reference are left alone, as well as those
+ * that the reorder buffer may need for other purposes (e.g. NEW_CID).
+ */
+static bool
+is_foreign_heap_record(XLogReaderState *record, DecodingOutputState *dstate)
+{
+	uint8		info = XLogRecGetInfo(record) & XLOG_HEAP_OPMASK;
+	RelFileLocator locator;
+
+	if (dstate == NULL || !dstate->filter_relfilenodes)
+		return false;
+
+	if (XLogRecGetRmid(record) == RM_HEAP_ID)
+	{
+		/*
+		 * XLOG_HEAP_CONFIRM must be skipped if the speculative insertion
+		 * was, otherwise the reorder buffer would complain about the missing
+		 * insertion.
+		 */
+		if (info != XLOG_HEAP_INSERT && info != XLOG_HEAP_UPDATE &&
+			info != XLOG_HEAP_HOT_UPDATE && info != XLOG_HEAP_DELETE &&
+			info != XLOG_HEAP_CONFIRM)
+			return false;
+	}
+	else if (XLogRecGetRmid(record) == RM_HEAP2_ID)
+	{
+		if (info != XLOG_HEAP2_MULTI_INSERT)
+			return false;
+	}
+	else
+		return false;
+
+	if (!XLogRecHasBlockRef(record, 0))
+		return false;
+
+	XLogRecGetBlockTag(record, 0, &locator, NULL, NULL);
+
+	return !RelFileLocatorEquals(locator, dstate->locator) &&
+		!RelFileLocatorEquals(locator, dstate->toast_locator);
+}
+
+/*
+ * Do the transaction bookkeeping that LogicalDecodingProcessRecord() would
+ * do for a heap record, but do not decode the tuple.
+ */
+static void
+skip_heap_record(LogicalDecodingContext *ctx, XLogReaderState *record)
+{
+	TransactionId xid = XLogRecGetXid(record);
+	XLogRecPtr	lsn = record->ReadRecPtr;
+#if PG_VERSION_NUM >= 140000
+	TransactionId top_xid = XLogRecGetTopXid(record);
+
+	if (TransactionIdIsValid(top_xid))
+		ReorderBufferAssignChild(ctx->reorder, top_xid, xid, lsn);
+#endif
+
+	ReorderBufferProcessXid(ctx->reorder, xid, lsn);
+
+	/*
+	 * Like heap_decode(), let the transaction get its base snapshot, so that
+	 * the slot's xmin is computed as if the change was decoded.
+	 */
+	if (SnapBuildCurrentState(ctx->snapshot_builder) >= SNAPBUILD_FULL_SNAPSHOT &&
+		!ctx->fast_forward)
+		SnapBuildProcessChange(ctx->snapshot_builder, xid, lsn);
+}
+
+static bool
+processing_time_elapsed(struct timeval *utmost)
+{
+	struct timeval now;
+
+	if (utmost == NULL)
+		return false;
+
+	gettimeofday(&now, NULL);
+
+	if (now.tv_sec < utmost->tv_sec)
+		return false;
+
+	if (now.tv_sec > utmost->tv_sec)
+		return true;
+
+	return now.tv_usec >= utmost->tv_usec;
+}
+
+IndexInsertState *
+get_index_insert_state(Relation relation, Oid ident_index_id)
+{
+	EState	   *estate;
+	int			i;
 	IndexInsertState *result;
 
 	result = (IndexInsertState *) palloc0(sizeof(IndexInsertState));
@@ -573,6 +1515,8 @@ get_index_insert_state(Relation relation, Oid ident_index_id)
 	if (result->ident_index == NULL)
 		elog(ERROR, "Failed to open identity index");
 
+	result->tid_cache = tid_cache_create(relation, result->ident_index);
+
 	/* Only initialize fields needed by ExecInsertIndexTuples(). */
 #if PG_VERSION_NUM < 140000
 	estate->es_result_relations = estate->es_result_relation_info =
@@ -587,12 +1531,226 @@ get_index_insert_state(Relation relation, Oid ident_index_id)
 void
 free_index_insert_state(IndexInsertState *iistate)
 {
+	tid_cache_free(iistate->tid_cache);
 	ExecCloseIndices(iistate->rri);
 	FreeExecutorState(iistate->estate);
 	pfree(iistate->rri);
 	pfree(iistate);
 }
 
+static TidCache *
+tid_cache_create(Relation relation, Relation ident_index)
+{
+	TidCache   *result;
+	Form_pg_index ind_form;
+
+	result = (TidCache *) palloc0(sizeof(TidCache));
+	result->mcxt = AllocSetContextCreate(CurrentMemoryContext,
+										 "TID cache",
+										 ALLOCSET_DEFAULT_SIZES);
+	result->tupdesc = RelationGetDescr(relation);
+
+	ind_form = ident_index->rd_index;
+	result->nkeys = ind_form->indnkeyatts;
+	result->attnos = (AttrNumber *) palloc(result->nkeys *
+										   sizeof(AttrNumber));
+	for (int i = 0; i < result->nkeys; i++)
+	{
+		/* The identity index should not contain expressions. */
+		Assert(ind_form->indkey.values[i] > 0);
+		result->attnos[i] = ind_form->indkey.values[i];
+	}
+	initStringInfo(&result->buf);
+
+	tid_cache_reset(result);
+
+	return result;
+}
+
+/*
+ * Remove all the entries.
+ */
+static void
+tid_cache_reset(TidCache *cache)
+{
+	HASHCTL		ctl;
+
+	/* This also deletes the hash table if it already exists. */
+	MemoryContextReset(cache->mcxt);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(TidCacheKey);
+	ctl.entrysize = sizeof(TidCacheEntry);
+	ctl.hash = tid_cache_hash;
+	ctl.match = tid_cache_match;
+	ctl.hcxt = cache->mcxt;
+	cache->htab = hash_create("TID cache", 1024, &ctl,
+							  HASH_ELEM | HASH_FUNCTION | HASH_COMPARE |
+							  HASH_CONTEXT);
+}
+
+static void
+tid_cache_free(TidCache *cache)
+{
+	MemoryContextDelete(cache->mcxt);
+	pfree(cache->attnos);
+	pfree(cache->buf.data);
+	pfree(cache);
+}
+
+static uint32
+tid_cache_hash(const void *key, Size keysize)
+{
+	const TidCacheKey *k = (const TidCacheKey *) key;
+
+	return DatumGetUInt32(hash_any((const unsigned char *) k->data,
+								   (int) k->len));
+}
+
+static int
+tid_cache_match(const void *key1, const void *key2, Size keysize)
+{
+	const TidCacheKey *k1 = (const TidCacheKey *) key1;
+	const TidCacheKey *k2 = (const TidCacheKey *) key2;
+
+	if (k1->len != k2->len)
+		return 1;
+	return memcmp(k1->data, k2->data, k1->len);
+}
+
+/*
+ * Serialize the identity key of a tuple into cache->buf.
+ *
+ * Returns false if the key cannot be used for the cache.
+ */
+static bool
+tid_cache_make_key(TidCache *cache, HeapTuple tup, TidCacheKey *key)
+{
+	StringInfo	buf = &cache->buf;
+
+	resetStringInfo(buf);
+	for (int i = 0; i < cache->nkeys; i++)
+	{
+		AttrNumber	attno = cache->attnos[i];
+		Form_pg_attribute att = TupleDescAttr(cache->tupdesc, attno - 1);
+		Datum		value;
+		bool		isnull;
+
+		value = heap_getattr(tup, attno, cache->tupdesc, &isnull);
+		/* The identity key should not contain NULLs, but be careful. */
+		if (isnull)
+			return false;
+
+		if (att->attbyval)
+			appendBinaryStringInfo(buf, (char *) &value, sizeof(Datum));
+		else if (att->attlen > 0)
+			appendBinaryStringInfo(buf, DatumGetPointer(value), att->attlen);
+		else if (att->attlen == -1)
+		{
+			struct varlena *val = (struct varlena *) DatumGetPointer(value);
+			struct varlena *val_plain;
+			int32		len;
+
+			/* Fetching the value from TOAST is not worth the effort. */
+			if (VARATT_IS_EXTERNAL(val))
+				return false;
+
+			/* Compressed and uncompressed values must get the same key. */
+			val_plain = pg_detoast_datum_packed(val);
+			len = VARSIZE_ANY_EXHDR(val_plain);
+			appendBinaryStringInfo(buf, (char *) &len, sizeof(len));
+			appendBinaryStringInfo(buf, VARDATA_ANY(val_plain), len);
+			if (val_plain != val)
+				pfree(val_plain);
+		}
+		else
+		{
+			char	   *str = DatumGetCString(value);
+
+			Assert(att->attlen == -2);
+			appendBinaryStringInfo(buf, str, strlen(str) + 1);
+		}
+	}
+
+	key->data = buf->data;
+	key->len = buf->len;
+	return true;
+}
+
+/*
+ * Find the location of the row identified by tup_key.
+ *
+ * If found, the row is stored in the slot.
+ */
+static bool
+tid_cache_lookup(TidCache *cache, Relation relation, HeapTuple tup_key,
+				 TupleTableSlot *slot, ItemPointer tid)
+{
+	TidCacheKey key;
+	TidCacheEntry *entry;
+
+	if (!tid_cache_make_key(cache, tup_key, &key))
+		return false;
+
+	entry = (TidCacheEntry *) hash_search(cache->htab, &key, HASH_FIND,
+										  NULL);
+	if (entry == NULL)
+		return false;
+
+	/* Make sure the entry is not stale. */
+	if (!table_tuple_fetch_row_version(relation, &entry->tid,
+									   GetActiveSnapshot(), slot))
+	{
+		tid_cache_remove(cache, tup_key);
+		return false;
+	}
+
+	ItemPointerCopy(&entry->tid, tid);
+	return true;
+}
+
+/*
+ * Remember that the current version of the row is located at tid.
+ */
+static void
+tid_cache_store(TidCache *cache, HeapTuple tup, ItemPointer tid)
+{
+	TidCacheKey key;
+	TidCacheEntry *entry;
+	bool		found;
+
+	if (!tid_cache_make_key(cache, tup, &key))
+		return;
+
+	if (hash_get_num_entries(cache->htab) >= TID_CACHE_MAX_ENTRIES)
+		tid_cache_reset(cache);
+
+	entry = (TidCacheEntry *) hash_search(cache->htab, &key, HASH_ENTER,
+										  &found);
+	if (!found)
+	{
+		/* So far the entry points to cache->buf. */
+		entry->key.data = MemoryContextAlloc(cache->mcxt, key.len);
+		memcpy(entry->key.data, key.data, key.len);
+	}
+	ItemPointerCopy(tid, &entry->tid);
+}
+
+static void
+tid_cache_remove(TidCache *cache, HeapTuple tup_key)
+{
+	TidCacheKey key;
+	TidCacheEntry *entry;
+
+	if (!tid_cache_make_key(cache, tup_key, &key))
+		return;
+
+	entry = (TidCacheEntry *) hash_search(cache->htab, &key, HASH_REMOVE,
+										  NULL);
+	if (entry != NULL)
+		pfree(entry->key.data);
+}
+
 void
 _PG_output_plugin_init(OutputPluginCallbacks *cb)
 {
@@ -747,22 +1905,31 @@ store_change(LogicalDecodingContext *ctx, ConcurrentChangeKind kind,
 			 HeapTuple tuple)
 {
 	DecodingOutputState *dstate;
-	char	   *change_raw;
 	ConcurrentChange *change;
-	MemoryContext oldcontext;
+	HeapTuple	tuple_key = NULL;
 	bool		flattened = false;
 	Size		size;
-	Datum		values[1];
-	bool		isnull[1];
-	char	   *dst;
 
 	dstate = (DecodingOutputState *) ctx->output_writer_private;
 
+	/*
+	 * Only the identity key of the old tuple is needed to apply the change,
+	 * so do not store the other columns. Do this before flattening so that
+	 * the TOASTed values of the other columns are not fetched.
+	 */
+	if (dstate->ident_attrs &&
+		(kind == PG_SQUEEZE_CHANGE_UPDATE_OLD ||
+		 kind == PG_SQUEEZE_CHANGE_DELETE))
+	{
+		tuple_key = form_identity_tuple(dstate, tuple);
+		tuple = tuple_key;
+	}
+
 	/*
 	 * ReorderBufferCommit() stores the TOAST chunks in its private memory
 	 * context and frees them after having called apply_change(). Therefore we
 	 * need flat copy (including TOAST) that we eventually copy into the
-	 * memory context which is available to decode_concurrent_changes().
+	 * buffer which is available to decode_concurrent_changes().
 	 */
 	if (HeapTupleHasExternal(tuple))
 	{
@@ -774,73 +1941,440 @@ store_change(LogicalDecodingContext *ctx, ConcurrentChangeKind kind,
 		flattened = true;
 	}
 
-	size = MAXALIGN(VARHDRSZ) + sizeof(ConcurrentChange) + tuple->t_len;
-	/* XXX Isn't there any function / macro to do this? */
-	if (size >= 0x3FFFFFFF)
-		elog(ERROR, "Change is too big.");
-
-	oldcontext = MemoryContextSwitchTo(ctx->context);
-	change_raw = (char *) palloc(size);
-	MemoryContextSwitchTo(oldcontext);
+	if (dstate->mqh != NULL)
+	{
+		ConcurrentChange change_hdr;
 
-	SET_VARSIZE(change_raw, size);
-	change = (ConcurrentChange *) VARDATA(change_raw);
+		change_hdr.kind = kind;
+		memcpy(&change_hdr.tup_data, tuple, sizeof(HeapTupleData));
+		send_change(dstate, &change_hdr, tuple);
+	}
+	else
+	{
+		size = CHANGE_RECORD_SIZE(tuple->t_len);
+		change = (ConcurrentChange *) change_buffer_alloc(dstate->changes,
+														  size);
 
-	/*
-	 * Copy the tuple.
-	 *
-	 * CAUTION: change->tup_data.t_data must be fixed on retrieval!
-	 */
-	memcpy(&change->tup_data, tuple, sizeof(HeapTupleData));
-	dst = (char *) change + sizeof(ConcurrentChange);
-	memcpy(dst, tuple->t_data, tuple->t_len);
+		/*
+		 * Copy the tuple. t_data is set when the change is retrieved.
+		 */
+		change->kind = kind;
+		memcpy(&change->tup_data, tuple, sizeof(HeapTupleData));
+		memcpy((char *) change + CHANGE_HEADER_SIZE, tuple->t_data,
+			   tuple->t_len);
 
-	/* The other field. */
-	change->kind = kind;
+		/* Accounting. */
+		dstate->nchanges++;
+	}
 
 	/* The data has been copied. */
 	if (flattened)
 		pfree(tuple);
+	if (tuple_key)
+		heap_freetuple(tuple_key);
+}
+
+/*
+ * Return a copy of the tuple in which all the columns except for the
+ * identity key are NULL.
+ */
+static HeapTuple
+form_identity_tuple(DecodingOutputState *dstate, HeapTuple tuple)
+{
+	TupleDesc	desc = dstate->tupdesc;
+	Datum	   *values;
+	bool	   *isnull;
+	HeapTuple	result;
 
-	/* Store as tuple of 1 bytea column. */
-	values[0] = PointerGetDatum(change_raw);
-	isnull[0] = false;
-	tuplestore_putvalues(dstate->tstore, dstate->tupdesc_change,
-						 values, isnull);
+	values = (Datum *) palloc(desc->natts * sizeof(Datum));
+	isnull = (bool *) palloc(desc->natts * sizeof(bool));
+	heap_deform_tuple(tuple, desc, values, isnull);
+	for (int i = 0; i < desc->natts; i++)
+	{
+		if (!bms_is_member(i + 1, dstate->ident_attrs))
+			isnull[i] = true;
+	}
+	result = heap_form_tuple(desc, values, isnull);
+	result->t_self = tuple->t_self;
+	result->t_tableOid = tuple->t_tableOid;
 
-	/* Accounting. */
-	dstate->nchanges++;
+	pfree(values);
+	pfree(isnull);
 
-	/* Cleanup. */
-	pfree(change_raw);
+	return result;
 }
 
 /*
- * Retrieve tuple from a change structure. As for the change, no alignment is
- * assumed.
+ * Send the change to the squeeze worker. The message consists of the change
+ * header, immediately followed by the tuple data.
  */
-static HeapTuple
-get_changed_tuple(ConcurrentChange *change)
+static void
+send_change(DecodingOutputState *dstate, ConcurrentChange *change,
+			HeapTuple tuple)
 {
-	HeapTupleData tup_data;
-	HeapTuple	result;
-	char	   *src;
+	shm_mq_iovec iov[2];
+	shm_mq_result res;
 
-	/*
-	 * Ensure alignment before accessing the fields. (This is why we can't use
-	 * heap_copytuple() instead of this function.)
-	 */
-	memcpy(&tup_data, &change->tup_data, sizeof(HeapTupleData));
+	iov[0].data = (char *) change;
+	iov[0].len = sizeof(ConcurrentChange);
+	iov[1].data = (char *) tuple->t_data;
+	iov[1].len = tuple->t_len;
+
+	res = shm_mq_sendv(dstate->mqh, iov, 2, false
+#if PG_VERSION_NUM >= 150000
+					   , true	/* force_flush */
+#endif
+		);
+	if (res != SHM_MQ_SUCCESS)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("the squeeze worker is no longer receiving the changes")));
+}
+
+/*
+ * Initialize an empty ChangeBuffer in the current memory context. Once the
+ * changes occupy max_size bytes, they are written to disk, using the given
+ * compression method.
+ */
+ChangeBuffer *
+change_buffer_begin(Size max_size, SpillCompression compression)
+{
+	ChangeBuffer *cb;
+
+	cb = (ChangeBuffer *) palloc0(sizeof(ChangeBuffer));
+	cb->mcxt = CurrentMemoryContext;
+	cb->compression = compression;
+	cb->max_size = Max(max_size, CHANGE_BUFFER_MIN_SIZE);
+	cb->size = CHANGE_BUFFER_MIN_SIZE;
+	cb->data = (char *) palloc(cb->size);
+
+	return cb;
+}
+
+void
+change_buffer_end(ChangeBuffer *cb)
+{
+	if (cb->file)
+		BufFileClose(cb->file);
+	if (cb->read_buf)
+		pfree(cb->read_buf);
+	if (cb->comp_buf)
+		pfree(cb->comp_buf);
+	pfree(cb->data);
+	pfree(cb);
+}
+
+/*
+ * Reserve space for a record of given size at the end of the buffer.
+ */
+static char *
+change_buffer_alloc(ChangeBuffer *cb, Size size)
+{
+	char	   *result;
+
+	/* The caller should have read all the changes. */
+	Assert(!cb->reading);
+
+	if (cb->used > 0 && cb->used + size > cb->max_size)
+		change_buffer_spill(cb);
+
+	if (cb->used + size > cb->size)
+	{
+		Size		size_new;
 
-	result = (HeapTuple) palloc(HEAPTUPLESIZE + tup_data.t_len);
-	memcpy(result, &tup_data, sizeof(HeapTupleData));
-	result->t_data = (HeapTupleHeader) ((char *) result + HEAPTUPLESIZE);
-	src = (char *) change + sizeof(ConcurrentChange);
-	memcpy(result->t_data, src, result->t_len);
+		/*
+		 * Do not exceed max_size, unless a single record is bigger than
+		 * that.
+		 */
+		size_new = Max(cb->size * 2, cb->used + size);
+		size_new = Min(size_new, Max(cb->max_size, cb->used + size));
+		cb->data = (char *) repalloc_huge(cb->data, size_new);
+		cb->size = size_new;
+	}
+
+	result = cb->data + cb->used;
+	cb->used += size;
 
 	return result;
 }
 
+/*
+ * Append the records in the arena to the file and make the arena empty.
+ */
+static void
+change_buffer_spill(ChangeBuffer *cb)
+{
+	if (cb->file == NULL)
+	{
+		MemoryContext old_cxt;
+
+		old_cxt = MemoryContextSwitchTo(cb->mcxt);
+		cb->file = BufFileCreateTemp(false);
+		MemoryContextSwitchTo(old_cxt);
+	}
+
+	/* Reading might have moved the position. */
+	if (BufFileSeek(cb->file, 0, cb->file_size, SEEK_SET) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in the file of decoded changes: %m")));
+
+	if (cb->compression == SPILL_COMPRESSION_OFF)
+		change_buffer_write(cb, cb->data, cb->used);
+	else
+	{
+		Size		start = 0;
+		Size		pos = 0;
+
+		/*
+		 * Compress the arena in chunks so that the reader does not need to
+		 * allocate memory for all of it. The chunks only contain whole
+		 * records.
+		 */
+		while (pos < cb->used)
+		{
+			ConcurrentChange *change;
+
+			change = (ConcurrentChange *) (cb->data + pos);
+			pos += CHANGE_RECORD_SIZE(change->tup_data.t_len);
+			if (pos - start >= CHANGE_CHUNK_SIZE || pos == cb->used)
+			{
+				change_buffer_write_chunk(cb, cb->data + start, pos - start);
+				start = pos;
+			}
+		}
+	}
+	cb->used = 0;
+}
+
+/*
+ * Compress a chunk of records and write it to the file. If the compression
+ * does not save space, the chunk is written as it is.
+ */
+static void
+change_buffer_write_chunk(ChangeBuffer *cb, char *data, Size size)
+{
+	ChangeChunkHeader hdr;
+	int32		compsize = -1;
+
+	switch (cb->compression)
+	{
+		case SPILL_COMPRESSION_PGLZ:
+			change_buffer_reserve(&cb->comp_buf, &cb->comp_buf_size,
+								  PGLZ_MAX_OUTPUT(size), cb->mcxt);
+			compsize = pglz_compress(data, size, cb->comp_buf,
+									 PGLZ_strategy_default);
+			break;
+#ifdef USE_LZ4
+		case SPILL_COMPRESSION_LZ4:
+			change_buffer_reserve(&cb->comp_buf, &cb->comp_buf_size,
+								  LZ4_compressBound(size), cb->mcxt);
+			compsize = LZ4_compress_default(data, cb->comp_buf, size,
+											cb->comp_buf_size);
+			if (compsize == 0)
+				compsize = -1;
+			break;
+#endif
+		default:
+			elog(ERROR, "unrecognized compression method: %d",
+				 cb->compression);
+	}
+
+	hdr.rawsize = size;
+	if (compsize >= 0 && (Size) compsize < size)
+	{
+		hdr.compsize = compsize;
+		change_buffer_write(cb, &hdr, sizeof(hdr));
+		change_buffer_write(cb, cb->comp_buf, compsize);
+	}
+	else
+	{
+		hdr.compsize = size;
+		change_buffer_write(cb, &hdr, sizeof(hdr));
+		change_buffer_write(cb, data, size);
+	}
+}
+
+/*
+ * Write data at the current position of the file.
+ */
+static void
+change_buffer_write(ChangeBuffer *cb, void *ptr, Size size)
+{
+#if PG_VERSION_NUM >= 130000
+	BufFileWrite(cb->file, ptr, size);
+#else
+	if (BufFileWrite(cb->file, ptr, size) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to the file of decoded changes: %m")));
+#endif
+	cb->file_size += size;
+	if (MyWorkerSlot)
+		progress_add(&MyWorkerSlot->progress.change_spill, size);
+}
+
+/*
+ * Return the next change, or NULL if all the changes have been read. The
+ * change (including the tuple data) is only valid until the next call.
+ */
+static ConcurrentChange *
+change_buffer_next(ChangeBuffer *cb)
+{
+	ConcurrentChange *change;
+
+	if (!cb->reading)
+	{
+		cb->reading = true;
+		cb->file_pos = 0;
+		cb->data_pos = 0;
+		cb->read_pos = 0;
+		cb->read_len = 0;
+		if (cb->file &&
+			BufFileSeek(cb->file, 0, 0, SEEK_SET) != 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not seek in the file of decoded changes: %m")));
+	}
+
+	/* Compressed file is read by whole chunks. */
+	if (cb->compression != SPILL_COMPRESSION_OFF &&
+		cb->read_pos >= cb->read_len && cb->file_pos < cb->file_size)
+		change_buffer_read_chunk(cb);
+
+	if (cb->read_pos < cb->read_len)
+	{
+		change = (ConcurrentChange *) (cb->read_buf + cb->read_pos);
+		cb->read_pos += CHANGE_RECORD_SIZE(change->tup_data.t_len);
+	}
+	else if (cb->file_pos < cb->file_size)
+	{
+		Size		size;
+
+		/* Read the header first so we know the size of the record. */
+		change_buffer_reserve(&cb->read_buf, &cb->read_buf_size,
+							  CHANGE_HEADER_SIZE, cb->mcxt);
+		change_buffer_read(cb, cb->read_buf, CHANGE_HEADER_SIZE);
+		change = (ConcurrentChange *) cb->read_buf;
+		size = CHANGE_RECORD_SIZE(change->tup_data.t_len);
+		change_buffer_reserve(&cb->read_buf, &cb->read_buf_size, size,
+							  cb->mcxt);
+		change = (ConcurrentChange *) cb->read_buf;
+		change_buffer_read(cb, cb->read_buf + CHANGE_HEADER_SIZE,
+						   size - CHANGE_HEADER_SIZE);
+	}
+	else if (cb->data_pos < cb->used)
+	{
+		change = (ConcurrentChange *) (cb->data + cb->data_pos);
+		cb->data_pos += CHANGE_RECORD_SIZE(change->tup_data.t_len);
+	}
+	else
+	{
+		change_buffer_reset(cb);
+		return NULL;
+	}
+
+	change->tup_data.t_data = (HeapTupleHeader) ((char *) change +
+												 CHANGE_HEADER_SIZE);
+	return change;
+}
+
+/*
+ * Read the next chunk of the compressed file into read_buf.
+ */
+static void
+change_buffer_read_chunk(ChangeBuffer *cb)
+{
+	ChangeChunkHeader hdr;
+
+	change_buffer_read(cb, &hdr, sizeof(hdr));
+	change_buffer_reserve(&cb->read_buf, &cb->read_buf_size, hdr.rawsize,
+						  cb->mcxt);
+	if (hdr.compsize == hdr.rawsize)
+		change_buffer_read(cb, cb->read_buf, hdr.rawsize);
+	else
+	{
+		int32		rawsize = -1;
+
+		change_buffer_reserve(&cb->comp_buf, &cb->comp_buf_size,
+							  hdr.compsize, cb->mcxt);
+		change_buffer_read(cb, cb->comp_buf, hdr.compsize);
+
+		switch (cb->compression)
+		{
+			case SPILL_COMPRESSION_PGLZ:
+				rawsize = pglz_decompress(cb->comp_buf, hdr.compsize,
+										  cb->read_buf, hdr.rawsize, true);
+				break;
+#ifdef USE_LZ4
+			case SPILL_COMPRESSION_LZ4:
+				rawsize = LZ4_decompress_safe(cb->comp_buf, cb->read_buf,
+											  hdr.compsize, hdr.rawsize);
+				break;
+#endif
+			default:
+				elog(ERROR, "unrecognized compression method: %d",
+					 cb->compression);
+		}
+		if (rawsize != hdr.rawsize)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATA_CORRUPTED),
+					 errmsg("compressed data of decoded changes is corrupt")));
+	}
+	cb->read_pos = 0;
+	cb->read_len = hdr.rawsize;
+}
+
+/*
+ * Read data from the current position of the file.
+ */
+static void
+change_buffer_read(ChangeBuffer *cb, void *ptr, Size size)
+{
+#if PG_VERSION_NUM >= 160000
+	BufFileReadExact(cb->file, ptr, size);
+#else
+	if (BufFileRead(cb->file, ptr, size) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from the file of decoded changes: %m")));
+#endif
+	cb->file_pos += size;
+}
+
+/*
+ * Make sure that the buffer has at least 'size' bytes. The contents is
+ * preserved.
+ */
+static void
+change_buffer_reserve(char **buf, Size *buf_size, Size size,
+					  MemoryContext mcxt)
+{
+	if (*buf == NULL)
+	{
+		*buf_size = Max(size, CHANGE_BUFFER_MIN_SIZE);
+		*buf = (char *) MemoryContextAllocHuge(mcxt, *buf_size);
+	}
+	else if (size > *buf_size)
+	{
+		*buf = (char *) repalloc_huge(*buf, size);
+		*buf_size = size;
+	}
+}
+
+/*
+ * Discard all the changes.
+ */
+static void
+change_buffer_reset(ChangeBuffer *cb)
+{
+	cb->used = 0;
+	cb->file_size = 0;
+	cb->reading = false;
+	cb->read_pos = 0;
+	cb->read_len = 0;
+}
+
 /*
  * A filter that recognizes changes produced by the initial load.
  */
@@ -851,10 +2385,19 @@ plugin_filter(LogicalDecodingContext *ctx, RepOriginId origin_id)
 
 	dstate = (DecodingOutputState *) ctx->output_writer_private;
 
+	if (origin_id == InvalidRepOriginId)
+		return false;
+
 	/* dstate is not initialized during decoding setup - should it be? */
 	if (dstate && dstate->rorigin != InvalidRepOriginId &&
 		origin_id == dstate->rorigin)
 		return true;
 
-	return false;
+	/*
+	 * Other squeeze workers of the same database write their transient
+	 * tables, which we'd only waste memory and disk space for in the reorder
+	 * buffer. (Their changes of catalogs are not lost by filtering because
+	 * ReorderBufferForget() still executes the invalidations.)
+	 */
+	return is_worker_origin(origin_id, ctx->reader->ReadRecPtr);
 }
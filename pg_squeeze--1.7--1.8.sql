@@ -0,0 +1,609 @@
+/* pg_squeeze--1.7--1.8.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION pg_squeeze UPDATE TO '1.8'" to load this file. \quit
+
+ALTER TABLE tables ADD COLUMN initial_load_workers int NOT NULL DEFAULT 0
+	CHECK (initial_load_workers >= 0);
+COMMENT ON COLUMN tables.initial_load_workers IS
+	'The number of parallel workers to copy the table data during the '
+	'initial load (limited by squeeze.max_initial_load_workers).';
+
+ALTER TABLE tables ADD COLUMN sample_blocks int CHECK (sample_blocks > 0);
+ALTER TABLE tables ADD COLUMN sample_percent real
+	CHECK (sample_percent > 0.0 AND sample_percent <= 100.0);
+ALTER TABLE tables ADD CHECK (sample_blocks ISNULL OR sample_percent ISNULL);
+COMMENT ON COLUMN tables.sample_blocks IS
+	'If set, estimate the free space from a random sample of this many '
+	'blocks rather than by scanning the table.';
+COMMENT ON COLUMN tables.sample_percent IS
+	'If set, estimate the free space from a random sample of this '
+	'percentage of the table blocks rather than by scanning the table.';
+
+CREATE FUNCTION pgstattuple_sample(IN reloid regclass,
+    IN sample_blocks int,               -- the number of blocks to examine
+    IN threshold float8 DEFAULT NULL,   -- stop early if clearly above / below
+    OUT table_len BIGINT,               -- physical table length in bytes
+    OUT scanned_percent FLOAT8,         -- what percentage of the table's pages was examined
+    OUT dead_tuple_percent FLOAT8,      -- dead tuples in % (estimate)
+    OUT free_percent FLOAT8,            -- free space in % (estimate)
+    OUT error_percent FLOAT8)           -- error bound of free + dead space in %
+AS 'MODULE_PATHNAME', 'squeeze_pgstattuple_sample'
+LANGUAGE C PARALLEL SAFE;
+
+CREATE FUNCTION get_heap_freespace(a_relid oid, a_sample_percent real)
+RETURNS double precision
+AS 'MODULE_PATHNAME', 'get_heap_freespace'
+VOLATILE
+LANGUAGE C;
+
+-- Tasks of partitioned tables are created per leaf partition.
+ALTER TABLE tasks ADD COLUMN partschema name;
+ALTER TABLE tasks ADD COLUMN partname name;
+ALTER TABLE tasks ADD CHECK ((partschema ISNULL) = (partname ISNULL));
+COMMENT ON COLUMN tasks.partschema IS
+	'Database schema of the leaf partition to process, if the registered '
+	'table is partitioned.';
+COMMENT ON COLUMN tasks.partname IS
+	'Leaf partition to process, if the registered table is partitioned.';
+
+-- The OID of the table to process is looked up when the task is created, so
+-- that the views below need not join pg_class by name.
+ALTER TABLE tasks ADD COLUMN relid oid;
+UPDATE tasks k
+SET	relid = c.oid
+FROM	tables t, pg_catalog.pg_class c, pg_catalog.pg_namespace n
+WHERE	k.table_id = t.id AND n.nspname = t.tabschema AND
+	c.relname = t.tabname AND c.relnamespace = n.oid;
+COMMENT ON COLUMN tasks.relid IS
+	'OID of the table to process.';
+
+-- The table that each task should process, i.e. either the registered table
+-- or one of its leaf partitions. For the latter, clustering_index is the
+-- partition of the index specified in squeeze.tables.
+CREATE VIEW task_tables AS
+	SELECT	k.id AS task_id, c.oid AS relid, n.nspname AS tabschema,
+		c.relname AS tabname,
+		CASE WHEN k.partname ISNULL THEN t.clustering_index
+		ELSE (
+			SELECT	ic.relname
+			FROM	pg_catalog.pg_index x,
+				pg_catalog.pg_class ic,
+				pg_catalog.pg_partition_ancestors(x.indexrelid) a,
+				pg_catalog.pg_class pic,
+				pg_catalog.pg_namespace pin
+			WHERE	x.indrelid = c.oid AND ic.oid = x.indexrelid AND
+				pic.oid = a.relid AND
+				pic.relname = t.clustering_index AND
+				pic.relnamespace = pin.oid AND
+				pin.nspname = t.tabschema)
+		END AS clustering_index
+	FROM	squeeze.tasks k,
+		squeeze.tables t,
+		pg_catalog.pg_class c,
+		pg_catalog.pg_namespace n
+	WHERE	k.table_id = t.id AND c.oid = k.relid AND
+		c.relnamespace = n.oid;
+
+-- pg_stat_user_tables does not always contain partitioned tables.
+CREATE OR REPLACE VIEW scheduled_for_now AS
+	SELECT	i.table_id, t.tabschema, t.tabname
+	FROM	squeeze.tables_internal i,
+		squeeze.tables t,
+		pg_class c, pg_namespace n
+	WHERE
+		i.table_id = t.id AND
+		n.nspname = t.tabschema AND c.relnamespace = n.oid AND
+		c.relname = t.tabname AND c.relkind IN ('r', 'p') AND
+		(
+			((t.schedule).minutes ISNULL OR
+			EXTRACT(minute FROM now())::int = ANY((t.schedule).minutes))
+			AND
+			((t.schedule).hours ISNULL OR
+			EXTRACT(hour FROM now())::int = ANY((t.schedule).hours))
+			AND
+			((t.schedule).months ISNULL OR
+			EXTRACT(month FROM now())::int = ANY((t.schedule).months))
+			AND
+			(
+				-- At least one of the "days_of_month" and
+				-- "days_of_week" components must
+				-- match. However if one matches, NULL value
+				-- of the other must not be considered "any
+				-- day of month/week". Instead, NULL can only
+				-- cause a match if both components have it.
+				((t.schedule).days_of_month ISNULL AND
+				(t.schedule).days_of_week ISNULL)
+				OR
+				EXTRACT(day FROM now())::int = ANY((t.schedule).days_of_month)
+				OR
+				EXTRACT(dow FROM now())::int = ANY((t.schedule).days_of_week)
+				OR
+				-- Sunday can be expressed as both 0 and 7.
+				EXTRACT(isodow FROM now())::int = ANY((t.schedule).days_of_week)
+			)
+		);
+
+-- The first time not earlier than a_from (truncated to minutes) at which
+-- the schedule matches, see the scheduled_for_now view. The time zone of the
+-- session applies.
+CREATE FUNCTION next_check_time(a_schedule schedule, a_from timestamptz)
+RETURNS timestamptz
+LANGUAGE plpgsql
+STABLE
+AS $$
+DECLARE
+	v_day		date;
+	v_min_time	time;
+	v_time		time;
+BEGIN
+	v_day := date_trunc('minute', a_from)::date;
+	v_min_time := date_trunc('minute', a_from)::time;
+
+	-- If the schedule can match at all, a matching day occurs within 8
+	-- years. (That's the longest distance between two February 29th.)
+	FOR i IN 0 .. 8 * 366 LOOP
+		IF ((a_schedule).months ISNULL OR
+			EXTRACT(month FROM v_day)::int = ANY((a_schedule).months))
+			AND
+			(
+				((a_schedule).days_of_month ISNULL AND
+				(a_schedule).days_of_week ISNULL)
+				OR
+				EXTRACT(day FROM v_day)::int = ANY((a_schedule).days_of_month)
+				OR
+				EXTRACT(dow FROM v_day)::int = ANY((a_schedule).days_of_week)
+				OR
+				EXTRACT(isodow FROM v_day)::int = ANY((a_schedule).days_of_week)
+			)
+		THEN
+			SELECT	min(make_time(h, m, 0))
+			INTO	v_time
+			FROM	unnest(coalesce((a_schedule).hours::int[],
+					ARRAY(SELECT generate_series(0, 23)))) h,
+				unnest(coalesce((a_schedule).minutes::int[],
+					ARRAY(SELECT generate_series(0, 59)))) m
+			WHERE	make_time(h, m, 0) >= v_min_time;
+
+			IF v_time NOTNULL THEN
+				RETURN v_day + v_time;
+			END IF;
+		END IF;
+
+		v_day := v_day + 1;
+		v_min_time := time '00:00';
+	END LOOP;
+
+	-- The schedule never matches, e.g. February 30th.
+	RETURN timestamptz 'infinity';
+END;
+$$;
+
+-- When the schedule of the table should be checked next time. NULL means
+-- that it's not known yet: check_schedule() computes it, so that the time
+-- zone of the scheduler worker applies.
+ALTER TABLE tables_internal ADD COLUMN next_check timestamptz;
+-- The OID of the table at the time of the last check.
+ALTER TABLE tables_internal ADD COLUMN relid oid;
+-- Only the tables whose check is due should be visited.
+CREATE INDEX ON tables_internal(next_check);
+
+CREATE OR REPLACE FUNCTION tables_internal_trig_func()
+RETURNS trigger
+LANGUAGE plpgsql
+AS $$
+BEGIN
+	IF TG_OP = 'INSERT' THEN
+		INSERT INTO squeeze.tables_internal(table_id)
+		VALUES (NEW.id);
+	ELSIF NEW.schedule IS DISTINCT FROM OLD.schedule THEN
+		UPDATE squeeze.tables_internal
+		SET	next_check = NULL
+		WHERE	table_id = NEW.id;
+	END IF;
+
+	RETURN NEW;
+END;
+$$;
+
+CREATE TRIGGER tables_internal_upd_trig AFTER UPDATE OF schedule
+ON squeeze.tables
+FOR EACH ROW
+EXECUTE PROCEDURE squeeze.tables_internal_trig_func();
+
+-- Let the scheduler worker check the tables and tasks as soon as the
+-- current transaction commits.
+CREATE FUNCTION wake_scheduler()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'squeeze_wake_scheduler'
+LANGUAGE C;
+
+CREATE TRIGGER tables_wake_scheduler AFTER INSERT OR UPDATE OR DELETE
+ON squeeze.tables
+FOR EACH STATEMENT
+EXECUTE PROCEDURE squeeze.wake_scheduler();
+
+CREATE TRIGGER tasks_wake_scheduler AFTER INSERT OR UPDATE OR DELETE
+ON squeeze.tasks
+FOR EACH STATEMENT
+EXECUTE PROCEDURE squeeze.wake_scheduler();
+
+CREATE OR REPLACE FUNCTION check_schedule() RETURNS void
+LANGUAGE sql
+AS $$
+	-- Delete the processed tasks. The next check of their tables has
+	-- already been moved past the current minute, so the tables won't be
+	-- scheduled again now.
+	DELETE FROM squeeze.tasks t
+	WHERE	state = 'processed';
+
+	-- Find out when the tables registered or rescheduled since the last
+	-- run should be checked.
+	UPDATE	squeeze.tables_internal i
+	SET	next_check = squeeze.next_check_time(t.schedule, now())
+	FROM	squeeze.tables t
+	WHERE	i.table_id = t.id AND i.next_check ISNULL;
+
+	-- Look up the tables due for the check. The table could have been
+	-- dropped, renamed or replaced since the last check, so do not rely on
+	-- the previous OID.
+	UPDATE	squeeze.tables_internal i
+	SET	relid = pg_catalog.to_regclass(
+			pg_catalog.format('%I.%I', t.tabschema, t.tabname))
+	FROM	squeeze.tables t
+	WHERE	i.table_id = t.id AND i.next_check <= now();
+
+	-- Create the tasks.
+	INSERT INTO squeeze.tasks(table_id, relid)
+	SELECT	i.table_id, i.relid
+	FROM	squeeze.tables_internal i,
+		pg_catalog.pg_class c
+	WHERE
+		i.next_check <= now() AND c.oid = i.relid AND c.relkind = 'r'
+		-- Ignore tables for which a task currently exists.
+		AND NOT i.table_id IN (SELECT table_id FROM squeeze.tasks);
+
+	-- For a partitioned table, create one task per leaf partition. No new
+	-- tasks are created until all the partitions have been processed.
+	INSERT INTO squeeze.tasks(table_id, partschema, partname, relid)
+	SELECT	i.table_id, pn.nspname, pc.relname, pc.oid
+	FROM	squeeze.tables_internal i,
+		pg_catalog.pg_class c,
+		pg_catalog.pg_partition_tree(c.oid) p,
+		pg_catalog.pg_class pc, pg_catalog.pg_namespace pn
+	WHERE
+		i.next_check <= now() AND c.oid = i.relid AND c.relkind = 'p' AND
+		p.isleaf AND pc.oid = p.relid AND pc.relkind = 'r' AND
+		pc.relnamespace = pn.oid
+		AND NOT i.table_id IN (SELECT table_id FROM squeeze.tasks);
+
+	-- The next check should not take place in the current minute.
+	UPDATE	squeeze.tables_internal i
+	SET	next_check = squeeze.next_check_time(t.schedule,
+						     now() + interval '1 minute')
+	FROM	squeeze.tables t
+	WHERE	i.table_id = t.id AND i.next_check <= now();
+$$;
+
+CREATE OR REPLACE FUNCTION update_free_space_info() RETURNS void
+LANGUAGE sql
+AS $$
+	-- If VACUUM completed recenly enough, we consider the percentage of
+	-- dead tuples negligible and so retrieve the free space from FSM.
+	--
+	-- If the table should be sampled, only sample the FSM too.
+	UPDATE squeeze.tasks k
+	SET	free_space = 100 * squeeze.get_heap_freespace(
+			tt.relid,
+			CASE WHEN t.sample_blocks NOTNULL THEN
+				least(100.0 * t.sample_blocks /
+					  greatest(pg_catalog.pg_relation_size(tt.relid, 'main') /
+							   current_setting('block_size')::int, 1),
+					  100)
+			ELSE t.sample_percent
+			END::real)
+	FROM	squeeze.tables t,
+		squeeze.tables_internal i,
+		squeeze.task_tables tt,
+		pg_catalog.pg_stat_user_tables s
+	WHERE	k.state = 'new' AND k.table_id = t.id AND i.table_id = t.id
+		AND tt.task_id = k.id AND s.relid = tt.relid AND
+		(
+			(s.last_vacuum >= now() - t.vacuum_max_age)
+			OR
+			(s.last_autovacuum >= now() - t.vacuum_max_age)
+		)
+		AND
+		-- Each processing makes the previous VACUUM unimportant.
+		(
+			i.last_task_finished ISNULL
+			OR
+			i.last_task_finished < s.last_vacuum
+			OR
+			i.last_task_finished < s.last_autovacuum
+		);
+
+	-- If VACUUM didn't run recently or there's no FSM, take the more
+	-- expensive approach.
+	UPDATE	squeeze.tasks k
+	SET	free_space = a.approx_free_percent + a.dead_tuple_percent
+	FROM	squeeze.tables t,
+		squeeze.task_tables tt,
+		squeeze.pgstattuple_approx(tt.relid) a
+	WHERE	k.state = 'new' AND k.free_space ISNULL AND
+		k.table_id = t.id AND tt.task_id = k.id AND
+		t.sample_blocks ISNULL AND t.sample_percent ISNULL;
+
+	-- The same for tables that should only be sampled. The sampling can
+	-- stop as soon as it's clear which side of the threshold used by
+	-- dispatch_new_tasks() the table is on.
+	UPDATE	squeeze.tasks k
+	SET	free_space = a.free_percent + a.dead_tuple_percent
+	FROM	squeeze.tables t,
+		squeeze.task_tables tt,
+		squeeze.pgstattuple_sample(
+			tt.relid,
+			coalesce(
+				t.sample_blocks,
+				greatest(
+					ceil(pg_catalog.pg_relation_size(tt.relid, 'main') /
+						 current_setting('block_size')::int *
+						 t.sample_percent / 100),
+					1)::int),
+			(100 - squeeze.get_heap_fillfactor(tt.relid)) + t.free_space_extra) a
+	WHERE	k.state = 'new' AND k.free_space ISNULL AND
+		k.table_id = t.id AND tt.task_id = k.id AND
+		(t.sample_blocks NOTNULL OR t.sample_percent NOTNULL);
+$$;
+
+ALTER TABLE tables ADD COLUMN deadline interval
+	CHECK (deadline > interval '0');
+ALTER TABLE tables ADD COLUMN window_end time;
+COMMENT ON COLUMN tables.deadline IS
+	'If set, the processing should finish within this interval after the '
+	'task has been created. Tasks close to their deadline are started '
+	'before the others.';
+COMMENT ON COLUMN tables.window_end IS
+	'If set, the processing should finish by this time of day. A task is '
+	'not started if the previous processing of the table took longer than '
+	'the time remaining.';
+
+-- Speed up the retrieval of the previous processing of a table.
+CREATE INDEX ON log(tabschema, tabname, finished);
+
+-- How much work the processing of a table takes per byte of the table.
+-- Besides the table, its indexes need to be rebuilt, and the data changes
+-- done meanwhile need to be processed. The write rate is approximated by the
+-- fraction of rows modified per hour since the last ANALYZE.
+--
+-- The result does not grow with the size of the table, so that the ranking
+-- of the tasks below is not reduced to the percentage of free space.
+CREATE FUNCTION estimate_task_overhead(a_relid oid) RETURNS double precision
+LANGUAGE sql
+AS $$
+	SELECT	(pg_catalog.pg_table_size(c.oid) +
+		 pg_catalog.pg_indexes_size(c.oid))::double precision /
+		greatest(pg_catalog.pg_table_size(c.oid), 1) *
+		(1 + coalesce(
+			s.n_mod_since_analyze / greatest(c.reltuples, 1) /
+			greatest(
+				EXTRACT(epoch FROM now() -
+					greatest(s.last_analyze, s.last_autoanalyze))
+				/ 3600,
+				1),
+			0))
+	FROM	pg_catalog.pg_class c
+		LEFT JOIN pg_catalog.pg_stat_user_tables s ON s.relid = c.oid
+	WHERE	c.oid = a_relid;
+$$;
+
+-- Information the scheduler needs to decide which tasks to start first.
+--
+-- benefit is the expected amount of space reclaimed, in bytes, and priority
+-- is the benefit discounted by the overhead of the processing. Thus a big
+-- table is preferred to a small one with the same percentage of free
+-- space. latest_start is the time the processing should start at in order
+-- to meet the deadline, and window_end is the end of the maintenance window
+-- in which the task was created. duration is the time the previous
+-- processing of the table took.
+CREATE VIEW task_ranking AS
+	SELECT	x.task_id,
+		x.benefit,
+		x.benefit / greatest(x.overhead, 1) AS priority,
+		x.deadline - coalesce(x.duration, interval '0') AS latest_start,
+		x.window_end,
+		x.duration
+	FROM (
+		SELECT	k.id AS task_id,
+			k.free_space / 100 *
+			pg_catalog.pg_relation_size(tt.relid) AS benefit,
+			squeeze.estimate_task_overhead(tt.relid) AS overhead,
+			k.created + t.deadline AS deadline,
+			date_trunc('day', k.created) + t.window_end::interval +
+			CASE WHEN t.window_end <= k.created::time THEN
+				interval '1 day'
+			ELSE interval '0'
+			END AS window_end,
+			(
+				SELECT	l.finished - l.started
+				FROM	squeeze.log l
+				WHERE	l.tabschema = tt.tabschema AND
+					l.tabname = tt.tabname
+				ORDER BY l.finished DESC
+				LIMIT 1
+			) AS duration
+		FROM	squeeze.tasks k,
+			squeeze.tables t,
+			squeeze.task_tables tt
+		WHERE	k.table_id = t.id AND tt.task_id = k.id) x;
+
+CREATE OR REPLACE FUNCTION dispatch_new_tasks() RETURNS void
+LANGUAGE sql
+AS $$
+	-- A partition could have been dropped or detached since the task was
+	-- created.
+	UPDATE squeeze.tasks k
+	SET	state = 'processed'
+	WHERE	k.state IN ('new', 'ready') AND
+		NOT EXISTS (
+			SELECT *
+			FROM squeeze.task_tables tt
+			WHERE tt.task_id = k.id
+		);
+
+	-- Tasks that did not start before the end of the maintenance window
+	-- have to wait for the next schedule.
+	UPDATE squeeze.tasks k
+	SET	state = 'processed'
+	FROM	squeeze.task_ranking r,
+		squeeze.task_tables tt
+	WHERE	k.state IN ('new', 'ready') AND r.task_id = k.id AND
+		tt.task_id = k.id AND r.window_end <= now() AND
+		NOT EXISTS (
+			SELECT *
+			FROM squeeze.get_active_workers() w
+			WHERE (w.tabschema, w.tabname) = (tt.tabschema, tt.tabname)
+		);
+
+	-- First, get rid of tables not big enough for processing.
+	UPDATE squeeze.tasks k
+	SET	state = 'processed'
+	FROM	squeeze.tables t,
+		squeeze.task_tables tt
+	WHERE	k.state = 'new' AND k.table_id = t.id AND tt.task_id = k.id AND
+		pg_catalog.pg_relation_size(tt.relid, 'main') < t.min_size * 1048576;
+
+	SELECT squeeze.update_free_space_info();
+
+	-- Make the actual decision.
+	--
+	-- Ignore tasks having NULL in free_space - those have been created
+	-- after update_free_space_info() had finished, so the should waite
+	-- for the next run of dispatch_new_tasks().
+	UPDATE	squeeze.tasks k
+	SET	state =
+		CASE
+			WHEN k.free_space >
+			((100 - squeeze.get_heap_fillfactor(tt.relid)) + t.free_space_extra)
+			THEN 'ready'
+			ELSE 'processed'
+		END
+	FROM	squeeze.tables t,
+		squeeze.task_tables tt
+	WHERE	k.state = 'new' AND k.free_space NOTNULL AND k.table_id = t.id
+		AND tt.task_id = k.id;
+
+$$;
+
+-- The statistics are now preserved, so ANALYZE is only needed on request.
+ALTER TABLE tables ALTER COLUMN skip_analyze SET DEFAULT true;
+COMMENT ON COLUMN tables.skip_analyze IS
+	'Only squeeze the table, without running ANALYZE afterwards. The '
+	'planner statistics are preserved in any case.';
+
+ALTER TABLE log ADD COLUMN catch_up_rounds int;
+ALTER TABLE log ADD COLUMN xlock_attempts int;
+COMMENT ON COLUMN log.catch_up_rounds IS
+	'The number of rounds in which the concurrent changes were processed '
+	'before the exclusive lock was requested.';
+COMMENT ON COLUMN log.xlock_attempts IS
+	'The number of times the exclusive lock was acquired to finish the processing.';
+
+ALTER TABLE log ADD COLUMN setup_time interval;
+ALTER TABLE log ADD COLUMN initial_load_time interval;
+ALTER TABLE log ADD COLUMN index_build_time interval;
+ALTER TABLE log ADD COLUMN catch_up_time interval;
+ALTER TABLE log ADD COLUMN lock_wait_time interval;
+ALTER TABLE log ADD COLUMN final_merge_time interval;
+ALTER TABLE log ADD COLUMN swap_time interval;
+ALTER TABLE log ADD COLUMN wal_decoded bigint;
+ALTER TABLE log ADD COLUMN reorder_spill bigint;
+ALTER TABLE log ADD COLUMN change_spill bigint;
+ALTER TABLE log ADD COLUMN sort_spill bigint;
+ALTER TABLE log ADD COLUMN peak_memory bigint;
+COMMENT ON COLUMN log.setup_time IS
+	'Time spent setting up the logical decoding, including the wait for '
+	'the transactions running at the time.';
+COMMENT ON COLUMN log.initial_load_time IS
+	'Time spent copying the data into the new table.';
+COMMENT ON COLUMN log.index_build_time IS
+	'Time spent building the indexes of the new table.';
+COMMENT ON COLUMN log.catch_up_time IS
+	'Time spent processing the concurrent changes without the exclusive lock.';
+COMMENT ON COLUMN log.lock_wait_time IS
+	'Time spent waiting for the exclusive lock, summed over all the attempts.';
+COMMENT ON COLUMN log.final_merge_time IS
+	'Time spent processing the remaining changes while holding the '
+	'exclusive lock, summed over all the attempts.';
+COMMENT ON COLUMN log.swap_time IS
+	'Time spent swapping the storage of the old and the new table.';
+COMMENT ON COLUMN log.wal_decoded IS
+	'Bytes of WAL the logical decoding has read.';
+COMMENT ON COLUMN log.reorder_spill IS
+	'Bytes the reorder buffer of the logical decoding has written to disk. '
+	'Only available on PostgreSQL 15 and later.';
+COMMENT ON COLUMN log.change_spill IS
+	'Bytes of decoded changes that did not fit into maintenance_work_mem '
+	'and had to be written to a temporary file.';
+COMMENT ON COLUMN log.sort_spill IS
+	'Bytes the sort of the initial load has written to disk.';
+COMMENT ON COLUMN log.peak_memory IS
+	'The maximum amount of memory the worker had allocated. Only available '
+	'on PostgreSQL 13 and later.';
+
+CREATE VIEW pg_stat_progress_squeeze AS
+SELECT	w.pid,
+	w.tabschema,
+	w.tabname,
+	CASE p.param2
+		WHEN 0 THEN 'initializing'
+		WHEN 1 THEN 'seq scanning heap'
+		WHEN 2 THEN 'index scanning heap'
+		WHEN 3 THEN 'sorting tuples'
+		WHEN 4 THEN 'writing new heap'
+		WHEN 5 THEN 'swapping relation files'
+		WHEN 6 THEN 'rebuilding index'
+		WHEN 7 THEN 'performing final cleanup'
+		WHEN 8 THEN 'catching up'
+		WHEN 9 THEN 'final merge'
+	END AS phase,
+	p.param3::oid AS cluster_index_relid,
+	p.param6 AS heap_blks_total,
+	p.param7 AS heap_blks_scanned,
+	p.param4 AS heap_tuples_scanned,
+	p.param5 AS heap_tuples_written,
+	p.param9 AS heap_bytes_written,
+	p.param15 AS indexes_total,
+	p.param8 AS indexes_built,
+	CASE WHEN p.param18 > 0 THEN
+		(to_hex(p.param18 >> 32) || '/' ||
+		 to_hex(p.param18 & 4294967295))::pg_lsn
+	END AS decoded_lsn,
+	CASE WHEN p.param19 > 0 THEN
+		(to_hex(p.param19 >> 32) || '/' ||
+		 to_hex(p.param19 & 4294967295))::pg_lsn
+	END AS target_lsn,
+	p.param14 AS changes_pending,
+	w.ins_initial,
+	w.ins,
+	w.upd,
+	w.del
+FROM	pg_stat_get_progress_info('CLUSTER') AS p
+	JOIN get_active_workers() AS w ON w.pid = p.pid;
+
+ALTER TABLE tables ADD COLUMN tail_percent real
+	CHECK (tail_percent > 0.0 AND tail_percent < 100.0);
+ALTER TABLE tables ADD CHECK (tail_percent ISNULL OR
+	(clustering_index ISNULL AND rel_tablespace ISNULL AND
+	 ind_tablespaces ISNULL));
+COMMENT ON COLUMN tables.tail_percent IS
+	'If set, do not rewrite the table, but move the rows out of this '
+	'percentage of pages at the end of the table and truncate it.';
+
+ALTER TABLE tables ADD COLUMN cost_limit int CHECK (cost_limit > 0);
+ALTER TABLE tables ADD COLUMN cost_delay real
+	CHECK (cost_delay >= 0.0 AND cost_delay <= 100.0);
+COMMENT ON COLUMN tables.cost_limit IS
+	'If set, overrides the squeeze.cost_limit configuration variable.';
+COMMENT ON COLUMN tables.cost_delay IS
+	'If set, overrides the squeeze.cost_delay configuration variable.';
@@ -9,18 +9,19 @@
  */
 #include "pg_squeeze.h"
 
+#include <math.h>
+
 #if PG_VERSION_NUM >= 130000
 #include "access/heaptoast.h"
 #endif
 #include "access/multixact.h"
+#include "access/parallel.h"
 #include "access/sysattr.h"
 #if PG_VERSION_NUM >= 130000
 #include "access/toast_internals.h"
 #include "access/xlogutils.h"
 #endif
-#if PG_VERSION_NUM >= 150000
 #include "access/xloginsert.h"
-#endif
 #include "catalog/catalog.h"
 #include "catalog/dependency.h"
 #include "catalog/heap.h"
@@ -37,14 +38,27 @@
 #include "commands/cluster.h"
 #include "commands/tablecmds.h"
 #include "commands/tablespace.h"
+#include "commands/vacuum.h"
 #include "executor/executor.h"
+#include "executor/instrument.h"
 #include "lib/stringinfo.h"
 #include "nodes/primnodes.h"
 #include "nodes/makefuncs.h"
 #include "optimizer/optimizer.h"
+#include "parser/parse_node.h"
+#include "pgstat.h"
+#include "port/atomics.h"
 #include "storage/bufmgr.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/bulk_write.h"
+#endif
 #include "storage/freespace.h"
+#include "storage/fsm_internals.h"
+#include "storage/latch.h"
 #include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
+#include "storage/shm_mq.h"
 #include "storage/smgr.h"
 #include "storage/standbydefs.h"
 #include "tcop/tcopprot.h"
@@ -55,7 +69,12 @@
 #include "utils/lsyscache.h"
 #include "utils/memutils.h"
 #include "utils/rel.h"
+#include "utils/sampling.h"
 #include "utils/syscache.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
 
 #if PG_VERSION_NUM < 150000
 extern PGDLLIMPORT int wal_segment_size;
@@ -70,6 +89,11 @@ PG_MODULE_MAGIC;
 
 static void squeeze_table_internal(Name relschema, Name relname, Name indname,
 								   Name tbspname, ArrayType *ind_tbsp);
+static void compact_table_tail(Name relschema, Name relname, Oid relid,
+							   Oid ident_idx);
+static bool compact_tail_chunk(Oid relid, Oid ident_idx, BlockNumber start,
+							   BlockNumber end, BlockNumber cutoff,
+							   TransactionId *xid);
 static int	index_cat_info_compare(const void *arg1, const void *arg2);
 
 /* Index-to-tablespace mapping. */
@@ -88,6 +112,172 @@ typedef struct TablespaceInfo
 	IndexTablespace *indexes;
 } TablespaceInfo;
 
+/*
+ * Shared state of the parallel initial load.
+ *
+ * Each participant repeatedly claims PARALLEL_LOAD_CHUNK_BLOCKS blocks,
+ * starting at next_block, until end_block is reached.
+ */
+typedef struct ParallelLoadShared
+{
+	Oid			relid;			/* the source relation */
+	bool		has_dropped_attr;	/* see has_dropped_attribute() */
+
+	pg_atomic_uint64 next_block;
+	BlockNumber end_block;
+} ParallelLoadShared;
+
+/*
+ * Additional shared state if the participants of the parallel load sort the
+ * tuples, see perform_initial_load_sort_parallel().
+ */
+typedef struct ParallelSortShared
+{
+	Oid			indexid;		/* the clustering index */
+	int			sortmem;		/* memory for each participant, in kB */
+
+	/* The segment containing Sharedsort. */
+	dsm_handle	sort_seg;
+} ParallelSortShared;
+
+/* Keys of the shared memory TOC of the parallel initial load. */
+#define PARALLEL_LOAD_KEY_SHARED	UINT64CONST(0xA5A5A5A500000001)
+#define PARALLEL_LOAD_KEY_QUEUES	UINT64CONST(0xA5A5A5A500000002)
+#define PARALLEL_LOAD_KEY_SORT		UINT64CONST(0xA5A5A5A500000003)
+
+/* Size of the queue through which a worker sends tuples to the leader. */
+#define PARALLEL_LOAD_QUEUE_SIZE	(256 * 1024)
+
+/* The number of blocks a participant of the parallel load claims at a time. */
+#define PARALLEL_LOAD_CHUNK_BLOCKS	64
+
+/*
+ * Limits on the tuples buffered for a single table_multi_insert() call
+ * during the initial load. The values are those that COPY FROM uses.
+ */
+#define LOAD_INSERT_MAX_TUPLES	1000
+#define LOAD_INSERT_MAX_BYTES	65535
+
+/*
+ * The number of pages the page writer collects before it writes them out.
+ * (PG >= 17 leaves the batching to the bulk write facility.)
+ */
+#define LOAD_PAGES_MAX	32
+
+/*
+ * If squeeze_max_xlock_time is set, the exclusive lock is only requested
+ * when the changes not yet decoded are expected to be processed within this
+ * fraction of squeeze_max_xlock_time.
+ */
+#define XLOCK_TIME_FRACTION		0.5
+
+/*
+ * The maximum number of catch-up rounds before each attempt to acquire the
+ * exclusive lock. If the remaining WAL does not get short enough by then,
+ * we try the lock anyway.
+ */
+#define CATCH_UP_MAX_ROUNDS		32
+
+/*
+ * The number of pages that compact_table_tail() empties in a single
+ * transaction, i.e. w/o releasing the lock on the table.
+ */
+#define TAIL_CHUNK_PAGES		32
+
+/*
+ * How long compact_table_tail() waits for the deleted tuples to become
+ * removable by VACUUM, in milliseconds.
+ */
+#define TAIL_HORIZON_WAIT_MS	10000
+
+/* Measurements of catch_up_before_final_merge(). */
+typedef struct CatchUpStats
+{
+	int			rounds;			/* total number of rounds */
+	double		rate;			/* WAL bytes processed per second */
+	uint64		remaining;		/* WAL bytes not decoded yet */
+} CatchUpStats;
+
+/*
+ * State of writing the pages of the transient table directly, i.e. w/o
+ * shared buffers, the way rewriteheap.c does.
+ */
+typedef struct LoadPageWriter
+{
+	TransactionId xid;
+	CommandId	cid;
+	Size		save_free_space;	/* see RelationGetTargetPageFreeSpace() */
+
+	BlockNumber blkno;			/* block number of the current page */
+	Page		page;			/* the current page, NULL if none */
+	int			ntuples;		/* tuples not yet reported in the progress */
+	Size		nbytes;			/* their size */
+
+#if PG_VERSION_NUM >= 130000
+	/*
+	 * If the source table has TOAST, the TOAST values are copied to the
+	 * transient table as they are, i.e. w/o decompression and compression.
+	 */
+	Relation	toastrel_src;
+	Relation   *toastidxs_src;
+	int			num_toastidxs_src;
+	int			valididx_src;
+	Relation	toastrel_dst;
+	Relation   *toastidxs_dst;
+	int			num_toastidxs_dst;
+	int			valididx_dst;
+	BulkInsertState toast_bistate;
+#endif
+#if PG_VERSION_NUM >= 170000
+	BulkWriteState *bulkstate;
+#else
+	Page		pages[LOAD_PAGES_MAX];	/* the pages to be written out */
+	BlockNumber blknos[LOAD_PAGES_MAX];
+	int			npages;
+#endif
+} LoadPageWriter;
+
+/*
+ * Tuples to be inserted into the transient table, either by
+ * table_multi_insert() or by the page writer.
+ */
+typedef struct LoadInsertState
+{
+	Relation	rel;
+	BulkInsertState bistate;
+	MemoryContext mcxt;			/* where the slots are allocated */
+
+	TupleTableSlot *slots[LOAD_INSERT_MAX_TUPLES];
+	int			nslots_created;
+	int			nslots;			/* the number of slots in use */
+	Size		nbytes;			/* the total size of the buffered tuples */
+
+	LoadPageWriter *writer;		/* NULL unless the pages are written here */
+	bool		keep_toast;		/* may the tuples contain TOAST pointers? */
+
+	/* For the progress reporting. */
+	int64		ntuples_written;
+	int64		nbytes_written;
+} LoadInsertState;
+
+/* Leader's state to insert the tuples produced by the parallel workers. */
+typedef struct ParallelLoadLeaderState
+{
+	LoadInsertState istate;
+
+	/*
+	 * Tuples for which heap_insert() might need to create TOAST values. OIDs
+	 * cannot be assigned in parallel mode, so we can only insert these when
+	 * the workers are done.
+	 */
+	Tuplestorestate *deferred;
+	TupleTableSlot *deferred_slot;
+
+	int64		tuples_scanned;	/* for the progress reporting */
+} ParallelLoadLeaderState;
+
+typedef void (*ParallelLoadCallback) (HeapTuple tup, void *arg);
+
 /* The WAL segment being decoded. */
 XLogSegNo	squeeze_current_segment = 0;
 
@@ -95,6 +285,11 @@ static void check_prerequisites(Relation rel);
 static LogicalDecodingContext *setup_decoding(Oid relid, TupleDesc tup_desc,
 											  Snapshot *snap_hist);
 static void decoding_cleanup(LogicalDecodingContext *ctx);
+static void check_catalog_visible(CatalogState *cat_state,
+								  Snapshot snap_hist);
+#if PG_VERSION_NUM >= 150000
+static int64 get_slot_spill_bytes(void);
+#endif
 static CatalogState *get_catalog_state(Oid relid);
 static void get_pg_class_info(Oid relid, TransactionId *xmin,
 							  Form_pg_class *form_p, TupleDesc *desc_p);
@@ -119,6 +314,48 @@ static void resolve_index_tablepaces(TablespaceInfo *tbsp_info,
 static void perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 								 Snapshot snap_hist, Relation rel_dst,
 								 LogicalDecodingContext *ctx);
+static void perform_initial_load_stream(Relation rel_src, Snapshot snap_hist,
+										Relation rel_dst,
+										LogicalDecodingContext *ctx);
+static void perform_initial_load_parallel(Relation rel_src,
+										  Snapshot snap_hist,
+										  Relation rel_dst,
+										  LogicalDecodingContext *ctx);
+static void parallel_load_round(Relation rel_src, Snapshot snap_hist,
+								bool has_dropped_attr, BlockNumber start,
+								BlockNumber end,
+								ParallelLoadLeaderState *lstate);
+static void parallel_load_scan(Relation rel, Snapshot snapshot,
+							   ParallelLoadShared *shared,
+							   ParallelLoadCallback callback, void *arg);
+static void parallel_load_store_tuple(HeapTuple tup, void *arg);
+static void parallel_load_send_tuple(HeapTuple tup, void *arg);
+static bool perform_initial_load_sort_parallel(Relation rel_src,
+											   Relation cluster_idx,
+											   Relation rel_dst);
+static void parallel_load_sort_tuple(HeapTuple tup, void *arg);
+static void load_insert_begin(LoadInsertState *istate, Relation rel,
+							  bool write_pages, Oid toastrelid_src);
+static void load_insert_tuple(LoadInsertState *istate, HeapTuple tup);
+static void load_insert_flush(LoadInsertState *istate);
+static void load_insert_end(LoadInsertState *istate);
+static void load_insert_report(LoadInsertState *istate, int ntuples,
+							   Size nbytes);
+static void load_page_add_tuple(LoadInsertState *istate, HeapTuple tup);
+static bool load_page_copy_tuple(LoadInsertState *istate, HeapTuple tup);
+static HeapTupleHeader load_page_add_item(LoadInsertState *istate,
+										  HeapTupleHeader data,
+										  uint32 data_len);
+static void load_page_finish(LoadInsertState *istate);
+#if PG_VERSION_NUM < 170000
+static void load_pages_write(LoadInsertState *istate);
+#endif
+#if PG_VERSION_NUM >= 130000
+static HeapTuple load_copy_toast_values(LoadInsertState *istate,
+										HeapTuple tup);
+static Datum load_copy_toast_value(LoadPageWriter *writer,
+								   struct varlena *attr);
+#endif
 static bool has_dropped_attribute(Relation rel);
 static Oid	create_transient_table(CatalogState *cat_state, TupleDesc tup_desc,
 								   Oid tablespace, Oid relowner);
@@ -129,13 +366,26 @@ static Oid *build_transient_indexes(Relation rel_dst, Relation rel_src,
 									LogicalDecodingContext *ctx);
 static ScanKey build_identity_key(Oid ident_idx_oid, Relation rel_src,
 								  int *nentries);
+static void catch_up_before_final_merge(LogicalDecodingContext *ctx,
+										CatalogState *cat_state,
+										Relation rel_dst, ScanKey ident_key,
+										int ident_key_nentries,
+										IndexInsertState *iistate,
+										CatchUpStats *stats);
 static bool perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 								Relation rel_dst, ScanKey ident_key,
 								int ident_key_nentries,
 								IndexInsertState *iistate,
 								CatalogState *cat_state,
 								LogicalDecodingContext *ctx);
-static void swap_relation_files(Oid r1, Oid r2);
+static void set_transient_relstats(Oid relid, BlockNumber relpages,
+								   double reltuples);
+static void cost_delay_begin(void);
+static void cost_delay_end(void);
+static void cost_delay_point(void);
+static void swap_relation_files(Oid *rels1, Oid *rels2, int nrels);
+static void swap_relation_pair(Relation relRelation,
+							   CatalogIndexState indstate, Oid r1, Oid r2);
 static void swap_toast_names(Oid relid1, Oid toastrelid1, Oid relid2,
 							 Oid toastrelid2);
 #if PG_VERSION_NUM < 130000
@@ -147,7 +397,8 @@ static Oid	get_toast_index(Oid toastrelid);
  * processing. Note that it only process_concurrent_changes() execution time
  * is included here. The very last steps like swap_relation_files() and
  * swap_toast_names() shouldn't get blocked and it'd be wrong to consider them
- * a reason to abort otherwise completed processing.
+ * a reason to abort otherwise completed processing. We only report if they
+ * took longer than this.
  */
 int			squeeze_max_xlock_time = 0;
 
@@ -168,6 +419,86 @@ char	   *squeeze_worker_role = NULL;
 /* The number of squeeze workers per database. */
 int			squeeze_workers_per_database = 1;
 
+/*
+ * The number of replication slots the scheduler keeps ready for the next
+ * tasks, and the time after which such a slot is replaced by a new one.
+ */
+int			squeeze_slot_pool_size = 0;
+int			squeeze_slot_pool_max_age = 300;
+
+/*
+ * The maximum number of tables processed by one squeeze worker in a row, and
+ * the maximum size (in megabytes) of a table to be processed this way.
+ */
+int			squeeze_max_batch_tables = 1;
+int			squeeze_batch_table_max_size = 512;
+
+/*
+ * The maximum number of parallel workers that copy data during the initial
+ * load. The squeeze worker sets the variable to the value requested by the
+ * task.
+ */
+int			squeeze_max_initial_load_workers = 0;
+
+/*
+ * If the table is at least this big (in megabytes), it's always sorted for
+ * clustering, even if the planner prefers the index scan. -1 means that the
+ * planner decides.
+ */
+int			squeeze_cluster_sort_min_size = -1;
+
+/*
+ * The maximum number of parallel workers to build each index, -1 means that
+ * max_parallel_maintenance_workers applies.
+ */
+int			squeeze_max_parallel_index_workers = -1;
+
+/*
+ * Should the concurrent changes be reduced to the net effect per identity
+ * key before they are applied?
+ */
+bool		squeeze_coalesce_changes = false;
+
+/*
+ * Should a separate worker decode the concurrent changes while we are
+ * applying them?
+ */
+bool		squeeze_pipelined_decoding = false;
+
+/*
+ * How to compress the decoded changes that do not fit into memory and need
+ * to be written to a temporary file.
+ */
+int			squeeze_spill_compression = SPILL_COMPRESSION_OFF;
+
+static const struct config_enum_entry spill_compression_options[] = {
+	{"off", SPILL_COMPRESSION_OFF, false},
+	{"pglz", SPILL_COMPRESSION_PGLZ, false},
+#ifdef USE_LZ4
+	{"lz4", SPILL_COMPRESSION_LZ4, false},
+#endif
+	{NULL, 0, false}
+};
+
+/*
+ * If greater than zero, do not rewrite the table, but move the rows out of
+ * this percentage of pages at the end of the table, and truncate it.
+ */
+double		squeeze_tail_percent = 0.0;
+
+/*
+ * Cost-based delay of the initial load and of the index build, see
+ * cost_delay_point(). (The costs of particular operations are those of
+ * VACUUM.)
+ */
+int			squeeze_cost_limit = 200;
+double		squeeze_cost_delay = 0.0;
+
+/* pgWalUsage.wal_bytes already accounted for by cost_delay_point(). */
+#if PG_VERSION_NUM >= 130000
+static uint64 cost_wal_bytes = 0;
+#endif
+
 void
 _PG_init(void)
 {
@@ -227,6 +558,55 @@ _PG_init(void)
 	 */
 							NULL, NULL, NULL);
 
+	DefineCustomIntVariable(
+							"squeeze.slot_pool_size",
+							"Number of replication slots the scheduler worker prepares in advance.",
+							"The slots are handed over to the squeeze workers as soon as tasks "
+							"appear, so the workers do not have to wait for the running "
+							"transactions to finish. Values greater than "
+							"\"squeeze.workers_per_database\" have the same effect as that "
+							"setting.",
+							&squeeze_slot_pool_size,
+							0, 0, max_worker_processes,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"squeeze.slot_pool_max_age",
+							"Time after which a prepared replication slot is replaced.",
+							"A prepared slot prevents VACUUM from removing rows deleted after the "
+							"slot was created, and it retains WAL.",
+							&squeeze_slot_pool_max_age,
+							300, 1, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"squeeze.max_batch_tables",
+							"Maximum number of small tables one squeeze worker processes in a row.",
+							"The scheduler worker assigns the tasks for tables not bigger than "
+							"\"squeeze.batch_table_max_size\" to the same squeeze worker, "
+							"which creates the replication slot of each table just before "
+							"it processes the table.",
+							&squeeze_max_batch_tables,
+							/* No more tasks fit into the shared memory, see worker.c. */
+							1, 1, 16,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"squeeze.batch_table_max_size",
+							"Maximum size of a table that can be processed in a batch.",
+							NULL,
+							&squeeze_batch_table_max_size,
+							512, 0, MAX_KILOBYTES,
+							PGC_SIGHUP,
+							GUC_UNIT_MB,
+							NULL, NULL, NULL);
+
 	if (squeeze_worker_autostart)
 	{
 		List	   *dbnames = NIL;
@@ -309,6 +689,119 @@ _PG_init(void)
 							PGC_USERSET,
 							GUC_UNIT_MS,
 							NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"squeeze.max_initial_load_workers",
+							"Maximum number of parallel workers to copy table data during the initial load.",
+							"The value of the \"initial_load_workers\" column of \"squeeze.tables\" "
+							"is limited by this setting. The squeeze_table() function uses the "
+							"value directly. If a clustering index is used, the workers only "
+							"help if the tuples are sorted rather than read using the index.",
+							&squeeze_max_initial_load_workers,
+							0, 0, max_worker_processes,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"squeeze.cluster_sort_min_size",
+							"Minimum size of a table that is always sorted for clustering.",
+							"Tables of this size or bigger are sorted even if the planner thinks "
+							"that the scan of the clustering index is cheaper. -1 means that "
+							"the planner always decides.",
+							&squeeze_cluster_sort_min_size,
+							-1, -1, MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_MB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"squeeze.max_parallel_index_workers",
+							"Maximum number of parallel workers to build an index of the new table.",
+							"If set, overrides max_parallel_maintenance_workers when building the "
+							"indexes. -1 means that max_parallel_maintenance_workers applies.",
+							&squeeze_max_parallel_index_workers,
+							-1, -1, max_worker_processes,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+							 "squeeze.coalesce_changes",
+							 "Apply only the net effect of the concurrent changes of each row.",
+							 "If enabled, the data changes that took place during the processing are "
+							 "grouped by the identity key, and only the final state of each row is "
+							 "written into the new table. This does not happen if the table has a "
+							 "unique index other than the identity index.",
+							 &squeeze_coalesce_changes,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable(
+							 "squeeze.pipelined_decoding",
+							 "Decode the concurrent changes in a separate background worker.",
+							 "If enabled, an additional background worker decodes the data changes "
+							 "that took place during the initial load and sends them to the squeeze "
+							 "worker, which applies them meanwhile. This only applies to the changes "
+							 "processed before the exclusive lock is acquired.",
+							 &squeeze_pipelined_decoding,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomEnumVariable(
+							 "squeeze.spill_compression",
+							 "Compress the concurrent changes written to disk.",
+							 "If the data changes decoded during the processing do not fit into "
+							 "maintenance_work_mem, they are written to a temporary file. This "
+							 "setting controls the compression method of the file.",
+							 &squeeze_spill_compression,
+							 SPILL_COMPRESSION_OFF,
+							 spill_compression_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomRealVariable(
+							 "squeeze.tail_percent",
+							 "Only compact this percentage of pages at the end of the table.",
+							 "If greater than zero, the table is not rewritten. Instead, the rows "
+							 "are moved from the given percentage of pages at the end of the table "
+							 "into free space in the preceding pages, and the table is truncated. "
+							 "The value of the \"tail_percent\" column of \"squeeze.tables\" is "
+							 "used for scheduled processing.",
+							 &squeeze_tail_percent,
+							 0.0, 0.0, 99.0,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+							"squeeze.cost_limit",
+							"The accumulated cost that causes the squeeze worker to sleep.",
+							"Like vacuum_cost_limit, but it applies to the initial load and to "
+							"the index build. Besides page reads and writes, each block of WAL "
+							"written costs vacuum_cost_page_dirty.",
+							&squeeze_cost_limit,
+							200, 1, 10000,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomRealVariable(
+							 "squeeze.cost_delay",
+							 "Cost delay in milliseconds for the squeeze worker.",
+							 "Zero disables the cost-based delay. The \"cost_limit\" and "
+							 "\"cost_delay\" columns of \"squeeze.tables\" override the "
+							 "configuration variables for scheduled processing.",
+							 &squeeze_cost_delay,
+							 0.0, 0.0, 100.0,
+							 PGC_USERSET,
+							 GUC_UNIT_MS,
+							 NULL, NULL, NULL);
 }
 
 /*
@@ -343,6 +836,13 @@ exit_if_requested(void)
 {
 	bool	exit_requested;
 
+	/*
+	 * The decoding worker has no task, the squeeze worker terminates it if
+	 * needed.
+	 */
+	if (MyWorkerTask == NULL)
+		return;
+
 	SpinLockAcquire(&MyWorkerTask->mutex);
 	exit_requested = MyWorkerTask->exit_requested;
 	SpinLockRelease(&MyWorkerTask->mutex);
@@ -359,6 +859,127 @@ exit_if_requested(void)
 			 errmsg("terminating pg_squeeze background worker due to administrator command")));
 }
 
+/*
+ * Record the memory currently allocated by the worker if it's the highest
+ * value seen so far. This is only called at certain points (e.g. when a
+ * batch of changes has been decoded), so the actual peak can be a bit
+ * higher.
+ */
+void
+progress_sample_memory(void)
+{
+#if PG_VERSION_NUM >= 130000
+	uint64		allocated;
+
+	/* The decoding worker has no slot. */
+	if (MyWorkerSlot == NULL)
+		return;
+
+	allocated = MemoryContextMemAllocated(TopMemoryContext, true);
+	if (allocated > pg_atomic_read_u64(&MyWorkerSlot->progress.peak_memory))
+		pg_atomic_write_u64(&MyWorkerSlot->progress.peak_memory, allocated);
+#endif
+}
+
+/*
+ * Return the wait event to report during the given activity.
+ */
+uint32
+squeeze_wait_event(SqueezeWaitEvent event)
+{
+#if PG_VERSION_NUM >= 170000
+	static uint32 events[SQUEEZE_WAIT_EVENTS] = {0};
+	static const char *names[SQUEEZE_WAIT_EVENTS] = {
+		"SqueezeDecoding",
+		"SqueezeDecodingWorker",
+		"SqueezeCostDelay"
+	};
+
+	/* The event is registered in shared memory on first use. */
+	if (events[event] == 0)
+		events[event] = WaitEventExtensionNew(names[event]);
+
+	return events[event];
+#else
+	return PG_WAIT_EXTENSION;
+#endif
+}
+
+/*
+ * Start the cost-based delay, if it's enabled.
+ *
+ * The buffer manager charges the page accesses to VacuumCostBalance while
+ * VacuumCostActive is set, so we only need to add the cost of WAL and to
+ * sleep.
+ */
+static void
+cost_delay_begin(void)
+{
+	VacuumCostActive = squeeze_cost_delay > 0;
+	VacuumCostBalance = 0;
+#if PG_VERSION_NUM >= 130000
+	cost_wal_bytes = pgWalUsage.wal_bytes;
+#endif
+}
+
+/*
+ * Stop the delay, e.g. because the remaining steps need to be done as soon as
+ * possible.
+ */
+static void
+cost_delay_end(void)
+{
+	VacuumCostActive = false;
+	VacuumCostBalance = 0;
+}
+
+/*
+ * Sleep if the cost accumulated since the previous sleep exceeds
+ * squeeze_cost_limit.
+ *
+ * Like in vacuum_delay_point(), the sleep time is capped: if the balance got
+ * high because we could not sleep for a while, the I/O has already been
+ * done, so a long sleep would only delay the completion.
+ */
+static void
+cost_delay_point(void)
+{
+	double		msec;
+
+	if (!VacuumCostActive)
+		return;
+
+#if PG_VERSION_NUM >= 130000
+	{
+		uint64		nblocks;
+
+		nblocks = (pgWalUsage.wal_bytes - cost_wal_bytes) / BLCKSZ;
+		VacuumCostBalance += nblocks * VacuumCostPageDirty;
+		cost_wal_bytes += nblocks * BLCKSZ;
+	}
+#endif
+
+	if (VacuumCostBalance < squeeze_cost_limit)
+		return;
+
+	msec = squeeze_cost_delay * VacuumCostBalance / squeeze_cost_limit;
+	msec = Min(msec, squeeze_cost_delay * 4);
+	VacuumCostBalance = 0;
+
+	/* Sleep in slices so that the worker can respond to requests to exit. */
+	while (msec >= 1.0)
+	{
+		long		delay = (long) Min(msec, 1000.0);
+
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+						 delay, squeeze_wait_event(SQUEEZE_WAIT_COST_DELAY));
+		ResetLatch(MyLatch);
+		exit_if_requested();
+		msec -= delay;
+	}
+}
+
 
 /*
  * Introduced in pg_squeeze 1.6, to be called directly as opposed to calling
@@ -420,12 +1041,22 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	int			nindexes;
 	Oid		   *indexes_src = NULL,
 			   *indexes_dst = NULL;
+	Oid		   *rels_src,
+			   *rels_dst;
 	bool		invalid_index = false;
 	IndexCatInfo *ind_info;
 	TablespaceInfo *tbsp_info;
 	ObjectAddress object;
 	bool		source_finalized;
 	bool		xmin_valid;
+	CatchUpStats catch_up;
+	BlockNumber nblocks_dst;
+	double		ntuples_dst;
+	TimestampTz phase_start;
+	int64		swap_time;
+#if PG_VERSION_NUM >= 150000
+	int64		reorder_spill_start;
+#endif
 
 	relrv_src = makeRangeVar(NameStr(*relschema), NameStr(*relname), -1);
 	rel_src = table_openrv(relrv_src, AccessShareLock);
@@ -447,7 +1078,7 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	toastrelid_src = rel_src->rd_rel->reltoastrelid;
 
 	/*
-	 * Info to create transient table and to initialize tuplestore we'll use
+	 * Info to create transient table and to process the changes we decode
 	 * during logical decoding.
 	 */
 	tup_desc = CreateTupleDescCopy(RelationGetDescr(rel_src));
@@ -525,6 +1156,24 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 				(errcode(ERRCODE_UNIQUE_VIOLATION),
 				 (errmsg("Replica identity \"full\" not supported"))));
 
+	/*
+	 * If only the tail of the table should be compacted, no transient table
+	 * is created, so neither clustering nor tablespace change is possible.
+	 */
+	if (squeeze_tail_percent > 0.0)
+	{
+		if (indname || tbspname || ind_tbsp)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 (errmsg("tail compaction cannot cluster the table or change its tablespace"))));
+
+		free_catalog_state(cat_state);
+		FreeTupleDesc(tup_desc);
+
+		compact_table_tail(relschema, relname, relid_src, ident_idx_src);
+		return;
+	}
+
 	/*
 	 * Clustering index, if any.
 	 *
@@ -581,7 +1230,18 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	for (i = 0; i < nindexes; i++)
 		indexes_src[i] = cat_state->indexes[i].oid;
 
+	/* Report the progress, see the pg_stat_progress_squeeze view. */
+	pgstat_progress_start_command(PROGRESS_COMMAND_CLUSTER, relid_src);
+	pgstat_progress_update_param(PROGRESS_CLUSTER_COMMAND,
+								 PROGRESS_CLUSTER_COMMAND_CLUSTER);
+
+	phase_start = GetCurrentTimestamp();
 	ctx = setup_decoding(relid_src, tup_desc, &snap_hist);
+	progress_add_elapsed(&MyWorkerSlot->progress.setup_time, phase_start);
+	check_catalog_visible(cat_state, snap_hist);
+#if PG_VERSION_NUM >= 150000
+	reorder_spill_start = get_slot_spill_bytes();
+#endif
 
 	relid_dst = create_transient_table(cat_state, tup_desc, tbsp_info->table,
 									   rel_src_owner);
@@ -589,6 +1249,10 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	/* The source relation will be needed for the initial load. */
 	rel_src = table_open(relid_src, AccessShareLock);
 
+	/* From now on, only decode the changes of the source relation. */
+	set_relfilenode_filter((DecodingOutputState *) ctx->output_writer_private,
+						   rel_src);
+
 	/*
 	 * The new relation should not be visible for other transactions until we
 	 * commit, but exclusive lock just makes sense.
@@ -611,10 +1275,19 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	 */
 	PushActiveSnapshot(snap_hist);
 
+	/*
+	 * Throttle the I/O until the indexes are built, if the user wants so.
+	 */
+	cost_delay_begin();
+
 	/*
 	 * The historic snapshot is used to retrieve data w/o concurrent changes.
 	 */
+	phase_start = GetCurrentTimestamp();
 	perform_initial_load(rel_src, relrv_cl_idx, snap_hist, rel_dst, ctx);
+	progress_add_elapsed(&MyWorkerSlot->progress.initial_load_time,
+						 phase_start);
+	progress_sample_memory();
 
 	/*
 	 * We no longer need to preserve the rows processed during the initial
@@ -673,11 +1346,21 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	 * Create indexes on the temporary table - that might take a while.
 	 * (Unlike the concurrent changes, which we insert into existing indexes.)
 	 */
+	phase_start = GetCurrentTimestamp();
 	PushActiveSnapshot(GetTransactionSnapshot());
 	indexes_dst = build_transient_indexes(rel_dst, rel_src, indexes_src,
 										  nindexes, tbsp_info, cat_state,
 										  ctx);
 	PopActiveSnapshot();
+	progress_add_elapsed(&MyWorkerSlot->progress.index_build_time,
+						 phase_start);
+	progress_sample_memory();
+
+	/*
+	 * The remaining work, especially the final merge, should complete as
+	 * soon as possible.
+	 */
+	cost_delay_end();
 
 	/*
 	 * Make the identity index of the transient table visible, for the sake of
@@ -764,9 +1447,18 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	 * many XLOG records that we need to read. Do so before requesting
 	 * exclusive lock on the source relation.
 	 */
-	process_concurrent_changes(ctx, end_of_wal, cat_state, rel_dst,
-							   ident_key, ident_key_nentries, iistate,
-							   NoLock, NULL);
+	pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+								 PROGRESS_SQUEEZE_PHASE_CATCH_UP);
+	phase_start = GetCurrentTimestamp();
+	if (squeeze_pipelined_decoding)
+		process_concurrent_changes_pipelined(&ctx, end_of_wal, cat_state,
+											 rel_dst, ident_key,
+											 ident_key_nentries, iistate);
+	else
+		process_concurrent_changes(ctx, end_of_wal, cat_state, rel_dst,
+								   ident_key, ident_key_nentries, iistate,
+								   NoLock, NULL);
+	progress_add_elapsed(&MyWorkerSlot->progress.catch_up_time, phase_start);
 
 	/*
 	 * This (supposedly cheap) special check should avoid one particular
@@ -797,8 +1489,28 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	 * disable it.
 	 */
 	source_finalized = false;
+	memset(&catch_up, 0, sizeof(CatchUpStats));
 	for (i = 0; i < 4; i++)
 	{
+		/*
+		 * If the lock duration is limited, do not request the lock until the
+		 * remaining changes are likely to be processed in time.
+		 */
+		if (squeeze_max_xlock_time > 0)
+		{
+			pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+										 PROGRESS_SQUEEZE_PHASE_CATCH_UP);
+			phase_start = GetCurrentTimestamp();
+			catch_up_before_final_merge(ctx, cat_state, rel_dst, ident_key,
+										ident_key_nentries, iistate,
+										&catch_up);
+			progress_add_elapsed(&MyWorkerSlot->progress.catch_up_time,
+								 phase_start);
+		}
+
+		pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+									 PROGRESS_SQUEEZE_PHASE_FINAL_MERGE);
+		progress_add(&MyWorkerSlot->progress.xlock_attempts, 1);
 		if (perform_final_merge(relid_src, indexes_src, nindexes,
 								rel_dst, ident_key, ident_key_nentries,
 								iistate, cat_state, ctx))
@@ -814,7 +1526,12 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	if (!source_finalized)
 		ereport(ERROR,
 				(errcode(ERRCODE_OBJECT_IN_USE),
-				 errmsg("\"squeeze_max_xlock_time\" prevented squeeze from completion")));
+				 errmsg("\"squeeze_max_xlock_time\" prevented squeeze from completion"),
+				 errdetail("The exclusive lock was acquired %d times, after %d catch-up rounds in total. "
+						   "The last round processed %.0f bytes of WAL per second, "
+						   UINT64_FORMAT " bytes of WAL were left for the last attempt.",
+						   i, catch_up.rounds, catch_up.rate,
+						   catch_up.remaining)));
 
 	/*
 	 * Done with decoding.
@@ -822,6 +1539,13 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	 * XXX decoding_cleanup() frees tup_desc, although we've used it not only
 	 * for the decoding.
 	 */
+	pg_atomic_write_u64(&MyWorkerSlot->progress.wal_decoded,
+						((DecodingOutputState *)
+						 ctx->output_writer_private)->wal_decoded);
+#if PG_VERSION_NUM >= 150000
+	pg_atomic_write_u64(&MyWorkerSlot->progress.reorder_spill,
+						Max(get_slot_spill_bytes() - reorder_spill_start, 0));
+#endif
 	decoding_cleanup(ctx);
 	ReplicationSlotRelease();
 
@@ -833,25 +1557,60 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	/*
 	 * XXX (Should have been closed right after process_concurrent_changes()?)
 	 */
+	nblocks_dst = RelationGetNumberOfBlocks(rel_dst);
 	table_close(rel_dst, AccessExclusiveLock);
 
+	/*
+	 * The number of rows follows from the counters of the initial load and
+	 * of the concurrent changes, so we don't have to count them.
+	 */
+	ntuples_dst = (double) pg_atomic_read_u64(&MyWorkerSlot->progress.ins_initial) +
+		(double) pg_atomic_read_u64(&MyWorkerSlot->progress.ins) -
+		(double) pg_atomic_read_u64(&MyWorkerSlot->progress.del);
+	set_transient_relstats(relid_dst, nblocks_dst, Max(ntuples_dst, 0.0));
+	CommandCounterIncrement();
+
 	/*
 	 * Exchange storage (including TOAST) and indexes between the source and
 	 * destination tables.
 	 */
-	swap_relation_files(relid_src, relid_dst);
-	CommandCounterIncrement();
+	pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+								 PROGRESS_CLUSTER_PHASE_SWAP_REL_FILES);
+	phase_start = GetCurrentTimestamp();
+	rels_src = (Oid *) palloc((nindexes + 1) * sizeof(Oid));
+	rels_dst = (Oid *) palloc((nindexes + 1) * sizeof(Oid));
+	rels_src[0] = relid_src;
+	rels_dst[0] = relid_dst;
+	for (i = 0; i < nindexes; i++)
+	{
+		rels_src[i + 1] = indexes_src[i];
+		rels_dst[i + 1] = indexes_dst[i];
+	}
+	swap_relation_files(rels_src, rels_dst, nindexes + 1);
 
 	/*
 	 * As swap_relation_files() already changed pg_class(reltoastrelid), we
 	 * pass toastrelid_dst for relid_src and vice versa.
 	 */
 	swap_toast_names(relid_src, toastrelid_dst, relid_dst, toastrelid_src);
-
-	for (i = 0; i < nindexes; i++)
-		swap_relation_files(indexes_src[i], indexes_dst[i]);
 	CommandCounterIncrement();
+	swap_time = GetCurrentTimestamp() - phase_start;
+	progress_add(&MyWorkerSlot->progress.swap_time, swap_time);
 
+	/*
+	 * squeeze_max_xlock_time does not limit the swap, but the user should
+	 * know if the lock was held longer because of it.
+	 */
+	if (squeeze_max_xlock_time > 0)
+		ereport(swap_time / 1000 >= squeeze_max_xlock_time ? LOG : DEBUG1,
+				(errmsg("pg_squeeze: swapping the storage of table \"%s\".\"%s\" and of %d index(es) took %.3f ms",
+						NameStr(*relschema), NameStr(*relname), nindexes,
+						swap_time / 1000.0),
+				 errdetail("squeeze.max_xlock_time is %d ms.",
+						   squeeze_max_xlock_time)));
+
+	pfree(rels_src);
+	pfree(rels_dst);
 	if (nindexes > 0)
 	{
 		pfree(indexes_src);
@@ -865,14 +1624,331 @@ squeeze_table_internal(Name relschema, Name relname, Name indname,
 	 * Drop the transient table including indexes (and possibly constraints on
 	 * those indexes).
 	 */
+	pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+								 PROGRESS_CLUSTER_PHASE_FINAL_CLEANUP);
 	object.classId = RelationRelationId;
 	object.objectSubId = 0;
 	object.objectId = relid_dst;
 	performDeletion(&object, DROP_RESTRICT, PERFORM_DELETION_INTERNAL);
+
+	pgstat_progress_end_command();
 }
 
-static int
-index_cat_info_compare(const void *arg1, const void *arg2)
+/*
+ * Move the live tuples out of the last squeeze_tail_percent percent of pages
+ * into the free space of the preceding pages, and let VACUUM truncate the
+ * table.
+ *
+ * Unlike the full squeeze, this does not need logical decoding: each chunk
+ * of pages is processed in a separate transaction which holds ExclusiveLock
+ * on the table, so that readers are not blocked, and writers only wait for
+ * the current chunk. Each tuple is moved by deleting it and inserting a
+ * copy, so other MVCC snapshots see exactly one version of it.
+ *
+ * The function commits the caller's transaction and returns in a new one.
+ */
+static void
+compact_table_tail(Name relschema, Name relname, Oid relid, Oid ident_idx)
+{
+	Relation	rel;
+	BlockNumber nblocks,
+				cutoff,
+				blkno;
+	BlockNumber ntail;
+	TransactionId last_xid = InvalidTransactionId;
+	RepOriginId origin_save;
+	TimestampTz wait_start;
+	VacuumStmt *stmt;
+	VacuumRelation *vrel;
+
+	/*
+	 * No replication slot has been created for the task (see
+	 * task_needs_slot()), so nothing but the running transactions prevents
+	 * VACUUM from removing the tuples we delete.
+	 */
+	Assert(NameStr(MyWorkerTask->repl_slot.name)[0] == '\0');
+
+	rel = table_open(relid, AccessShareLock);
+	nblocks = RelationGetNumberOfBlocks(rel);
+	ntail = (BlockNumber) ceil(nblocks * squeeze_tail_percent / 100.0);
+	cutoff = nblocks - Min(ntail, nblocks);
+
+	/*
+	 * Make sure that neither we nor other backends put new tuples into the
+	 * tail. (Backends that already have a tail page as the insertion target
+	 * can still put tuples there, in which case the truncation is only
+	 * partial.)
+	 */
+	for (blkno = cutoff; blkno < nblocks; blkno++)
+		RecordPageWithFreeSpace(rel, blkno, 0);
+	if (cutoff < nblocks)
+		FreeSpaceMapVacuumRange(rel, cutoff, nblocks);
+	table_close(rel, AccessShareLock);
+
+	pgstat_progress_start_command(PROGRESS_COMMAND_CLUSTER, relid);
+	pgstat_progress_update_param(PROGRESS_CLUSTER_COMMAND,
+								 PROGRESS_CLUSTER_COMMAND_CLUSTER);
+	pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+								 PROGRESS_CLUSTER_PHASE_SEQ_SCAN_HEAP);
+	pgstat_progress_update_param(PROGRESS_CLUSTER_TOTAL_HEAP_BLKS,
+								 nblocks - cutoff);
+
+	CommitTransactionCommand();
+
+	/*
+	 * The moved tuples are regular data changes, so they must not carry our
+	 * replication origin. Otherwise subscriptions that skip changes having
+	 * an origin would not replicate them.
+	 */
+	origin_save = replorigin_session_origin;
+	replorigin_session_origin = InvalidRepOriginId;
+
+	/* Process the tail backwards, from the last page. */
+	blkno = nblocks;
+	while (blkno > cutoff)
+	{
+		BlockNumber start = blkno > cutoff + TAIL_CHUNK_PAGES ?
+			blkno - TAIL_CHUNK_PAGES : cutoff;
+		TransactionId xid;
+		bool		done;
+
+		exit_if_requested();
+
+		done = !compact_tail_chunk(relid, ident_idx, start, blkno, cutoff,
+								   &xid);
+		if (TransactionIdIsValid(xid))
+			last_xid = xid;
+		if (done)
+			break;
+
+		pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_BLKS_SCANNED,
+									 nblocks - start);
+		blkno = start;
+	}
+
+	replorigin_session_origin = origin_save;
+	pgstat_progress_end_command();
+
+	/*
+	 * If the squeeze_table() function started us, the snapshot of its
+	 * transaction still sees the old tuple versions, so VACUUM could not
+	 * truncate the table now. The function tells the user to run VACUUM
+	 * afterwards.
+	 */
+	if (MyWorkerTask->task_id < 0)
+	{
+		StartTransactionCommand();
+		return;
+	}
+
+	/*
+	 * VACUUM can only remove the old tuple versions once no snapshot can
+	 * see them, so give the transactions running concurrently a chance to
+	 * finish.
+	 */
+	wait_start = GetCurrentTimestamp();
+	while (TransactionIdIsValid(last_xid))
+	{
+		TransactionId oldest;
+
+#if PG_VERSION_NUM >= 140000
+		oldest = GetOldestNonRemovableTransactionId(NULL);
+#else
+		oldest = GetOldestXmin(NULL, PROCARRAY_FLAGS_VACUUM);
+#endif
+		if (TransactionIdPrecedes(last_xid, oldest))
+			break;
+
+		if (TimestampDifferenceExceeds(wait_start, GetCurrentTimestamp(),
+									   TAIL_HORIZON_WAIT_MS))
+		{
+			ereport(DEBUG1,
+					(errmsg("the tuples moved out of the tail of \"%s\".\"%s\" are still visible to some transactions",
+							NameStr(*relschema), NameStr(*relname))));
+			break;
+		}
+
+		exit_if_requested();
+		WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH,
+				  100L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+
+	/*
+	 * Truncate the table and remove the index entries pointing to the old
+	 * tuple versions. ExecVacuum() commits the current transaction and
+	 * starts a new one when done.
+	 */
+	StartTransactionCommand();
+	vrel = makeVacuumRelation(makeRangeVar(NameStr(*relschema),
+										   NameStr(*relname), -1),
+							  InvalidOid, NIL);
+	stmt = makeNode(VacuumStmt);
+	stmt->options = NIL;
+	stmt->rels = list_make1(vrel);
+	stmt->is_vacuumcmd = true;
+	ExecVacuum(make_parsestate(NULL), stmt, true);
+}
+
+/*
+ * Move the tuples of pages [start, end) of the relation to pages below
+ * 'cutoff', starting at the highest page, in a separate transaction. *xid
+ * receives the XID of the transaction, or InvalidTransactionId if nothing
+ * was moved.
+ *
+ * Return false if there was not enough free space for some tuple, so the
+ * caller should not continue with the lower pages.
+ */
+static bool
+compact_tail_chunk(Oid relid, Oid ident_idx, BlockNumber start,
+				   BlockNumber end, BlockNumber cutoff, TransactionId *xid)
+{
+	Relation	rel;
+	TupleDesc	tupdesc;
+	Snapshot	snapshot;
+	IndexInsertState *iistate;
+	TupleTableSlot *slot;
+	BlockNumber blkno;
+	bool		result = true;
+
+	StartTransactionCommand();
+
+	/*
+	 * ExclusiveLock conflicts with data changes and with VACUUM, but not
+	 * with SELECT.
+	 */
+	rel = table_open(relid, ExclusiveLock);
+	tupdesc = RelationGetDescr(rel);
+	PushActiveSnapshot(GetTransactionSnapshot());
+	snapshot = GetActiveSnapshot();
+
+	iistate = get_index_insert_state(rel, ident_idx);
+	slot = MakeSingleTupleTableSlot(tupdesc, &TTSOpsHeapTuple);
+	iistate->econtext->ecxt_scantuple = slot;
+
+	for (blkno = end; blkno > start && result;)
+	{
+		Buffer		buf;
+		Page		page;
+		OffsetNumber off,
+					maxoff;
+		HeapTuple  *tuples;
+		int			ntuples = 0;
+		int			i;
+
+		blkno--;
+		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno, RBM_NORMAL, NULL);
+
+		/* Copy the visible tuples so that we can release the buffer. */
+		LockBuffer(buf, BUFFER_LOCK_SHARE);
+		page = BufferGetPage(buf);
+		maxoff = PageIsNew(page) ? InvalidOffsetNumber :
+			PageGetMaxOffsetNumber(page);
+		tuples = (HeapTuple *) palloc(Max(maxoff, 1) * sizeof(HeapTuple));
+		for (off = FirstOffsetNumber; off <= maxoff; off = OffsetNumberNext(off))
+		{
+			ItemId		itemid = PageGetItemId(page, off);
+			HeapTupleData tuple;
+
+			if (!ItemIdIsNormal(itemid))
+				continue;
+
+			tuple.t_data = (HeapTupleHeader) PageGetItem(page, itemid);
+			tuple.t_len = ItemIdGetLength(itemid);
+			tuple.t_tableOid = relid;
+			ItemPointerSet(&tuple.t_self, blkno, off);
+
+			if (HeapTupleSatisfiesVisibility(&tuple, snapshot, buf))
+				tuples[ntuples++] = heap_copytuple(&tuple);
+		}
+		UnlockReleaseBuffer(buf);
+
+		for (i = 0; i < ntuples; i++)
+		{
+			HeapTuple	tup_old = tuples[i];
+			HeapTuple	tup;
+			Size		len;
+			BlockNumber target;
+			List	   *recheck;
+
+			/* Large tuples will be TOASTed by heap_insert(). */
+			len = Min(MAXALIGN(tup_old->t_len), TOAST_TUPLE_THRESHOLD) +
+				sizeof(ItemIdData);
+			target = GetPageWithFreeSpace(rel, len);
+			if (target == InvalidBlockNumber || target >= cutoff)
+			{
+				result = false;
+				break;
+			}
+
+			/*
+			 * heap_delete() deletes the TOAST values too, so the new tuple
+			 * must not point to them.
+			 */
+			tup = tup_old;
+			if (HeapTupleHasExternal(tup))
+				tup = toast_flatten_tuple(tup, tupdesc);
+
+			simple_heap_delete(rel, &tup_old->t_self);
+			RelationSetTargetBlock(rel, target);
+			simple_heap_insert(rel, tup);
+
+			ResetExprContext(iistate->econtext);
+			ExecStoreHeapTuple(tup, slot, false);
+			recheck = ExecInsertIndexTuples(
+#if PG_VERSION_NUM >= 140000
+											iistate->rri,
+#endif
+											slot,
+											iistate->estate,
+#if PG_VERSION_NUM >= 140000
+											false,	/* update */
+#endif
+											false,	/* noDupErr */
+											NULL,	/* specConflict */
+											NIL /* arbiterIndexes */
+#if PG_VERSION_NUM >= 160000
+											,
+											false	/* onlySummarizing */
+#endif
+				);
+			list_free(recheck);
+
+			progress_add(&MyWorkerSlot->progress.ins_initial, 1);
+
+			/*
+			 * If heap_insert() did not find enough space below the cutoff
+			 * either, the table has been extended. The tuple is still valid,
+			 * but it makes no sense to continue.
+			 */
+			if (ItemPointerGetBlockNumber(&tup->t_self) >= cutoff)
+				result = false;
+
+			ExecClearTuple(slot);
+			if (tup != tup_old)
+				heap_freetuple(tup);
+			if (!result)
+				break;
+		}
+
+		for (i = 0; i < ntuples; i++)
+			heap_freetuple(tuples[i]);
+		pfree(tuples);
+	}
+
+	ExecDropSingleTupleTableSlot(slot);
+	free_index_insert_state(iistate);
+	PopActiveSnapshot();
+	table_close(rel, NoLock);
+
+	*xid = GetCurrentTransactionIdIfAny();
+	CommitTransactionCommand();
+
+	return result;
+}
+
+static int
+index_cat_info_compare(const void *arg1, const void *arg2)
 {
 	IndexCatInfo *i1 = (IndexCatInfo *) arg1;
 	IndexCatInfo *i2 = (IndexCatInfo *) arg2;
@@ -897,6 +1973,16 @@ check_prerequisites(Relation rel)
 {
 	Form_pg_class form = RelationGetForm(rel);
 
+	/*
+	 * Check the relation first. (Partitioned table has no access method
+	 * before PG 17.)
+	 */
+	if (form->relkind == RELKIND_PARTITIONED_TABLE)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("cannot squeeze partitioned table"),
+				 errhint("Squeeze the partitions, or register the table in \"squeeze.tables\".")));
+
 	/*
 	 * The extension is not generic enough to handle AMs other than "heap".
 	 */
@@ -904,12 +1990,6 @@ check_prerequisites(Relation rel)
 		ereport(ERROR,
 				(errmsg("pg_squeeze only supports the \"heap\" access method")));
 
-	/* Check the relation first. */
-	if (form->relkind == RELKIND_PARTITIONED_TABLE)
-		ereport(ERROR,
-				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
-				 errmsg("cannot squeeze partitioned table")));
-
 	if (form->relkind != RELKIND_RELATION)
 		ereport(ERROR,
 				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
@@ -983,7 +2063,6 @@ setup_decoding(Oid relid, TupleDesc tup_desc, Snapshot *snap_hist)
 	DecodingOutputState *dstate;
 	MemoryContext oldcontext;
 	LogicalDecodingContext *ctx;
-	XLogRecPtr	restart_lsn;
 	dsm_segment *seg = NULL;
 	char	*snap_src;
 
@@ -1021,27 +2100,7 @@ setup_decoding(Oid relid, TupleDesc tup_desc, Snapshot *snap_hist)
 				(errmsg("replication slot \"%s\" has invalid effective_xmin",
 						NameStr(MyReplicationSlot->data.name))));
 
-	restart_lsn = MyReplicationSlot->data.restart_lsn;
-
-	/* Restart the decoding context at slot's confirmed_flush */
-	ctx = CreateDecodingContext(InvalidXLogRecPtr,
-								NIL,
-								false,
-#if PG_VERSION_NUM >= 130000
-								XL_ROUTINE(.page_read = read_local_xlog_page,
-										   .segment_open = wal_segment_open,
-										   .segment_close = wal_segment_close),
-#else
-								logical_read_local_xlog_page,
-#endif
-								NULL, NULL, NULL);
-
-#if PG_VERSION_NUM >= 130000
-	/* decode_concurrent_changes() handles the older versions. */
-	XLogBeginRead(ctx->reader, MyReplicationSlot->data.restart_lsn);
-#endif
-
-	XLByteToSeg(restart_lsn, squeeze_current_segment, wal_segment_size);
+	ctx = create_decoding_context();
 
 	/*
 	 * Setup structures to store decoded changes.
@@ -1050,18 +2109,11 @@ setup_decoding(Oid relid, TupleDesc tup_desc, Snapshot *snap_hist)
 
 	dstate = palloc0(sizeof(DecodingOutputState));
 	dstate->relid = relid;
-	dstate->tstore = tuplestore_begin_heap(false, false,
-										   maintenance_work_mem);
+	dstate->changes = change_buffer_begin((Size) maintenance_work_mem *
+										  1024,
+										  squeeze_spill_compression);
 	dstate->tupdesc = tup_desc;
 
-	/* Initialize the descriptor to store the changes ... */
-	dstate->tupdesc_change = CreateTemplateTupleDesc(1);
-
-	TupleDescInitEntry(dstate->tupdesc_change, 1, NULL, BYTEAOID, -1, 0);
-	/* ... as well as the corresponding slot. */
-	dstate->tsslot = MakeSingleTupleTableSlot(dstate->tupdesc_change,
-											  &TTSOpsMinimalTuple);
-
 	dstate->resowner = ResourceOwnerCreate(CurrentResourceOwner,
 										   "logical decoding");
 
@@ -1093,14 +2145,109 @@ decoding_cleanup(LogicalDecodingContext *ctx)
 
 	dstate = (DecodingOutputState *) ctx->output_writer_private;
 
-	ExecDropSingleTupleTableSlot(dstate->tsslot);
-	FreeTupleDesc(dstate->tupdesc_change);
 	FreeTupleDesc(dstate->tupdesc);
-	tuplestore_end(dstate->tstore);
+	change_buffer_end(dstate->changes);
 
 	FreeDecodingContext(ctx);
 }
 
+/*
+ * Check that the historic snapshot sees the same catalog state of the
+ * relation as get_catalog_state() did.
+ *
+ * The scheduler may have created the replication slot long before the task
+ * started (see fill_slot_pool()). If the table was rewritten in between (by
+ * ALTER TABLE, TRUNCATE or by pg_squeeze itself), the rows of the new storage
+ * are invisible to the snapshot, and the rewrite is not decoded, so the
+ * initial load would miss them. If only the catalog changed (e.g. a column
+ * was added or dropped), the changes would be decoded using an obsolete
+ * tuple descriptor.
+ *
+ * Like check_pg_class_changes() and check_attribute_changes(), compare
+ * pg_class(xmin) and pg_attribute(xmin). Any change of pg_class(relfilenode)
+ * is caught this way too.
+ */
+static void
+check_catalog_visible(CatalogState *cat_state, Snapshot snap_hist)
+{
+	Oid			relid = cat_state->rel.relid;
+	HeapTuple	tuple;
+	Relation	rel;
+	SysScanDesc scan;
+	ScanKeyData key[2];
+	bool		visible = false;
+
+	rel = table_open(RelationRelationId, AccessShareLock);
+	ScanKeyInit(&key[0],
+				Anum_pg_class_oid,
+				BTEqualStrategyNumber,
+				F_OIDEQ,
+				ObjectIdGetDatum(relid));
+	scan = systable_beginscan(rel, ClassOidIndexId, true, snap_hist, 1, key);
+	tuple = systable_getnext(scan);
+	if (HeapTupleIsValid(tuple))
+		visible = TransactionIdEquals(HeapTupleHeaderGetXmin(tuple->t_data),
+									  cat_state->rel.xmin);
+	systable_endscan(scan);
+	table_close(rel, AccessShareLock);
+
+	if (visible)
+	{
+		int			n = 0;
+
+		rel = table_open(AttributeRelationId, AccessShareLock);
+		ScanKeyInit(&key[0], Anum_pg_attribute_attrelid,
+					BTEqualStrategyNumber, F_OIDEQ,
+					ObjectIdGetDatum(relid));
+		ScanKeyInit(&key[1],
+					Anum_pg_attribute_attnum,
+					BTGreaterStrategyNumber, F_INT2GT,
+					Int16GetDatum(0));
+		scan = systable_beginscan(rel, AttributeRelidNumIndexId, true,
+								  snap_hist, 2, key);
+		while (visible && (tuple = systable_getnext(scan)) != NULL)
+		{
+			/* The index ensures the ordering by attnum. */
+			visible = n < cat_state->rel.relnatts &&
+				TransactionIdEquals(HeapTupleHeaderGetXmin(tuple->t_data),
+									cat_state->rel.attr_xmins[n]);
+			n++;
+		}
+		if (n != cat_state->rel.relnatts)
+			visible = false;
+		systable_endscan(scan);
+		table_close(rel, AccessShareLock);
+	}
+
+	if (!visible)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_IN_USE),
+				 errmsg("table \"%s\" changed after the replication slot was created",
+						get_rel_name(relid)),
+				 errhint("Squeeze the table again.")));
+}
+
+#if PG_VERSION_NUM >= 150000
+/*
+ * Return the number of bytes the reorder buffer has spilled to disk while
+ * decoding from our replication slot, as recorded by the cumulative
+ * statistics. The counter of the slot is not reset when we start using the
+ * slot, so the caller needs to subtract the initial value. (The reorder
+ * buffer resets its own counters each time it reports them.)
+ */
+static int64
+get_slot_spill_bytes(void)
+{
+	PgStat_StatReplSlotEntry *stats;
+
+	/* Do not use the value cached by the previous call. */
+	pgstat_clear_snapshot();
+	stats = pgstat_fetch_replslot(MyReplicationSlot->data.name);
+
+	return stats != NULL ? stats->spill_bytes : 0;
+}
+#endif
+
 /*
  * Retrieve the catalog state to be passed later to check_catalog_changes.
  *
@@ -1978,6 +3125,7 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 	Size		tuple_array_size;
 	bool		tuple_array_can_expand = true;
 	Tuplesortstate *tuplesort = NULL;
+	TuplesortInstrumentation sort_stats;
 	Relation	cluster_idx = NULL;
 	TableScanDesc heap_scan = NULL;
 	TupleTableSlot *slot;
@@ -1985,7 +3133,7 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 	HeapTuple  *tuples = NULL;
 	ResourceOwner res_owner_old,
 				res_owner_plan;
-	BulkInsertState bistate;
+	LoadInsertState istate;
 	MemoryContext load_cxt,
 				old_cxt;
 	XLogRecPtr	end_of_wal_prev = InvalidXLogRecPtr;
@@ -1993,6 +3141,8 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 	bool	has_dropped_attr;
 	Datum		values[MaxTupleAttributeNumber];
 	bool		isnull[MaxTupleAttributeNumber];
+	int64		tuples_scanned = 0;
+	BlockNumber prev_cblock = InvalidBlockNumber;
 
 
 	/*
@@ -2002,6 +3152,23 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 	dstate = (DecodingOutputState *) ctx->output_writer_private;
 	dstate->rorigin = replorigin_session_origin;
 
+	/* Without clustering index, the work can be split among workers. */
+	if (cluster_idx_rv == NULL && squeeze_max_initial_load_workers > 0)
+	{
+		perform_initial_load_parallel(rel_src, snap_hist, rel_dst, ctx);
+		return;
+	}
+
+	/*
+	 * If the tuples can be stored as they are, copy them to the new pages
+	 * directly.
+	 */
+	if (cluster_idx_rv == NULL && !has_dropped_attribute(rel_src))
+	{
+		perform_initial_load_stream(rel_src, snap_hist, rel_dst, ctx);
+		return;
+	}
+
 	if (cluster_idx_rv != NULL)
 	{
 		cluster_idx = relation_openrv(cluster_idx_rv, AccessShareLock);
@@ -2045,6 +3212,35 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 		/* Cleanup. */
 		CurrentResourceOwner = res_owner_old;
 		ResourceOwnerDelete(res_owner_plan);
+
+		/*
+		 * The planner can prefer the index scan even if the heap is much
+		 * bigger than the memory, e.g. due to low random_page_cost. Each
+		 * tuple can then cost a random read, so let the user enforce the
+		 * sort for big tables.
+		 */
+		if (!use_sort && squeeze_cluster_sort_min_size >= 0 &&
+			(uint64) RelationGetNumberOfBlocks(rel_src) * BLCKSZ >=
+			(uint64) squeeze_cluster_sort_min_size * 1024 * 1024)
+		{
+			elog(DEBUG1,
+				 "pg_squeeze: sorting \"%s\" although index scan seems cheaper",
+				 RelationGetRelationName(rel_src));
+			use_sort = true;
+		}
+
+		/*
+		 * If parallel workers can do the scan and the sort, only the merge
+		 * of their results and the insertion of the tuples remain for us.
+		 */
+		if (use_sort && squeeze_max_initial_load_workers > 0 &&
+			perform_initial_load_sort_parallel(rel_src, cluster_idx,
+											   rel_dst))
+		{
+			relation_close(cluster_idx, AccessShareLock);
+			elog(DEBUG1, "pg_squeeze: the initial load completed");
+			return;
+		}
 	}
 	else
 		use_sort = false;
@@ -2059,6 +3255,31 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 
 	slot = table_slot_create(rel_src, NULL);
 
+	if (heap_scan)
+	{
+		const int	progress_index[] = {
+			PROGRESS_CLUSTER_PHASE,
+			PROGRESS_CLUSTER_TOTAL_HEAP_BLKS
+		};
+		int64		val[2];
+
+		val[0] = PROGRESS_CLUSTER_PHASE_SEQ_SCAN_HEAP;
+		val[1] = ((HeapScanDesc) heap_scan)->rs_nblocks;
+		pgstat_progress_update_multi_param(2, progress_index, val);
+	}
+	else
+	{
+		const int	progress_index[] = {
+			PROGRESS_CLUSTER_PHASE,
+			PROGRESS_CLUSTER_INDEX_RELID
+		};
+		int64		val[2];
+
+		val[0] = PROGRESS_CLUSTER_PHASE_INDEX_SCAN_HEAP;
+		val[1] = RelationGetRelid(cluster_idx);
+		pgstat_progress_update_multi_param(2, progress_index, val);
+	}
+
 	if (use_sort)
 		tuplesort = tuplesort_begin_cluster(RelationGetDescr(rel_src),
 											cluster_idx,
@@ -2079,12 +3300,16 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 		tuples = (HeapTuple *) palloc(tuple_array_size);
 	}
 
-	/* Expect many insertions. */
-	bistate = GetBulkInsertState();
-
 	/* Has the relation at least one dropped attribute? */
 	has_dropped_attr = has_dropped_attribute(rel_src);
 
+	/*
+	 * Expect many insertions. (If we only needed to pack the live tuples
+	 * into the new storage, perform_initial_load_stream() would have been
+	 * used.)
+	 */
+	load_insert_begin(&istate, rel_dst, false, InvalidOid);
+
 	/*
 	 * The processing can take many iterations. In case any data manipulation
 	 * below leaked, try to defend against out-of-memory conditions by using a
@@ -2160,6 +3385,22 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 					tup_in = ExecFetchSlotHeapTuple(slot, false, &shouldFree);
 					/* TTSOpsBufferHeapTuple has .get_heap_tuple != NULL. */
 					Assert(!shouldFree);
+
+					/* Like heapam_relation_copy_for_cluster(). */
+					if (heap_scan &&
+						((HeapScanDesc) heap_scan)->rs_cblock != prev_cblock)
+					{
+						HeapScanDesc hscan = (HeapScanDesc) heap_scan;
+
+						pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_BLKS_SCANNED,
+													 (hscan->rs_cblock +
+													  hscan->rs_nblocks -
+													  hscan->rs_startblock) %
+													 hscan->rs_nblocks + 1);
+						prev_cblock = hscan->rs_cblock;
+					}
+					pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_TUPLES_SCANNED,
+												 ++tuples_scanned);
 				}
 				else
 					tup_in = NULL;
@@ -2172,8 +3413,10 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 			if (tup_in == NULL)
 				break;
 
+			cost_delay_point();
+
 			/* Flatten the tuple if needed. */
-			if (HeapTupleHasExternal(tup_in))
+			if (HeapTupleHasExternal(tup_in) && !istate.keep_toast)
 			{
 				tup_in = toast_flatten_tuple(tup_in,
 											 RelationGetDescr(rel_src));
@@ -2296,7 +3539,17 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 		 */
 
 		if (use_sort)
+		{
+			pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+										 PROGRESS_CLUSTER_PHASE_SORT_TUPLES);
 			tuplesort_performsort(tuplesort);
+			tuplesort_get_stats(tuplesort, &sort_stats);
+			if (sort_stats.spaceType == SORT_SPACE_TYPE_DISK)
+				progress_add(&MyWorkerSlot->progress.sort_spill,
+							 sort_stats.spaceUsed * 1024);
+			pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+										 PROGRESS_CLUSTER_PHASE_WRITE_NEW_HEAP);
+		}
 		else
 		{
 			/*
@@ -2319,109 +3572,1453 @@ perform_initial_load(Relation rel_src, RangeVar *cluster_idx_rv,
 		{
 			HeapTuple	tup_out;
 
-			exit_if_requested();
+			exit_if_requested();
+
+			if (use_sort)
+				tup_out = tuplesort_getheaptuple(tuplesort, true);
+			else
+			{
+				if (i == batch_size)
+					tup_out = NULL;
+				else
+					tup_out = tuples[i++];
+			}
+
+			if (tup_out == NULL)
+				break;
+
+			/*
+			 * Tuplesort owns the tuple it returned, so we need a copy. The
+			 * tuples of the array are ours, and table_multi_insert() will
+			 * free them.
+			 *
+			 * XXX Should the insertions happen outside load_cxt? Currently
+			 * "bistate" is a flat object (i.e. it does not point to any
+			 * memory chunk that the previous call of heap_multi_insert()
+			 * might have allocated) and thus the cleanup between batches
+			 * should not damage it, but can't it get more complex in future
+			 * PG versions?
+			 */
+			if (use_sort)
+				tup_out = heap_copytuple(tup_out);
+			load_insert_tuple(&istate, tup_out);
+		}
+
+		/* The buffered tuples are in load_cxt, so insert them now. */
+		load_insert_flush(&istate);
+
+		/*
+		 * Reached the end of scan when retrieving data from heap or index?
+		 */
+		if (tup_in == NULL)
+			break;
+
+		/*
+		 * Free possibly-leaked memory.
+		 */
+		MemoryContextReset(load_cxt);
+
+		/*
+		 * Decode the WAL produced by the load, as well as by other
+		 * transactions, so that the replication slot can advance and WAL does
+		 * not pile up. Of course we must not apply the changes until the
+		 * initial load has completed.
+		 *
+		 * Note that the insertions into the new table shouldn't actually be
+		 * decoded, they should be filtered out by their origin.
+		 */
+#if PG_VERSION_NUM >= 150000
+		end_of_wal = GetFlushRecPtr(NULL);
+#else
+		end_of_wal = GetFlushRecPtr();
+#endif
+		if (end_of_wal > end_of_wal_prev)
+		{
+			MemoryContextSwitchTo(old_cxt);
+			decode_concurrent_changes(ctx, end_of_wal, NULL);
+			MemoryContextSwitchTo(load_cxt);
+		}
+		end_of_wal_prev = end_of_wal;
+	}
+
+	/*
+	 * At whichever stage the loop broke, the historic snapshot should no
+	 * longer be active.
+	 */
+
+	/* Cleanup. */
+	load_insert_end(&istate);
+
+	if (use_sort)
+		tuplesort_end(tuplesort);
+	else
+		pfree(tuples);
+
+	if (heap_scan != NULL)
+		table_endscan(heap_scan);
+
+	if (index_scan != NULL)
+		index_endscan(index_scan);
+
+	ExecDropSingleTupleTableSlot(slot);
+
+	/*
+	 * Unlock the index, but not the relation yet - caller will do so when
+	 * appropriate.
+	 */
+	if (cluster_idx != NULL)
+		relation_close(cluster_idx, AccessShareLock);
+
+	MemoryContextSwitchTo(old_cxt);
+	MemoryContextDelete(load_cxt);
+
+	elog(DEBUG1, "pg_squeeze: the initial load completed");
+}
+
+/*
+ * Initial load of a table that is not being clustered and has no dropped
+ * attributes, i.e. its tuples can be written to the new storage as they are.
+ *
+ * The tuples are not collected in batches: each one is copied from the
+ * (pinned) page of the source table directly into the page of the transient
+ * table, which is built in private memory rather than in shared buffers, so
+ * that the load does not evict "hot" pages of other backends. Only the tuples
+ * that need the toaster are copied to local memory first.
+ *
+ * The WAL is decoded each time the scan has read about maintenance_work_mem
+ * of pages, i.e. about as often as the other paths decode it between their
+ * batches. Since these "batches" end at the boundaries of the source pages,
+ * no tuple needs to survive the decoding.
+ */
+static void
+perform_initial_load_stream(Relation rel_src, Snapshot snap_hist,
+							Relation rel_dst, LogicalDecodingContext *ctx)
+{
+	TableScanDesc heap_scan;
+	HeapScanDesc hscan;
+	TupleTableSlot *slot;
+	LoadInsertState istate;
+	MemoryContext load_cxt,
+				old_cxt;
+	XLogRecPtr	end_of_wal_prev = InvalidXLogRecPtr;
+	BlockNumber prev_cblock = InvalidBlockNumber;
+	uint64		batch_blocks;
+	uint64		nblocks_batch = 0;
+	int64		tuples_scanned = 0;
+
+	batch_blocks = ((uint64) maintenance_work_mem * 1024) / BLCKSZ;
+
+	heap_scan = table_beginscan(rel_src, snap_hist, 0, (ScanKey) NULL);
+	hscan = (HeapScanDesc) heap_scan;
+	slot = table_slot_create(rel_src, NULL);
+
+	{
+		const int	progress_index[] = {
+			PROGRESS_CLUSTER_PHASE,
+			PROGRESS_CLUSTER_TOTAL_HEAP_BLKS
+		};
+		int64		val[2];
+
+		val[0] = PROGRESS_CLUSTER_PHASE_SEQ_SCAN_HEAP;
+		val[1] = hscan->rs_nblocks;
+		pgstat_progress_update_multi_param(2, progress_index, val);
+	}
+
+	load_insert_begin(&istate, rel_dst, true, rel_src->rd_rel->reltoastrelid);
+
+	/* For the tuples that need to be copied. */
+	load_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "pg_squeeze initial load cxt",
+									 ALLOCSET_DEFAULT_SIZES);
+
+	while (table_scan_getnextslot(heap_scan, ForwardScanDirection, slot))
+	{
+		HeapTuple	tup;
+		bool		shouldFree;
+
+		tup = ExecFetchSlotHeapTuple(slot, false, &shouldFree);
+		/* TTSOpsBufferHeapTuple has .get_heap_tuple != NULL. */
+		Assert(!shouldFree);
+
+		if (hscan->rs_cblock != prev_cblock)
+		{
+			pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_BLKS_SCANNED,
+										 (hscan->rs_cblock +
+										  hscan->rs_nblocks -
+										  hscan->rs_startblock) %
+										 hscan->rs_nblocks + 1);
+
+			/*
+			 * The previous page has been processed completely, so this is
+			 * where the current batch can end. See perform_initial_load()
+			 * for why the WAL is decoded.
+			 */
+			if (prev_cblock != InvalidBlockNumber &&
+				++nblocks_batch >= batch_blocks)
+			{
+				XLogRecPtr	end_of_wal;
+
+				MemoryContextReset(load_cxt);
+#if PG_VERSION_NUM >= 150000
+				end_of_wal = GetFlushRecPtr(NULL);
+#else
+				end_of_wal = GetFlushRecPtr();
+#endif
+				if (end_of_wal > end_of_wal_prev)
+					decode_concurrent_changes(ctx, end_of_wal, NULL);
+				end_of_wal_prev = end_of_wal;
+				nblocks_batch = 0;
+			}
+			prev_cblock = hscan->rs_cblock;
+		}
+		pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_TUPLES_SCANNED,
+									 ++tuples_scanned);
+
+		exit_if_requested();
+
+		if (load_page_copy_tuple(&istate, tup))
+			continue;
+
+		/* The toaster needs a copy of the tuple. */
+		old_cxt = MemoryContextSwitchTo(load_cxt);
+		if (HeapTupleHasExternal(tup) && !istate.keep_toast)
+			tup = toast_flatten_tuple(tup, RelationGetDescr(rel_src));
+		else
+			tup = heap_copytuple(tup);
+		load_insert_tuple(&istate, tup);
+		MemoryContextSwitchTo(old_cxt);
+	}
+
+	load_insert_end(&istate);
+	table_endscan(heap_scan);
+	ExecDropSingleTupleTableSlot(slot);
+	MemoryContextDelete(load_cxt);
+
+	elog(DEBUG1, "pg_squeeze: the initial load completed");
+}
+
+/*
+ * Initial load of a table that has no clustering index, with the heap scan
+ * split among parallel workers.
+ *
+ * The workers scan ranges of blocks using the historic snapshot (which they
+ * receive as the active snapshot) and send the tuples to the leader, which
+ * inserts them into rel_dst. Parallel workers are not allowed to insert
+ * tuples, and rel_dst is not visible to them anyway, but they do take over
+ * the page reads, the visibility checks and the TOAST fetching.
+ *
+ * ReorderBufferProcessTXN() may need to start a subtransaction, which is not
+ * possible in parallel mode, so the WAL cannot be decoded while the workers
+ * are running. Therefore the table is processed in rounds and the decoding
+ * takes place in between. The size of the round is derived from
+ * maintenance_work_mem so that the decoding happens about as often as in the
+ * serial case.
+ */
+static void
+perform_initial_load_parallel(Relation rel_src, Snapshot snap_hist,
+							  Relation rel_dst, LogicalDecodingContext *ctx)
+{
+	ParallelLoadLeaderState lstate;
+	BlockNumber nblocks;
+	uint64		round_blocks,
+				start;
+	bool		has_dropped_attr;
+	MemoryContext load_cxt,
+				old_cxt;
+	XLogRecPtr	end_of_wal_prev = InvalidXLogRecPtr;
+
+	nblocks = RelationGetNumberOfBlocks(rel_src);
+	has_dropped_attr = has_dropped_attribute(rel_src);
+
+	round_blocks = ((uint64) maintenance_work_mem * 1024) / BLCKSZ;
+	round_blocks = Max(round_blocks, PARALLEL_LOAD_CHUNK_BLOCKS);
+
+	load_insert_begin(&lstate.istate, rel_dst, false, InvalidOid);
+	lstate.deferred = tuplestore_begin_heap(false, false,
+											maintenance_work_mem);
+	lstate.deferred_slot = MakeSingleTupleTableSlot(RelationGetDescr(rel_dst),
+													&TTSOpsMinimalTuple);
+	lstate.tuples_scanned = 0;
+
+	{
+		const int	progress_index[] = {
+			PROGRESS_CLUSTER_PHASE,
+			PROGRESS_CLUSTER_TOTAL_HEAP_BLKS
+		};
+		int64		val[2];
+
+		val[0] = PROGRESS_CLUSTER_PHASE_SEQ_SCAN_HEAP;
+		val[1] = nblocks;
+		pgstat_progress_update_multi_param(2, progress_index, val);
+	}
+
+	load_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "pg_squeeze initial load cxt",
+									 ALLOCSET_DEFAULT_SIZES);
+
+	for (start = 0; start < nblocks; start += round_blocks)
+	{
+		BlockNumber end;
+		XLogRecPtr	end_of_wal;
+
+		end = (BlockNumber) Min(start + round_blocks, (uint64) nblocks);
+
+		old_cxt = MemoryContextSwitchTo(load_cxt);
+		parallel_load_round(rel_src, snap_hist, has_dropped_attr,
+							(BlockNumber) start, end, &lstate);
+		MemoryContextSwitchTo(old_cxt);
+		MemoryContextReset(load_cxt);
+		pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_BLKS_SCANNED, end);
+
+		/* See perform_initial_load(). */
+#if PG_VERSION_NUM >= 150000
+		end_of_wal = GetFlushRecPtr(NULL);
+#else
+		end_of_wal = GetFlushRecPtr();
+#endif
+		if (end_of_wal > end_of_wal_prev)
+			decode_concurrent_changes(ctx, end_of_wal, NULL);
+		end_of_wal_prev = end_of_wal;
+	}
+
+	load_insert_end(&lstate.istate);
+	ExecDropSingleTupleTableSlot(lstate.deferred_slot);
+	tuplestore_end(lstate.deferred);
+	MemoryContextDelete(load_cxt);
+
+	elog(DEBUG1, "pg_squeeze: the initial load completed");
+}
+
+/*
+ * Copy blocks from 'start' (inclusive) to 'end' (exclusive) of rel_src to
+ * the transient table, using parallel workers if possible.
+ *
+ * The tuples are inserted in the current memory context, which the caller
+ * is expected to reset afterwards.
+ */
+static void
+parallel_load_round(Relation rel_src, Snapshot snap_hist,
+					bool has_dropped_attr, BlockNumber start, BlockNumber end,
+					ParallelLoadLeaderState *lstate)
+{
+	ParallelContext *pcxt;
+	ParallelLoadShared *shared;
+	shm_mq_handle **mqh = NULL;
+	int			nworkers,
+				nlaunched,
+				nalive,
+				i;
+
+	EnterParallelMode();
+
+	pcxt = CreateParallelContext("pg_squeeze",
+								 "squeeze_initial_load_worker_main",
+								 squeeze_max_initial_load_workers);
+	shm_toc_estimate_chunk(&pcxt->estimator, sizeof(ParallelLoadShared));
+	shm_toc_estimate_chunk(&pcxt->estimator,
+						   mul_size(PARALLEL_LOAD_QUEUE_SIZE, pcxt->nworkers));
+	shm_toc_estimate_keys(&pcxt->estimator, 2);
+	InitializeParallelDSM(pcxt);
+
+	shared = (ParallelLoadShared *) shm_toc_allocate(pcxt->toc,
+													 sizeof(ParallelLoadShared));
+	shared->relid = RelationGetRelid(rel_src);
+	shared->has_dropped_attr = has_dropped_attr;
+	pg_atomic_init_u64(&shared->next_block, start);
+	shared->end_block = end;
+	shm_toc_insert(pcxt->toc, PARALLEL_LOAD_KEY_SHARED, shared);
+
+	/* InitializeParallelDSM() might have reduced the number of workers. */
+	nworkers = pcxt->nworkers;
+	if (nworkers > 0)
+	{
+		char	   *qspace;
+
+		qspace = shm_toc_allocate(pcxt->toc,
+								  mul_size(PARALLEL_LOAD_QUEUE_SIZE, nworkers));
+		shm_toc_insert(pcxt->toc, PARALLEL_LOAD_KEY_QUEUES, qspace);
+
+		mqh = (shm_mq_handle **) palloc(nworkers * sizeof(shm_mq_handle *));
+		for (i = 0; i < nworkers; i++)
+		{
+			shm_mq	   *mq;
+
+			mq = shm_mq_create(qspace + i * PARALLEL_LOAD_QUEUE_SIZE,
+							   PARALLEL_LOAD_QUEUE_SIZE);
+			shm_mq_set_receiver(mq, MyProc);
+			mqh[i] = shm_mq_attach(mq, pcxt->seg, NULL);
+		}
+	}
+
+	LaunchParallelWorkers(pcxt);
+	nlaunched = pcxt->nworkers_launched;
+
+	/*
+	 * Let the queues recognize workers that failed to start, and close those
+	 * that no worker will ever use.
+	 */
+	for (i = 0; i < nworkers; i++)
+	{
+		if (i < nlaunched)
+			shm_mq_set_handle(mqh[i], pcxt->worker[i].bgwhandle);
+		else
+		{
+			shm_mq_detach(mqh[i]);
+			mqh[i] = NULL;
+		}
+	}
+
+	/* If no worker could be launched, do the work ourselves. */
+	if (nlaunched == 0)
+		parallel_load_scan(rel_src, snap_hist, shared,
+						   parallel_load_store_tuple, lstate);
+
+	/* Receive the tuples until all the workers have detached. */
+	nalive = nlaunched;
+	while (nalive > 0)
+	{
+		bool		received = false;
+
+		for (i = 0; i < nlaunched; i++)
+		{
+			shm_mq_result res;
+			Size		nbytes;
+			void	   *data;
+			HeapTupleData tup;
+
+			if (mqh[i] == NULL)
+				continue;
+
+			res = shm_mq_receive(mqh[i], &nbytes, &data, true);
+			if (res == SHM_MQ_WOULD_BLOCK)
+				continue;
+			else if (res == SHM_MQ_DETACHED)
+			{
+				/*
+				 * Either the worker is done or it failed. In the latter
+				 * case, WaitForParallelWorkersToFinish() below will report
+				 * the error.
+				 */
+				shm_mq_detach(mqh[i]);
+				mqh[i] = NULL;
+				nalive--;
+				continue;
+			}
+			Assert(res == SHM_MQ_SUCCESS);
+
+			tup.t_len = nbytes;
+			tup.t_data = (HeapTupleHeader) data;
+			ItemPointerSetInvalid(&tup.t_self);
+			tup.t_tableOid = InvalidOid;
+			parallel_load_store_tuple(&tup, lstate);
+			received = true;
+		}
+
+		if (!received && nalive > 0)
+		{
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_EXIT_ON_PM_DEATH, -1L,
+							 PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+		}
+
+		/* Process error messages from the workers, if there are some. */
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	WaitForParallelWorkersToFinish(pcxt);
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	/* Now that OIDs can be assigned, insert the tuples we put aside. */
+	while (tuplestore_gettupleslot(lstate->deferred, true, false,
+								   lstate->deferred_slot))
+	{
+		HeapTuple	tup;
+		bool		shouldFree;
+
+		exit_if_requested();
+
+		/* The slot contains a minimal tuple, so we should get a copy. */
+		tup = ExecFetchSlotHeapTuple(lstate->deferred_slot, false,
+									 &shouldFree);
+		Assert(shouldFree);
+		load_insert_tuple(&lstate->istate, tup);
+	}
+	tuplestore_clear(lstate->deferred);
+	load_insert_flush(&lstate->istate);
+}
+
+/*
+ * Scan the chunks of blocks claimed from 'shared' and pass each tuple
+ * visible to 'snapshot' to the callback, in the form suitable for insertion
+ * into the transient table.
+ */
+static void
+parallel_load_scan(Relation rel, Snapshot snapshot,
+				   ParallelLoadShared *shared, ParallelLoadCallback callback,
+				   void *arg)
+{
+	TupleDesc	tup_desc = RelationGetDescr(rel);
+	TupleTableSlot *slot;
+	MemoryContext tup_cxt,
+				old_cxt;
+	Datum	   *values = NULL;
+	bool	   *isnull = NULL;
+
+	slot = table_slot_create(rel, NULL);
+	if (shared->has_dropped_attr)
+	{
+		values = (Datum *) palloc(tup_desc->natts * sizeof(Datum));
+		isnull = (bool *) palloc(tup_desc->natts * sizeof(bool));
+	}
+
+	tup_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									"pg_squeeze parallel load tuple cxt",
+									ALLOCSET_DEFAULT_SIZES);
+
+	while (true)
+	{
+		uint64		chunk_start;
+		BlockNumber chunk_size;
+		TableScanDesc scan;
+
+		chunk_start = pg_atomic_fetch_add_u64(&shared->next_block,
+											  PARALLEL_LOAD_CHUNK_BLOCKS);
+		if (chunk_start >= shared->end_block)
+			break;
+		chunk_size = (BlockNumber) Min(PARALLEL_LOAD_CHUNK_BLOCKS,
+									   shared->end_block - chunk_start);
+
+		/* heap_setscanlimits() does not allow synchronized scan. */
+		scan = table_beginscan_strat(rel, snapshot, 0, NULL, true, false);
+		heap_setscanlimits(scan, (BlockNumber) chunk_start, chunk_size);
+
+		while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+		{
+			HeapTuple	tup;
+			bool		shouldFree;
+
+			tup = ExecFetchSlotHeapTuple(slot, false, &shouldFree);
+			Assert(!shouldFree);
+
+			old_cxt = MemoryContextSwitchTo(tup_cxt);
+
+			/* The same processing as in perform_initial_load(). */
+			if (HeapTupleHasExternal(tup))
+				tup = toast_flatten_tuple(tup, tup_desc);
+
+			if (shared->has_dropped_attr)
+			{
+				heap_deform_tuple(tup, tup_desc, values, isnull);
+
+				for (int j = 0; j < tup_desc->natts; j++)
+				{
+					if (TupleDescAttr(tup_desc, j)->attisdropped)
+						isnull[j] = true;
+				}
+
+				tup = heap_form_tuple(tup_desc, values, isnull);
+			}
+
+			callback(tup, arg);
+
+			MemoryContextSwitchTo(old_cxt);
+			MemoryContextReset(tup_cxt);
+		}
+
+		table_endscan(scan);
+	}
+
+	MemoryContextDelete(tup_cxt);
+	ExecDropSingleTupleTableSlot(slot);
+	if (values)
+	{
+		pfree(values);
+		pfree(isnull);
+	}
+}
+
+/*
+ * ParallelLoadCallback of the leader: insert the tuple into the transient
+ * table, or put it aside if it might need TOAST.
+ */
+static void
+parallel_load_store_tuple(HeapTuple tup, void *arg)
+{
+	ParallelLoadLeaderState *lstate = (ParallelLoadLeaderState *) arg;
+
+	pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_TUPLES_SCANNED,
+								 ++lstate->tuples_scanned);
+
+	/* Tuples we get here are flat, so only the size matters. */
+	if (tup->t_len > TOAST_TUPLE_THRESHOLD)
+	{
+		tuplestore_puttuple(lstate->deferred, tup);
+		return;
+	}
+
+	/*
+	 * The tuple can be in the shared memory queue, or in the memory of the
+	 * scan, so it must be copied.
+	 */
+	load_insert_tuple(&lstate->istate, heap_copytuple(tup));
+
+	exit_if_requested();
+}
+
+/*
+ * ParallelLoadCallback of the parallel worker: send the tuple to the leader.
+ */
+static void
+parallel_load_send_tuple(HeapTuple tup, void *arg)
+{
+	shm_mq_handle *mqh = (shm_mq_handle *) arg;
+	shm_mq_result res;
+
+#if PG_VERSION_NUM >= 150000
+	res = shm_mq_send(mqh, tup->t_len, tup->t_data, false, false);
+#else
+	res = shm_mq_send(mqh, tup->t_len, tup->t_data, false);
+#endif
+	if (res != SHM_MQ_SUCCESS)
+		ereport(ERROR,
+				(errmsg("could not send tuple to the initial load leader")));
+}
+
+/*
+ * Entry point of the parallel worker that helps with the initial load, see
+ * perform_initial_load_parallel().
+ */
+void
+squeeze_initial_load_worker_main(dsm_segment *seg, shm_toc *toc)
+{
+	ParallelLoadShared *shared;
+	char	   *qspace;
+	shm_mq	   *mq;
+	shm_mq_handle *mqh;
+	Relation	rel;
+
+	shared = (ParallelLoadShared *) shm_toc_lookup(toc,
+												   PARALLEL_LOAD_KEY_SHARED,
+												   false);
+	qspace = (char *) shm_toc_lookup(toc, PARALLEL_LOAD_KEY_QUEUES, false);
+	mq = (shm_mq *) (qspace + ParallelWorkerNumber * PARALLEL_LOAD_QUEUE_SIZE);
+	shm_mq_set_sender(mq, MyProc);
+	mqh = shm_mq_attach(mq, seg, NULL);
+
+	/* The leader holds the same lock, and we are in its lock group. */
+	rel = table_open(shared->relid, AccessShareLock);
+
+	/* The leader's active snapshot is the historic one. */
+	parallel_load_scan(rel, GetActiveSnapshot(), shared,
+					   parallel_load_send_tuple, mqh);
+
+	table_close(rel, AccessShareLock);
+	shm_mq_detach(mqh);
+}
+
+/*
+ * Initial load of a table that is being clustered by sorting, with both the
+ * heap scan and the sort split among parallel workers.
+ *
+ * Each worker scans chunks of blocks, like in perform_initial_load_parallel(),
+ * and sorts the tuples it has found. The leader then merges the sorted runs
+ * of all the workers and inserts the tuples into rel_dst. Returns false if no
+ * worker could be launched, so that the caller can do the work itself.
+ *
+ * The Sharedsort is allocated in a separate DSM segment, so that the sorted
+ * runs survive the parallel context. That way the tuples can be inserted after
+ * the parallel mode has ended, i.e. the TOAST values (which need OIDs) can be
+ * created w/o changing the order of the tuples.
+ *
+ * Like with the serial sort, the WAL cannot be decoded before the whole table
+ * has been scanned.
+ */
+static bool
+perform_initial_load_sort_parallel(Relation rel_src, Relation cluster_idx,
+								   Relation rel_dst)
+{
+	ParallelContext *pcxt;
+	ParallelLoadShared *shared;
+	ParallelSortShared *sort_shared;
+	dsm_segment *sort_seg;
+	Sharedsort *sharedsort;
+	SortCoordinate coordinate;
+	Tuplesortstate *tuplesort;
+	TuplesortInstrumentation sort_stats;
+	LoadInsertState istate;
+	BlockNumber nblocks;
+	int			nworkers,
+				nlaunched;
+	MemoryContext load_cxt,
+				old_cxt;
+	HeapTuple	tup;
+	int64		ntuples = 0;
+
+	nblocks = RelationGetNumberOfBlocks(rel_src);
+
+	EnterParallelMode();
+
+	pcxt = CreateParallelContext("pg_squeeze",
+								 "squeeze_cluster_sort_worker_main",
+								 squeeze_max_initial_load_workers);
+	shm_toc_estimate_chunk(&pcxt->estimator, sizeof(ParallelLoadShared));
+	shm_toc_estimate_chunk(&pcxt->estimator, sizeof(ParallelSortShared));
+	shm_toc_estimate_keys(&pcxt->estimator, 2);
+	InitializeParallelDSM(pcxt);
+
+	/* InitializeParallelDSM() might have reduced the number of workers. */
+	nworkers = pcxt->nworkers;
+	if (nworkers == 0)
+	{
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		return false;
+	}
+
+	sort_seg = dsm_create(tuplesort_estimate_shared(nworkers), 0);
+	sharedsort = (Sharedsort *) dsm_segment_address(sort_seg);
+	tuplesort_initialize_shared(sharedsort, nworkers, sort_seg);
+
+	shared = (ParallelLoadShared *) shm_toc_allocate(pcxt->toc,
+													 sizeof(ParallelLoadShared));
+	shared->relid = RelationGetRelid(rel_src);
+	shared->has_dropped_attr = has_dropped_attribute(rel_src);
+	pg_atomic_init_u64(&shared->next_block, 0);
+	shared->end_block = nblocks;
+	shm_toc_insert(pcxt->toc, PARALLEL_LOAD_KEY_SHARED, shared);
+
+	/* Like in _bt_begin_parallel(), split maintenance_work_mem. */
+	sort_shared = (ParallelSortShared *) shm_toc_allocate(pcxt->toc,
+														  sizeof(ParallelSortShared));
+	sort_shared->indexid = RelationGetRelid(cluster_idx);
+	sort_shared->sortmem = Max(maintenance_work_mem / nworkers, 64);
+	sort_shared->sort_seg = dsm_segment_handle(sort_seg);
+	shm_toc_insert(pcxt->toc, PARALLEL_LOAD_KEY_SORT, sort_shared);
+
+	{
+		const int	progress_index[] = {
+			PROGRESS_CLUSTER_PHASE,
+			PROGRESS_CLUSTER_TOTAL_HEAP_BLKS
+		};
+		int64		val[2];
+
+		val[0] = PROGRESS_CLUSTER_PHASE_SEQ_SCAN_HEAP;
+		val[1] = nblocks;
+		pgstat_progress_update_multi_param(2, progress_index, val);
+	}
+
+	LaunchParallelWorkers(pcxt);
+	nlaunched = pcxt->nworkers_launched;
+	if (nlaunched == 0)
+	{
+		DestroyParallelContext(pcxt);
+		ExitParallelMode();
+		dsm_detach(sort_seg);
+		return false;
+	}
+
+	/* This also reports errors of the workers. */
+	WaitForParallelWorkersToFinish(pcxt);
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+	pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_BLKS_SCANNED, nblocks);
+
+	/* Merge the runs of the workers. */
+	pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+								 PROGRESS_CLUSTER_PHASE_SORT_TUPLES);
+	coordinate = (SortCoordinate) palloc0(sizeof(SortCoordinateData));
+	coordinate->isWorker = false;
+	coordinate->nParticipants = nlaunched;
+	coordinate->sharedsort = sharedsort;
+	tuplesort = tuplesort_begin_cluster(RelationGetDescr(rel_src),
+										cluster_idx,
+										maintenance_work_mem,
+										coordinate,
+										false);
+	tuplesort_performsort(tuplesort);
+	tuplesort_get_stats(tuplesort, &sort_stats);
+	if (sort_stats.spaceType == SORT_SPACE_TYPE_DISK)
+		progress_add(&MyWorkerSlot->progress.sort_spill,
+					 sort_stats.spaceUsed * 1024);
+
+	pgstat_progress_update_param(PROGRESS_CLUSTER_PHASE,
+								 PROGRESS_CLUSTER_PHASE_WRITE_NEW_HEAP);
+	load_cxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "pg_squeeze initial load cxt",
+									 ALLOCSET_DEFAULT_SIZES);
+	old_cxt = MemoryContextSwitchTo(load_cxt);
+	load_insert_begin(&istate, rel_dst, false, InvalidOid);
+	while ((tup = tuplesort_getheaptuple(tuplesort, true)) != NULL)
+	{
+		exit_if_requested();
+		cost_delay_point();
+
+		/* Tuplesort owns the tuple it returned. */
+		load_insert_tuple(&istate, heap_copytuple(tup));
+		pgstat_progress_update_param(PROGRESS_CLUSTER_HEAP_TUPLES_SCANNED,
+									 ++ntuples);
+	}
+	load_insert_end(&istate);
+	MemoryContextSwitchTo(old_cxt);
+	MemoryContextDelete(load_cxt);
+
+	tuplesort_end(tuplesort);
+	pfree(coordinate);
+	dsm_detach(sort_seg);
+
+	return true;
+}
+
+/*
+ * ParallelLoadCallback of the parallel worker that sorts: add the tuple to
+ * its part of the shared sort.
+ */
+static void
+parallel_load_sort_tuple(HeapTuple tup, void *arg)
+{
+	tuplesort_putheaptuple((Tuplesortstate *) arg, tup);
+}
+
+/*
+ * Entry point of the parallel worker that helps with the initial load, see
+ * perform_initial_load_sort_parallel().
+ */
+void
+squeeze_cluster_sort_worker_main(dsm_segment *seg, shm_toc *toc)
+{
+	ParallelLoadShared *shared;
+	ParallelSortShared *sort_shared;
+	dsm_segment *sort_seg;
+	Sharedsort *sharedsort;
+	SortCoordinate coordinate;
+	Tuplesortstate *tuplesort;
+	Relation	rel,
+				index;
+
+	shared = (ParallelLoadShared *) shm_toc_lookup(toc,
+												   PARALLEL_LOAD_KEY_SHARED,
+												   false);
+	sort_shared = (ParallelSortShared *) shm_toc_lookup(toc,
+														PARALLEL_LOAD_KEY_SORT,
+														false);
+	sort_seg = dsm_attach(sort_shared->sort_seg);
+	if (sort_seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map dynamic shared memory segment")));
+	sharedsort = (Sharedsort *) dsm_segment_address(sort_seg);
+	tuplesort_attach_shared(sharedsort, sort_seg);
+
+	/* The leader holds the same locks, and we are in its lock group. */
+	rel = table_open(shared->relid, AccessShareLock);
+	index = index_open(sort_shared->indexid, AccessShareLock);
+
+	coordinate = (SortCoordinate) palloc0(sizeof(SortCoordinateData));
+	coordinate->isWorker = true;
+	coordinate->nParticipants = -1;
+	coordinate->sharedsort = sharedsort;
+	tuplesort = tuplesort_begin_cluster(RelationGetDescr(rel), index,
+										sort_shared->sortmem, coordinate,
+										false);
+
+	/* The leader's active snapshot is the historic one. */
+	parallel_load_scan(rel, GetActiveSnapshot(), shared,
+					   parallel_load_sort_tuple, tuplesort);
+
+	/* The sorted run stays in the shared file set for the leader. */
+	tuplesort_performsort(tuplesort);
+	tuplesort_end(tuplesort);
+
+	index_close(index, AccessShareLock);
+	table_close(rel, AccessShareLock);
+	dsm_detach(sort_seg);
+}
+
+/*
+ * Prepare insertion of tuples into 'rel' by table_multi_insert(), or by
+ * writing the pages directly if 'write_pages' is true. The latter requires
+ * 'rel' to be empty and not to be accessed in any other way until
+ * load_insert_end() is called.
+ *
+ * If the pages are written directly and toastrelid_src is valid, the
+ * TOAST values are copied from that relation, so the caller does not have
+ * to flatten the tuples. istate->keep_toast tells whether that is the case.
+ *
+ * The slots and pages are allocated in the current memory context, so it
+ * should live until load_insert_end() is called.
+ */
+static void
+load_insert_begin(LoadInsertState *istate, Relation rel, bool write_pages,
+				  Oid toastrelid_src)
+{
+	istate->rel = rel;
+	istate->bistate = GetBulkInsertState();
+	istate->mcxt = CurrentMemoryContext;
+	istate->nslots_created = 0;
+	istate->nslots = 0;
+	istate->nbytes = 0;
+	istate->writer = NULL;
+	istate->keep_toast = false;
+	istate->ntuples_written = 0;
+	istate->nbytes_written = 0;
+
+	if (write_pages)
+	{
+		LoadPageWriter *writer;
+
+		Assert(RelationGetNumberOfBlocks(rel) == 0);
+
+		writer = (LoadPageWriter *) palloc0(sizeof(LoadPageWriter));
+		writer->xid = GetCurrentTransactionId();
+		writer->cid = GetCurrentCommandId(true);
+		writer->save_free_space =
+			RelationGetTargetPageFreeSpace(rel, HEAP_DEFAULT_FILLFACTOR);
+		writer->blkno = 0;
+		writer->page = NULL;
+#if PG_VERSION_NUM >= 170000
+		writer->bulkstate = smgr_bulk_start_rel(rel, MAIN_FORKNUM);
+#else
+		for (int i = 0; i < LOAD_PAGES_MAX; i++)
+		{
+#if PG_VERSION_NUM >= 160000
+			writer->pages[i] = (Page) palloc_aligned(BLCKSZ, PG_IO_ALIGN_SIZE,
+													 0);
+#else
+			writer->pages[i] = (Page) palloc(BLCKSZ);
+#endif
+		}
+		writer->npages = 0;
+#endif
+
+#if PG_VERSION_NUM >= 130000
+		if (OidIsValid(toastrelid_src) &&
+			OidIsValid(rel->rd_rel->reltoastrelid))
+		{
+			writer->toastrel_src = table_open(toastrelid_src,
+											  AccessShareLock);
+			writer->valididx_src =
+				toast_open_indexes(writer->toastrel_src, AccessShareLock,
+								   &writer->toastidxs_src,
+								   &writer->num_toastidxs_src);
+			writer->toastrel_dst = table_open(rel->rd_rel->reltoastrelid,
+											  RowExclusiveLock);
+			writer->valididx_dst =
+				toast_open_indexes(writer->toastrel_dst, RowExclusiveLock,
+								   &writer->toastidxs_dst,
+								   &writer->num_toastidxs_dst);
+			writer->toast_bistate = GetBulkInsertState();
+
+			istate->keep_toast = true;
+		}
+#endif
+		istate->writer = writer;
+	}
+}
+
+/*
+ * Add a tuple to the buffer and insert the buffered tuples if the buffer is
+ * full.
+ *
+ * The tuple will be freed when inserted, so the caller must not use it
+ * anymore. The memory context of the tuple must not be reset before
+ * load_insert_flush() is called.
+ */
+static void
+load_insert_tuple(LoadInsertState *istate, HeapTuple tup)
+{
+	TupleTableSlot *slot;
+
+	cost_delay_point();
+
+	if (istate->writer)
+	{
+		load_page_add_tuple(istate, tup);
+		return;
+	}
+
+	if (istate->nslots == istate->nslots_created)
+	{
+		MemoryContext old_cxt;
+
+		old_cxt = MemoryContextSwitchTo(istate->mcxt);
+		istate->slots[istate->nslots_created++] =
+			MakeSingleTupleTableSlot(RelationGetDescr(istate->rel),
+									 &TTSOpsHeapTuple);
+		MemoryContextSwitchTo(old_cxt);
+	}
+	slot = istate->slots[istate->nslots++];
+	ExecStoreHeapTuple(tup, slot, true);
+	istate->nbytes += tup->t_len;
+
+	if (istate->nslots == LOAD_INSERT_MAX_TUPLES ||
+		istate->nbytes >= LOAD_INSERT_MAX_BYTES)
+		load_insert_flush(istate);
+}
+
+/*
+ * Insert the buffered tuples.
+ */
+static void
+load_insert_flush(LoadInsertState *istate)
+{
+	if (istate->nslots == 0)
+		return;
+
+	/*
+	 * Compared to heap_insert(), heap_multi_insert() writes one WAL record
+	 * per page and locks each page only once.
+	 */
+	table_multi_insert(istate->rel, istate->slots, istate->nslots,
+					   GetCurrentCommandId(true), 0, istate->bistate);
+
+	load_insert_report(istate, istate->nslots, istate->nbytes);
+
+	for (int i = 0; i < istate->nslots; i++)
+		ExecClearTuple(istate->slots[i]);
+	istate->nslots = 0;
+	istate->nbytes = 0;
+}
+
+/*
+ * Update the progress information after tuples have been written.
+ */
+static void
+load_insert_report(LoadInsertState *istate, int ntuples, Size nbytes)
+{
+	const int	progress_index[] = {
+		PROGRESS_CLUSTER_HEAP_TUPLES_WRITTEN,
+		PROGRESS_SQUEEZE_BYTES_WRITTEN
+	};
+	int64		val[2];
+
+	progress_add(&MyWorkerSlot->progress.ins_initial, ntuples);
+
+	istate->ntuples_written += ntuples;
+	istate->nbytes_written += nbytes;
+	val[0] = istate->ntuples_written;
+	val[1] = istate->nbytes_written;
+	pgstat_progress_update_multi_param(2, progress_index, val);
+}
+
+/*
+ * Insert the remaining tuples and release the resources.
+ */
+static void
+load_insert_end(LoadInsertState *istate)
+{
+	load_insert_flush(istate);
+
+	for (int i = 0; i < istate->nslots_created; i++)
+		ExecDropSingleTupleTableSlot(istate->slots[i]);
+	FreeBulkInsertState(istate->bistate);
+
+	if (istate->writer)
+	{
+		LoadPageWriter *writer = istate->writer;
+
+		if (writer->page)
+			load_page_finish(istate);
+#if PG_VERSION_NUM >= 170000
+		/* The bulk write facility takes care of WAL and fsync. */
+		smgr_bulk_finish(writer->bulkstate);
+#else
+		load_pages_write(istate);
+
+		/*
+		 * The pages did not go through shared buffers, so checkpoint cannot
+		 * have flushed them. If a checkpoint has started after we WAL-logged
+		 * the pages, crash recovery would not replay the WAL, so make sure
+		 * the pages are on disk. (See also end_heap_rewrite().)
+		 */
+		if (RelationNeedsWAL(istate->rel))
+		{
+#if PG_VERSION_NUM >= 150000
+			smgrimmedsync(RelationGetSmgr(istate->rel), MAIN_FORKNUM);
+#else
+			RelationOpenSmgr(istate->rel);
+			smgrimmedsync(istate->rel->rd_smgr, MAIN_FORKNUM);
+#endif
+		}
+
+		for (int i = 0; i < LOAD_PAGES_MAX; i++)
+			pfree(writer->pages[i]);
+#endif
+
+#if PG_VERSION_NUM >= 130000
+		if (istate->keep_toast)
+		{
+			FreeBulkInsertState(writer->toast_bistate);
+			toast_close_indexes(writer->toastidxs_dst,
+								writer->num_toastidxs_dst, RowExclusiveLock);
+			table_close(writer->toastrel_dst, RowExclusiveLock);
+			toast_close_indexes(writer->toastidxs_src,
+								writer->num_toastidxs_src, AccessShareLock);
+			table_close(writer->toastrel_src, AccessShareLock);
+		}
+#endif
+		pfree(writer);
+		istate->writer = NULL;
+	}
+}
+
+/*
+ * Add a tuple to the current page of the page writer, and start a new page
+ * if the current one is full.
+ *
+ * Like with load_insert_tuple(), the tuple is freed here.
+ */
+static void
+load_page_add_tuple(LoadInsertState *istate, HeapTuple tup)
+{
+	LoadPageWriter *writer = istate->writer;
+	Relation	rel = istate->rel;
+	HeapTuple	heaptup;
+	bool		need_toast = true;
+
+#if PG_VERSION_NUM >= 130000
+	/*
+	 * The TOAST pointers still point to the source table. Copy the values
+	 * and let the new tuple point to the copies. The TOAST values the tuple
+	 * had in the source table are what it needs in the transient table, so
+	 * make sure the toaster does not get involved.
+	 */
+	if (istate->keep_toast && HeapTupleHasExternal(tup))
+	{
+		HeapTuple	tup_new;
+
+		tup_new = load_copy_toast_values(istate, tup);
+		heap_freetuple(tup);
+		tup = tup_new;
+		need_toast = false;
+	}
+#endif
+
+	/* Initialize the header as heap_prepare_insert() does. */
+	tup->t_data->t_infomask &= ~(HEAP_XACT_MASK);
+	tup->t_data->t_infomask2 &= ~(HEAP2_XACT_MASK);
+	tup->t_data->t_infomask |= HEAP_XMAX_INVALID;
+	HeapTupleHeaderSetXmin(tup->t_data, writer->xid);
+	HeapTupleHeaderSetCmin(tup->t_data, writer->cid);
+	HeapTupleHeaderSetXmax(tup->t_data, 0);
+	tup->t_tableOid = RelationGetRelid(rel);
+
+	/*
+	 * The TOAST relation is not affected by the page writer, its tuples are
+	 * inserted in the regular way.
+	 */
+	if (need_toast &&
+		(HeapTupleHasExternal(tup) || tup->t_len > TOAST_TUPLE_THRESHOLD))
+	{
+#if PG_VERSION_NUM >= 130000
+		heaptup = heap_toast_insert_or_update(rel, tup, NULL,
+											  HEAP_INSERT_SKIP_FSM);
+#else
+		heaptup = toast_insert_or_update(rel, tup, NULL,
+										 HEAP_INSERT_SKIP_FSM);
+#endif
+	}
+	else
+		heaptup = tup;
+
+	load_page_add_item(istate, heaptup->t_data, heaptup->t_len);
+
+	if (heaptup != tup)
+		heap_freetuple(heaptup);
+	heap_freetuple(tup);
+}
+
+/*
+ * Copy a tuple of the source table to the current page of the page writer,
+ * w/o copying it to local memory first. The tuple can reside in a shared
+ * buffer, it's not modified.
+ *
+ * Returns false if the tuple needs to be processed by the toaster, in which
+ * case the caller should pass a copy of it to load_insert_tuple() instead.
+ */
+static bool
+load_page_copy_tuple(LoadInsertState *istate, HeapTuple tup)
+{
+	LoadPageWriter *writer = istate->writer;
+	HeapTupleHeader onpage;
+
+	if (HeapTupleHasExternal(tup) || tup->t_len > TOAST_TUPLE_THRESHOLD)
+		return false;
+
+	cost_delay_point();
+
+	onpage = load_page_add_item(istate, tup->t_data, tup->t_len);
+
+	/* Initialize the header like load_page_add_tuple() does. */
+	onpage->t_infomask &= ~(HEAP_XACT_MASK);
+	onpage->t_infomask2 &= ~(HEAP2_XACT_MASK);
+	onpage->t_infomask |= HEAP_XMAX_INVALID;
+	HeapTupleHeaderSetXmin(onpage, writer->xid);
+	HeapTupleHeaderSetCmin(onpage, writer->cid);
+	HeapTupleHeaderSetXmax(onpage, 0);
+
+	return true;
+}
+
+/*
+ * Add the tuple data to the current page of the page writer, and start a new
+ * page if the current one is full. Returns the header of the tuple on the
+ * page.
+ */
+static HeapTupleHeader
+load_page_add_item(LoadInsertState *istate, HeapTupleHeader data,
+				   uint32 data_len)
+{
+	LoadPageWriter *writer = istate->writer;
+	Size		len;
+	OffsetNumber off;
+	HeapTupleHeader onpage;
+
+	len = MAXALIGN(data_len);
+	if (len > MaxHeapTupleSize)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("row is too big: size %zu, maximum size %zu",
+						len, MaxHeapTupleSize)));
+
+	/*
+	 * Start a new page if the tuple does not fit into the current one. An
+	 * empty page accepts the tuple regardless the fillfactor.
+	 */
+	if (writer->page &&
+		len + writer->save_free_space > PageGetHeapFreeSpace(writer->page))
+		load_page_finish(istate);
+
+	if (writer->page == NULL)
+	{
+#if PG_VERSION_NUM >= 170000
+		writer->page = (Page) smgr_bulk_get_buf(writer->bulkstate);
+#else
+		writer->page = writer->pages[writer->npages];
+#endif
+		PageInit(writer->page, BLCKSZ, 0);
+	}
+
+	off = PageAddItem(writer->page, (Item) data, data_len,
+					  InvalidOffsetNumber, false, true);
+	if (off == InvalidOffsetNumber)
+		elog(ERROR, "failed to add tuple to page");
+
+	/* The tuple is not updated, so t_ctid points to the tuple itself. */
+	onpage = (HeapTupleHeader) PageGetItem(writer->page,
+										   PageGetItemId(writer->page, off));
+	ItemPointerSet(&onpage->t_ctid, writer->blkno, off);
+
+	writer->ntuples++;
+	writer->nbytes += data_len;
+
+	return onpage;
+}
+
+/*
+ * Submit the current page of the page writer for writing.
+ */
+static void
+load_page_finish(LoadInsertState *istate)
+{
+	LoadPageWriter *writer = istate->writer;
+
+	Assert(writer->page != NULL);
+
+#if PG_VERSION_NUM >= 170000
+	smgr_bulk_write(writer->bulkstate, writer->blkno,
+					(BulkWriteBuffer) writer->page, true);
+#else
+	writer->blknos[writer->npages++] = writer->blkno;
+	if (writer->npages == LOAD_PAGES_MAX)
+		load_pages_write(istate);
+#endif
+	writer->page = NULL;
+	writer->blkno++;
+
+#if PG_VERSION_NUM < 130000
+	/* The page does not go through the buffer manager. */
+	if (VacuumCostActive)
+		VacuumCostBalance += VacuumCostPageDirty;
+#endif
+
+	load_insert_report(istate, writer->ntuples, writer->nbytes);
+	writer->ntuples = 0;
+	writer->nbytes = 0;
+}
+
+#if PG_VERSION_NUM >= 130000
+/*
+ * Return a copy of 'tup' in which each TOAST pointer is replaced by a
+ * pointer to a copy of the value in the TOAST relation of the transient
+ * table.
+ */
+static HeapTuple
+load_copy_toast_values(LoadInsertState *istate, HeapTuple tup)
+{
+	TupleDesc	desc = RelationGetDescr(istate->rel);
+	Datum	   *values;
+	bool	   *isnull;
+	HeapTuple	result;
+
+	values = (Datum *) palloc(desc->natts * sizeof(Datum));
+	isnull = (bool *) palloc(desc->natts * sizeof(bool));
+	heap_deform_tuple(tup, desc, values, isnull);
+
+	for (int i = 0; i < desc->natts; i++)
+	{
+		if (isnull[i] || TupleDescAttr(desc, i)->attlen != -1)
+			continue;
 
-			if (use_sort)
-				tup_out = tuplesort_getheaptuple(tuplesort, true);
-			else
-			{
-				if (i == batch_size)
-					tup_out = NULL;
-				else
-					tup_out = tuples[i++];
-			}
+		if (VARATT_IS_EXTERNAL_ONDISK(DatumGetPointer(values[i])))
+			values[i] = load_copy_toast_value(istate->writer,
+											  (struct varlena *) DatumGetPointer(values[i]));
+	}
 
-			if (tup_out == NULL)
-				break;
+	result = heap_form_tuple(desc, values, isnull);
+	pfree(values);
+	pfree(isnull);
 
-			/*
-			 * Insert the tuple into the new table.
-			 *
-			 * XXX Should this happen outside load_cxt? Currently "bistate" is
-			 * a flat object (i.e. it does not point to any memory chunk that
-			 * the previous call of heap_insert() might have allocated) and
-			 * thus the cleanup between batches should not damage it, but
-			 * can't it get more complex in future PG versions?
-			 */
-			heap_insert(rel_dst, tup_out, GetCurrentCommandId(true), 0,
-						bistate);
+	return result;
+}
 
-			/* Update the progress information. */
-			SpinLockAcquire(&MyWorkerSlot->mutex);
-			MyWorkerSlot->progress.ins_initial += 1;
-			SpinLockRelease(&MyWorkerSlot->mutex);
+/*
+ * Copy the chunks of a TOAST value to the TOAST relation of the transient
+ * table and return the new TOAST pointer.
+ *
+ * Unlike toast_save_datum(), we do not care whether the value is compressed
+ * or not: the chunks are copied as they are, only the value OID changes.
+ */
+static Datum
+load_copy_toast_value(LoadPageWriter *writer, struct varlena *attr)
+{
+	struct varatt_external toast_pointer;
+	struct varlena *result;
+	Oid			valueid;
+	ScanKeyData key;
+	SnapshotData SnapshotToast;
+	SysScanDesc scan;
+	HeapTuple	ttup;
+	TupleDesc	desc_src = RelationGetDescr(writer->toastrel_src);
+	TupleDesc	desc_dst = RelationGetDescr(writer->toastrel_dst);
+	Datum		t_values[3];
+	bool		t_isnull[3];
+	int			nchunks = 0;
+
+	VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+	if (toast_pointer.va_toastrelid != RelationGetRelid(writer->toastrel_src))
+		elog(ERROR, "TOAST pointer refers to unexpected relation %u",
+			 toast_pointer.va_toastrelid);
+
+	valueid = GetNewOidWithIndex(writer->toastrel_dst,
+								 RelationGetRelid(writer->toastidxs_dst[writer->valididx_dst]),
+								 (AttrNumber) 1);
+
+	/* Retrieve the chunks as heap_fetch_toast_slice() does. */
+	ScanKeyInit(&key,
+				(AttrNumber) 1,
+				BTEqualStrategyNumber, F_OIDEQ,
+				ObjectIdGetDatum(toast_pointer.va_valueid));
+	init_toast_snapshot(&SnapshotToast);
+	scan = systable_beginscan_ordered(writer->toastrel_src,
+									  writer->toastidxs_src[writer->valididx_src],
+									  &SnapshotToast, 1, &key);
+	while ((ttup = systable_getnext_ordered(scan, ForwardScanDirection)) != NULL)
+	{
+		HeapTuple	ttup_new;
 
-			if (!use_sort)
-				pfree(tup_out);
-		}
+		heap_deform_tuple(ttup, desc_src, t_values, t_isnull);
+		t_values[0] = ObjectIdGetDatum(valueid);
+		ttup_new = heap_form_tuple(desc_dst, t_values, t_isnull);
 
-		/*
-		 * Reached the end of scan when retrieving data from heap or index?
-		 */
-		if (tup_in == NULL)
-			break;
+		/* Insert the chunk as toast_save_datum() does. */
+		heap_insert(writer->toastrel_dst, ttup_new, writer->cid, 0,
+					writer->toast_bistate);
+		for (int i = 0; i < writer->num_toastidxs_dst; i++)
+		{
+			Relation	toastidx = writer->toastidxs_dst[i];
 
-		/*
-		 * Free possibly-leaked memory.
-		 */
-		MemoryContextReset(load_cxt);
+			if (!toastidx->rd_index->indisready)
+				continue;
 
-		/*
-		 * Decode the WAL produced by the load, as well as by other
-		 * transactions, so that the replication slot can advance and WAL does
-		 * not pile up. Of course we must not apply the changes until the
-		 * initial load has completed.
-		 *
-		 * Note that the insertions into the new table shouldn't actually be
-		 * decoded, they should be filtered out by their origin.
-		 */
-#if PG_VERSION_NUM >= 150000
-		end_of_wal = GetFlushRecPtr(NULL);
-#else
-		end_of_wal = GetFlushRecPtr();
+			index_insert(toastidx, t_values, t_isnull, &ttup_new->t_self,
+						 writer->toastrel_dst,
+						 toastidx->rd_index->indisunique ?
+						 UNIQUE_CHECK_YES : UNIQUE_CHECK_NO,
+#if PG_VERSION_NUM >= 140000
+						 false,
 #endif
-		if (end_of_wal > end_of_wal_prev)
-		{
-			MemoryContextSwitchTo(old_cxt);
-			decode_concurrent_changes(ctx, end_of_wal, NULL);
-			MemoryContextSwitchTo(load_cxt);
+						 NULL);
 		}
-		end_of_wal_prev = end_of_wal;
+		heap_freetuple(ttup_new);
+		nchunks++;
 	}
+	systable_endscan_ordered(scan);
 
-	/*
-	 * At whichever stage the loop broke, the historic snapshot should no
-	 * longer be active.
-	 */
-
-	/* Cleanup. */
-	FreeBulkInsertState(bistate);
-
-	if (use_sort)
-		tuplesort_end(tuplesort);
-	else
-		pfree(tuples);
+	if (nchunks == 0)
+		elog(ERROR, "missing chunks for toast value %u in %s",
+			 toast_pointer.va_valueid,
+			 RelationGetRelationName(writer->toastrel_src));
 
-	if (heap_scan != NULL)
-		table_endscan(heap_scan);
+	/* The new pointer only differs in the OIDs. */
+	toast_pointer.va_valueid = valueid;
+	toast_pointer.va_toastrelid = RelationGetRelid(writer->toastrel_dst);
+	result = (struct varlena *) palloc(TOAST_POINTER_SIZE);
+	SET_VARTAG_EXTERNAL(result, VARTAG_ONDISK);
+	memcpy(VARDATA_EXTERNAL(result), &toast_pointer, sizeof(toast_pointer));
 
-	if (index_scan != NULL)
-		index_endscan(index_scan);
+	return PointerGetDatum(result);
+}
+#endif
 
-	ExecDropSingleTupleTableSlot(slot);
+#if PG_VERSION_NUM < 170000
+/*
+ * WAL-log the collected pages and write them out.
+ *
+ * Since the relation is new, full-page image of each page is what we need
+ * to log. Once it's in WAL, write the page using smgr.
+ */
+static void
+load_pages_write(LoadInsertState *istate)
+{
+	LoadPageWriter *writer = istate->writer;
+	Relation	rel = istate->rel;
+	SMgrRelation smgr;
 
-	/*
-	 * Unlock the index, but not the relation yet - caller will do so when
-	 * appropriate.
-	 */
-	if (cluster_idx != NULL)
-		relation_close(cluster_idx, AccessShareLock);
+	if (writer->npages == 0)
+		return;
 
-	MemoryContextSwitchTo(old_cxt);
-	MemoryContextDelete(load_cxt);
+	if (RelationNeedsWAL(rel))
+	{
+#if PG_VERSION_NUM >= 160000
+		log_newpages(&rel->rd_locator, MAIN_FORKNUM, writer->npages,
+					 writer->blknos, writer->pages, true);
+#elif PG_VERSION_NUM >= 140000
+		log_newpages(&rel->rd_node, MAIN_FORKNUM, writer->npages,
+					 writer->blknos, writer->pages, true);
+#else
+		for (int i = 0; i < writer->npages; i++)
+			log_newpage(&rel->rd_node, MAIN_FORKNUM, writer->blknos[i],
+						writer->pages[i], true);
+#endif
+	}
 
-	elog(DEBUG1, "pg_squeeze: the initial load completed");
+#if PG_VERSION_NUM >= 150000
+	smgr = RelationGetSmgr(rel);
+#else
+	RelationOpenSmgr(rel);
+	smgr = rel->rd_smgr;
+#endif
+	for (int i = 0; i < writer->npages; i++)
+	{
+		PageSetChecksumInplace(writer->pages[i], writer->blknos[i]);
+		/* fsync is not needed, see load_insert_end(). */
+		smgrextend(smgr, MAIN_FORKNUM, writer->blknos[i],
+				   (char *) writer->pages[i], true);
+	}
+	writer->npages = 0;
 }
+#endif
 
 /*
  * Check if relation has at least one dropped attribute.
@@ -2612,12 +5209,42 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
 	int			i;
 	Oid		   *result;
 	XLogRecPtr	end_of_wal_prev = InvalidXLogRecPtr;
+	int			guc_nestlevel = -1;
 
 	Assert(nindexes > 0);
 
+	/*
+	 * index_build() uses parallel workers when it can, but the number of
+	 * workers is controlled by max_parallel_maintenance_workers. If the user
+	 * wants a different value for pg_squeeze, set it until we're done.
+	 */
+	if (squeeze_max_parallel_index_workers >= 0)
+	{
+		char		value[16];
+
+		snprintf(value, sizeof(value), "%d",
+				 squeeze_max_parallel_index_workers);
+		guc_nestlevel = NewGUCNestLevel();
+		(void) set_config_option("max_parallel_maintenance_workers", value,
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+	}
+
 	ind_name = makeStringInfo();
 	result = (Oid *) palloc(nindexes * sizeof(Oid));
 
+	{
+		const int	progress_index[] = {
+			PROGRESS_CLUSTER_PHASE,
+			PROGRESS_SQUEEZE_INDEXES_TOTAL
+		};
+		int64		val[2];
+
+		val[0] = PROGRESS_CLUSTER_PHASE_REBUILD_INDEX;
+		val[1] = nindexes;
+		pgstat_progress_update_multi_param(2, progress_index, val);
+	}
+
 	for (i = 0; i < nindexes; i++)
 	{
 		Oid			ind_oid,
@@ -2847,6 +5474,15 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
 		if (reloptions)
 			pfree(reloptions);
 
+		pgstat_progress_update_param(PROGRESS_CLUSTER_INDEX_REBUILD_COUNT,
+									 i + 1);
+
+		/*
+		 * index_build() does not let us sleep, so pay for its I/O before the
+		 * next index is built. (The sleep is capped, see cost_delay_point().)
+		 */
+		cost_delay_point();
+
 		/*
 		 * Like in perform_initial_load(), process some WAL so that the
 		 * segment files can be recycled. Unlike the initial load, do not set
@@ -2863,6 +5499,10 @@ build_transient_indexes(Relation rel_dst, Relation rel_src,
 		end_of_wal_prev = end_of_wal;
 	}
 
+	/* Restore max_parallel_maintenance_workers. */
+	if (guc_nestlevel >= 0)
+		AtEOXact_GUC(true, guc_nestlevel);
+
 	return result;
 }
 
@@ -2951,6 +5591,8 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 	struct timeval t_end;
 	struct timeval *t_end_ptr = NULL;
 	char		dummy_rec_data = '\0';
+	TimestampTz lock_start,
+				work_start;
 
 	/*
 	 * Lock the source table exclusively last time, to finalize the work.
@@ -2975,7 +5617,11 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 	 * lock and performed its scan. (And of course, waiting for transactions
 	 * A, B, ... to complete while holding the exclusive lock can cause
 	 * deadlocks.)
+	 *
+	 * The lock manager reports the wait event itself, we only measure the
+	 * time.
 	 */
+	lock_start = GetCurrentTimestamp();
 	LockRelationOid(relid_src, AccessExclusiveLock);
 
 	/*
@@ -2986,6 +5632,9 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 	 */
 	for (i = 0; i < nindexes; i++)
 		LockRelationOid(indexes_src[i], AccessExclusiveLock);
+	work_start = GetCurrentTimestamp();
+	progress_add(&MyWorkerSlot->progress.lock_wait_time,
+				 work_start - lock_start);
 
 	if (squeeze_max_xlock_time > 0)
 	{
@@ -3092,9 +5741,142 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
 				ctx->output_writer_private)->nchanges == 0);
 	}
 
+	progress_add_elapsed(&MyWorkerSlot->progress.final_merge_time,
+						 work_start);
+	progress_sample_memory();
+
 	return success;
 }
 
+/*
+ * Decode and apply the concurrent changes without holding the exclusive lock
+ * until the rest of them can probably be processed within
+ * squeeze_max_xlock_time.
+ *
+ * The prediction is based on the distance between the decoded position and
+ * the WAL flush position, and on the rate (WAL bytes per second) at which the
+ * previous round has decoded and applied the changes. The rate is stored in
+ * *stats, so the next call (after the lock had to be released) can make use
+ * of it.
+ */
+static void
+catch_up_before_final_merge(LogicalDecodingContext *ctx,
+							CatalogState *cat_state, Relation rel_dst,
+							ScanKey ident_key, int ident_key_nentries,
+							IndexInsertState *iistate, CatchUpStats *stats)
+{
+	double		max_time;
+
+	/* Seconds. */
+	max_time = XLOCK_TIME_FRACTION * squeeze_max_xlock_time / 1000.0;
+
+	for (int round = 0; round < CATCH_UP_MAX_ROUNDS; round++)
+	{
+		XLogRecPtr	start_lsn,
+					end_lsn,
+					end_of_wal;
+		struct timeval t_start,
+					t_end;
+		double		elapsed;
+
+		/* A new reader (PG < 13) will start at restart_lsn. */
+		start_lsn = ctx->reader->EndRecPtr;
+		if (XLogRecPtrIsInvalid(start_lsn))
+			start_lsn = MyReplicationSlot->data.restart_lsn;
+
+#if PG_VERSION_NUM >= 150000
+		end_of_wal = GetFlushRecPtr(NULL);
+#else
+		end_of_wal = GetFlushRecPtr();
+#endif
+		stats->remaining = end_of_wal > start_lsn ? end_of_wal - start_lsn : 0;
+
+		/* Do we expect to complete in time? */
+		if (stats->remaining == 0 ||
+			(stats->rate > 0 && stats->remaining / stats->rate <= max_time))
+			break;
+
+		gettimeofday(&t_start, NULL);
+		process_concurrent_changes(ctx, end_of_wal, cat_state, rel_dst,
+								   ident_key, ident_key_nentries, iistate,
+								   NoLock, NULL);
+		gettimeofday(&t_end, NULL);
+
+		end_lsn = ctx->reader->EndRecPtr;
+		elapsed = (t_end.tv_sec - t_start.tv_sec) +
+			(t_end.tv_usec - t_start.tv_usec) / (double) USECS_PER_SEC;
+		if (elapsed > 0 && end_lsn > start_lsn)
+			stats->rate = (end_lsn - start_lsn) / elapsed;
+
+		stats->rounds++;
+		progress_add(&MyWorkerSlot->progress.catch_up_rounds, 1);
+
+		elog(DEBUG1,
+			 "pg_squeeze: catch-up round processed " UINT64_FORMAT " bytes of WAL at %.0f bytes per second",
+			 (uint64) (end_lsn - start_lsn), stats->rate);
+	}
+}
+
+/*
+ * Set pg_class(relpages, reltuples) of the transient table, so that
+ * swap_relation_files() passes them to the source table.
+ */
+static void
+set_transient_relstats(Oid relid, BlockNumber relpages, double reltuples)
+{
+	Relation	relRelation;
+	HeapTuple	reltup;
+	Form_pg_class relform;
+
+	relRelation = table_open(RelationRelationId, RowExclusiveLock);
+
+	reltup = SearchSysCacheCopy1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(reltup))
+		elog(ERROR, "cache lookup failed for relation %u", relid);
+	relform = (Form_pg_class) GETSTRUCT(reltup);
+
+	relform->relpages = (int32) relpages;
+	relform->reltuples = (float4) reltuples;
+	CatalogTupleUpdate(relRelation, &reltup->t_self, reltup);
+
+	heap_freetuple(reltup);
+	table_close(relRelation, RowExclusiveLock);
+}
+
+/*
+ * Swap the storage of rels1[i] and rels2[i] for each i < nrels. The heap
+ * should come first, followed by the indexes.
+ *
+ * All the pairs are processed in a single pass over pg_class, and no
+ * CommandCounterIncrement() is done, so the relcache invalidations are
+ * processed once, by the caller's next CommandCounterIncrement(). That
+ * matters because we hold AccessExclusiveLock on the source table.
+ */
+static void
+swap_relation_files(Oid *rels1, Oid *rels2, int nrels)
+{
+	Relation	relRelation;
+	CatalogIndexState indstate;
+	int			i;
+
+	relRelation = table_open(RelationRelationId, RowExclusiveLock);
+	indstate = CatalogOpenIndexes(relRelation);
+
+	for (i = 0; i < nrels; i++)
+		swap_relation_pair(relRelation, indstate, rels1[i], rels2[i]);
+
+	CatalogCloseIndexes(indstate);
+	table_close(relRelation, RowExclusiveLock);
+
+#if PG_VERSION_NUM < 170000
+	for (i = 0; i < nrels; i++)
+	{
+		RelationCloseSmgrByOid(rels1[i]);
+		RelationCloseSmgrByOid(rels2[i]);
+	}
+#endif
+}
+
 /*
  * Derived from swap_relation_files() in PG core, but removed anything we
  * don't need. Also incorporated the relevant parts of finish_heap_swap().
@@ -3106,9 +5888,9 @@ perform_final_merge(Oid relid_src, Oid *indexes_src, int nindexes,
  * change if we preform regular rewrite instead of INSERT INTO ... SELECT ...
  */
 static void
-swap_relation_files(Oid r1, Oid r2)
+swap_relation_pair(Relation relRelation, CatalogIndexState indstate, Oid r1,
+				   Oid r2)
 {
-	Relation	relRelation;
 	HeapTuple	reltup1,
 				reltup2;
 	Form_pg_class relform1,
@@ -3116,11 +5898,8 @@ swap_relation_files(Oid r1, Oid r2)
 	Oid			relfilenode1,
 				relfilenode2;
 	Oid			swaptemp;
-	CatalogIndexState indstate;
 
 	/* We need writable copies of both pg_class tuples. */
-	relRelation = table_open(RelationRelationId, RowExclusiveLock);
-
 	reltup1 = SearchSysCacheCopy1(RELOID, ObjectIdGetDatum(r1));
 	if (!HeapTupleIsValid(reltup1))
 		elog(ERROR, "cache lookup failed for relation %u", r1);
@@ -3179,25 +5958,39 @@ swap_relation_files(Oid r1, Oid r2)
 		relform1->relminmxid = cutoffMulti;
 	}
 
+	/*
+	 * Swap the size statistics too, since the transient relation has them
+	 * up-to-date: index_build() set them for the indexes, and
+	 * set_transient_relstats() for the table. Thus ANALYZE is not needed
+	 * just to get them right. (pg_statistic is not affected by the swap
+	 * because the OIDs do not change.)
+	 */
+	{
+		int32		swap_pages;
+		float4		swap_tuples;
+
+		swap_pages = relform1->relpages;
+		relform1->relpages = relform2->relpages;
+		relform2->relpages = swap_pages;
+
+		swap_tuples = relform1->reltuples;
+		relform1->reltuples = relform2->reltuples;
+		relform2->reltuples = swap_tuples;
+	}
+
 	/*
 	 * Adjust pg_class fields of the relation (relform2 can be ignored as the
 	 * transient relation will get dropped.)
 	 *
 	 * There's no reason to expect relallvisible to be non-zero. The next
 	 * VACUUM should fix it.
-	 *
-	 * As for relpages and reltuples, neither includes concurrent changes (are
-	 * those worth any calculation?), so leave the original values. The next
-	 * ANALYZE will fix them.
 	 */
 	relform1->relallvisible = 0;
 
-	indstate = CatalogOpenIndexes(relRelation);
 	CatalogTupleUpdateWithInfo(relRelation, &reltup1->t_self, reltup1,
 							   indstate);
 	CatalogTupleUpdateWithInfo(relRelation, &reltup2->t_self, reltup2,
 							   indstate);
-	CatalogCloseIndexes(indstate);
 
 	InvokeObjectPostAlterHookArg(RelationRelationId, r1, 0,
 								 InvalidOid, true);
@@ -3256,13 +6049,6 @@ swap_relation_files(Oid r1, Oid r2)
 
 	heap_freetuple(reltup1);
 	heap_freetuple(reltup2);
-
-	table_close(relRelation, RowExclusiveLock);
-
-#if PG_VERSION_NUM < 170000
-	RelationCloseSmgrByOid(r1);
-	RelationCloseSmgrByOid(r2);
-#endif
 }
 
 /*
@@ -3272,6 +6058,7 @@ swap_relation_files(Oid r1, Oid r2)
  * relid2 refer to the transient relation in the same manner.
  *
  * The storage of TOAST tables and their indexes have already been swapped.
+ * The caller is responsible for CommandCounterIncrement() afterwards.
  *
  * On exit we hold AccessExclusiveLock on the TOAST relations and their indexes.
  */
@@ -3314,6 +6101,11 @@ swap_toast_names(Oid relid1, Oid toastrelid1, Oid relid2, Oid toastrelid2)
 		 * one should need read / write access to the TOAST indexes).
 		 */
 		RenameRelationInternal(toastidxid, name, true, false);
+
+		/*
+		 * The old names must not be visible when checking whether the new
+		 * ones are unique.
+		 */
 		CommandCounterIncrement();
 	}
 
@@ -3329,7 +6121,6 @@ swap_toast_names(Oid relid1, Oid toastrelid1, Oid relid2, Oid toastrelid2)
 #endif
 	snprintf(name, NAMEDATALEN, "pg_toast_%u_index", relid1);
 	RenameRelationInternal(toastidxid, name, true, false);
-	CommandCounterIncrement();
 }
 
 #if PG_VERSION_NUM < 130000
@@ -3384,8 +6175,67 @@ get_heap_fillfactor(PG_FUNCTION_ARGS)
 	PG_RETURN_INT32(fillfactor);
 }
 
+/*
+ * The following is copied from freespace.c, which does not export it.
+ */
+#define FSM_CATEGORIES	256
+#define FSM_CAT_STEP	(BLCKSZ / FSM_CATEGORIES)
+#define MaxFSMRequestSize	MaxHeapTupleSize
+#define FSM_TREE_DEPTH	((SlotsPerFSMPage >= 1626) ? 3 : 4)
+
+/*
+ * Return physical block number of the FSM leaf page 'leafno', see
+ * fsm_logical_to_physical() in freespace.c.
+ */
+static BlockNumber
+fsm_leaf_to_physical(BlockNumber leafno)
+{
+	BlockNumber pages = 0;
+	int			l;
+
+	for (l = 0; l < FSM_TREE_DEPTH; l++)
+	{
+		pages += leafno + 1;
+		leafno /= SlotsPerFSMPage;
+	}
+
+	return pages - 1;
+}
+
+/*
+ * Return the free space recorded in the first 'nslots' slots of an FSM leaf
+ * page.
+ */
+static uint64
+fsm_leaf_page_free(Page page, int nslots)
+{
+	FSMPage		fsmpage = (FSMPage) PageGetContents(page);
+	uint8	   *cats = &fsmpage->fp_nodes[NonLeafNodesPerPage];
+	uint64		sum = 0;
+	uint64		nmax = 0;
+	int			i;
+
+	/*
+	 * Keep the loop trivial so that the compiler can vectorize it. The
+	 * highest category needs special treatment, see fsm_space_cat_to_avail().
+	 */
+	for (i = 0; i < nslots; i++)
+	{
+		sum += cats[i];
+		nmax += cats[i] == FSM_CATEGORIES - 1;
+	}
+
+	return (sum - nmax * (FSM_CATEGORIES - 1)) * FSM_CAT_STEP +
+		nmax * MaxFSMRequestSize;
+}
+
 /*
  * Return fraction of free space in a relation, as indicated by FSM.
+ *
+ * Rather than calling GetRecordedFreeSpace() for each heap block, read the
+ * FSM leaf pages directly, each of which covers SlotsPerFSMPage heap blocks.
+ * If the second argument is passed, only that percentage of the leaf pages,
+ * randomly selected, is read.
  */
 extern Datum get_heap_freespace(PG_FUNCTION_ARGS);
 
@@ -3395,14 +6245,28 @@ get_heap_freespace(PG_FUNCTION_ARGS)
 {
 	Oid			relid;
 	Relation	rel;
-	BlockNumber blkno,
-				nblocks;
-	Size		free,
+	SMgrRelation smgr;
+	BlockNumber nblocks,
+				fsm_nblocks,
+				nleaves,
+				nsample;
+	double		sample_percent = 100.0;
+	BlockSamplerData bs;
+	BufferAccessStrategy bstrategy;
+	uint64		free,
 				total;
 	float8		result;
-	bool		fsm_exists = true;
 
 	relid = PG_GETARG_OID(0);
+	if (PG_NARGS() > 1 && !PG_ARGISNULL(1))
+		sample_percent = PG_GETARG_FLOAT4(1);
+
+	/* The negated form also rejects NaN. */
+	if (!(sample_percent > 0.0 && sample_percent <= 100.0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample percentage must be greater than zero and not greater than 100")));
+
 	rel = table_open(relid, AccessShareLock);
 	nblocks = RelationGetNumberOfBlocks(rel);
 
@@ -3413,34 +6277,70 @@ get_heap_freespace(PG_FUNCTION_ARGS)
 		PG_RETURN_NULL();
 	}
 
-	free = 0;
-	total = 0;
-	for (blkno = 0; blkno < nblocks; blkno++)
+#if PG_VERSION_NUM >= 150000
+	smgr = RelationGetSmgr(rel);
+#else
+	RelationOpenSmgr(rel);
+	smgr = rel->rd_smgr;
+#endif
+	/* Missing FSM does not mean that the relation is full. */
+	if (!smgrexists(smgr, FSM_FORKNUM))
 	{
-		free += GetRecordedFreeSpace(rel, blkno);
-		total += BLCKSZ;
+		RelationCloseSmgr(rel);
+		table_close(rel, AccessShareLock);
+		PG_RETURN_NULL();
 	}
+	fsm_nblocks = smgrnblocks(smgr, FSM_FORKNUM);
 
-	/*
-	 * If the relation seems to be full, verify that missing FSM is not the
-	 * reason.
-	 */
-	if (free == 0)
-	{
+	nleaves = (nblocks - 1) / SlotsPerFSMPage + 1;
+	nsample = (BlockNumber) ceil(nleaves * sample_percent / 100.0);
+	nsample = Max(nsample, 1);
+	nsample = Min(nsample, nleaves);
+	/* If nsample equals nleaves, the sampler returns all the pages. */
 #if PG_VERSION_NUM >= 150000
-		if (!smgrexists(RelationGetSmgr(rel), FSM_FORKNUM))
-			fsm_exists = false;
+	BlockSampler_Init(&bs, nleaves, nsample,
+					  pg_prng_uint32(&pg_global_prng_state));
 #else
-		RelationOpenSmgr(rel);
-		if (!smgrexists(rel->rd_smgr, FSM_FORKNUM))
-			fsm_exists = false;
+	BlockSampler_Init(&bs, nleaves, nsample, random());
 #endif
-		RelationCloseSmgr(rel);
+
+	/* Do not let the FSM pages replace the useful contents of the buffers. */
+	bstrategy = GetAccessStrategy(BAS_BULKREAD);
+
+	free = 0;
+	total = 0;
+	while (BlockSampler_HasMore(&bs))
+	{
+		BlockNumber leafno = BlockSampler_Next(&bs);
+		BlockNumber physblk;
+		int			nslots;
+		Buffer		buf;
+		Page		page;
+
+		/* The last leaf page is not necessarily used entirely. */
+		nslots = Min(SlotsPerFSMPage,
+					 nblocks - leafno * SlotsPerFSMPage);
+		total += (uint64) nslots * BLCKSZ;
+
+		/* Pages beyond the end of FSM are treated as zeroes. */
+		physblk = fsm_leaf_to_physical(leafno);
+		if (physblk < fsm_nblocks)
+		{
+			buf = ReadBufferExtended(rel, FSM_FORKNUM, physblk,
+									 RBM_ZERO_ON_ERROR, bstrategy);
+			LockBuffer(buf, BUFFER_LOCK_SHARE);
+			page = BufferGetPage(buf);
+			if (!PageIsNew(page))
+				free += fsm_leaf_page_free(page, nslots);
+			UnlockReleaseBuffer(buf);
+		}
+
+		CHECK_FOR_INTERRUPTS();
 	}
-	table_close(rel, AccessShareLock);
+	FreeAccessStrategy(bstrategy);
 
-	if (!fsm_exists)
-		PG_RETURN_NULL();
+	RelationCloseSmgr(rel);
+	table_close(rel, AccessShareLock);
 
 	result = (float8) free / total;
 	PG_RETURN_FLOAT8(result);
@@ -3474,6 +6374,9 @@ squeeze_handle_error_db(ErrorData **edata_p, MemoryContext edata_cxt)
 	if (IsTransactionState())
 		AbortOutOfAnyTransaction();
 
+	/* Do not slow down the remaining work of the worker. */
+	cost_delay_end();
+
 	/*
 	 * Now that the transaction is aborted, we can run a new one to drop the
 	 * origin.
@@ -3545,4 +6448,11 @@ manage_session_origin(Oid relid)
 		my_relid = InvalidOid;
 	}
 	CommitTransactionCommand();
+
+	/*
+	 * Only advertise the origin after the transaction that created it has
+	 * committed, see is_worker_origin(). (When dropping, the origin is
+	 * already invalid.)
+	 */
+	set_worker_origin(replorigin_session_origin);
 }
@@ -26,19 +26,30 @@
 #endif
 #include "access/xlog_internal.h"
 #include "catalog/pg_class.h"
+#include "commands/progress.h"
 #include "nodes/execnodes.h"
 #include "postmaster/bgworker.h"
 #include "replication/logical.h"
 #if PG_VERSION_NUM < 130000
 #include "replication/logicalfuncs.h"
 #endif
+#include "port/atomics.h"
 #include "replication/origin.h"
+#include "storage/buffile.h"
 #include "storage/ipc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
 #include "utils/array.h"
 #include "utils/inval.h"
 #include "utils/resowner.h"
 #include "utils/snapmgr.h"
 
+#if PG_VERSION_NUM < 160000
+/* PG 16 renamed RelFileNode to RelFileLocator. */
+typedef RelFileNode RelFileLocator;
+#define RelFileLocatorEquals(a, b)	RelFileNodeEquals(a, b)
+#endif
+
 /*
  * No underscore, names starting with "pg_" are reserved. See
  * pg_replication_origin_create().
@@ -47,6 +58,15 @@
 #define REPLORIGIN_NAME_PATTERN		REPLORIGIN_NAME_PREFIX "%u_%u"
 
 extern int			squeeze_max_xlock_time;
+extern int			squeeze_max_initial_load_workers;
+extern int			squeeze_cluster_sort_min_size;
+extern int			squeeze_max_parallel_index_workers;
+extern bool			squeeze_coalesce_changes;
+extern bool			squeeze_pipelined_decoding;
+extern int			squeeze_spill_compression;
+extern double		squeeze_tail_percent;
+extern int			squeeze_cost_limit;
+extern double		squeeze_cost_delay;
 
 typedef enum
 {
@@ -64,13 +84,69 @@ typedef struct ConcurrentChange
 	/*
 	 * The actual tuple.
 	 *
-	 * The tuple data follows the ConcurrentChange structure. Before use make
-	 * sure the tuple is correctly aligned (ConcurrentChange can be stored as
-	 * bytea) and that tuple->t_data is fixed.
+	 * The tuple data follows the ConcurrentChange structure, see
+	 * CHANGE_RECORD_SIZE. tuple->t_data is only valid for changes returned
+	 * by the ChangeBuffer read functions.
 	 */
 	HeapTupleData tup_data;
 } ConcurrentChange;
 
+/* Compression of the changes written to disk. */
+typedef enum SpillCompression
+{
+	SPILL_COMPRESSION_OFF,
+	SPILL_COMPRESSION_PGLZ,
+	SPILL_COMPRESSION_LZ4
+} SpillCompression;
+
+/* Size of the ConcurrentChange record containing tuple of size 'len'. */
+#define CHANGE_HEADER_SIZE		MAXALIGN(sizeof(ConcurrentChange))
+#define CHANGE_RECORD_SIZE(len)	(CHANGE_HEADER_SIZE + MAXALIGN(len))
+
+/*
+ * Append-only storage of ConcurrentChange records.
+ *
+ * The records are appended to a memory arena. Once the arena reaches
+ * max_size, its contents is written to a temporary file at once, and the
+ * arena is reused. If compression is enabled, the arena is written in chunks
+ * of whole records, each compressed separately. The records are aligned, so
+ * those in the arena can be used in place. The changes are read in the order
+ * they were added, i.e. those in the file first. No change may be added until
+ * all the changes are read.
+ */
+typedef struct ChangeBuffer
+{
+	MemoryContext mcxt;
+	SpillCompression compression;
+
+	char	   *data;			/* the arena */
+	Size		size;			/* allocated size of the arena */
+	Size		used;			/* bytes occupied by the records */
+	Size		max_size;
+
+	BufFile    *file;			/* NULL if nothing was spilled yet */
+	off_t		file_size;		/* bytes occupied by the records */
+
+	/* The read position. */
+	bool		reading;
+	off_t		file_pos;
+	Size		data_pos;
+
+	/* Records read from the file are retrieved here. */
+	char	   *read_buf;
+	Size		read_buf_size;
+
+	/*
+	 * If the file is compressed, read_buf contains the whole chunk last
+	 * read, and these are the position of the next record in it and the
+	 * chunk size. comp_buf is used to write or read the compressed chunks.
+	 */
+	Size		read_pos;
+	Size		read_len;
+	char	   *comp_buf;
+	Size		comp_buf_size;
+} ChangeBuffer;
+
 typedef struct DecodingOutputState
 {
 	/* The relation whose changes we're decoding. */
@@ -79,29 +155,16 @@ typedef struct DecodingOutputState
 	/*
 	 * Decoded changes are stored here. Although we try to avoid excessive
 	 * batches, it can happen that the changes need to be stored to disk. The
-	 * tuplestore does this transparently.
+	 * buffer does this transparently.
 	 */
-	Tuplestorestate *tstore;
+	ChangeBuffer *changes;
 
-	/* The current number of changes in tstore. */
+	/* The current number of changes in the buffer. */
 	double		nchanges;
 
-	/*
-	 * Descriptor to store the ConcurrentChange structure serialized (bytea).
-	 * We can't store the tuple directly because tuplestore only supports
-	 * minimum tuple and we may need to transfer OID system column from the
-	 * output plugin. Also we need to transfer the change kind, so it's better
-	 * to put everything in the structure than to use 2 tuplestores "in
-	 * parallel".
-	 */
-	TupleDesc	tupdesc_change;
-
 	/* Tuple descriptor needed to update indexes. */
 	TupleDesc	tupdesc;
 
-	/* Slot to retrieve data from tstore. */
-	TupleTableSlot *tsslot;
-
 	/*
 	 * WAL records having this origin have been created by the initial load
 	 * and should not be decoded.
@@ -109,6 +172,33 @@ typedef struct DecodingOutputState
 	RepOriginId rorigin;
 
 	ResourceOwner resowner;
+
+	/*
+	 * If valid, the changes are sent to the squeeze worker rather than
+	 * stored in the buffer. See process_concurrent_changes_pipelined().
+	 */
+	shm_mq_handle *mqh;
+
+	/*
+	 * Storage of the relation and of its TOAST relation. Heap records that
+	 * modify other storage are not decoded. The filter is not used until
+	 * set_relfilenode_filter() has been called.
+	 */
+	bool		filter_relfilenodes;
+	RelFileLocator locator;
+	RelFileLocator toast_locator;
+
+	/*
+	 * Attributes of the identity key, if the table has REPLICA IDENTITY
+	 * FULL. The other attributes of the old tuple of UPDATE and DELETE are
+	 * not stored, only the key is needed to apply these changes. (With the
+	 * other kinds of identity, only the key is logged anyway.) Set by
+	 * set_relfilenode_filter().
+	 */
+	Bitmapset  *ident_attrs;
+
+	/* Bytes of WAL read so far by decode_concurrent_changes(). */
+	uint64		wal_decoded;
 } DecodingOutputState;
 
 /* The WAL segment being decoded. */
@@ -124,6 +214,9 @@ typedef struct IndexInsertState
 	ExprContext *econtext;
 
 	Relation	ident_index;
+
+	/* Location of the rows recently inserted / updated. */
+	struct TidCache *tid_cache;
 } IndexInsertState;
 
 /*
@@ -219,6 +312,9 @@ extern void check_catalog_changes(CatalogState *state, LOCKMODE lock_held);
 extern IndexInsertState *get_index_insert_state(Relation relation,
 												Oid ident_index_id);
 extern void free_index_insert_state(IndexInsertState *iistate);
+extern ChangeBuffer *change_buffer_begin(Size max_size,
+										 SpillCompression compression);
+extern void change_buffer_end(ChangeBuffer *cb);
 extern bool process_concurrent_changes(LogicalDecodingContext *ctx,
 									   XLogRecPtr end_of_wal,
 									   CatalogState *cat_state,
@@ -227,12 +323,26 @@ extern bool process_concurrent_changes(LogicalDecodingContext *ctx,
 									   IndexInsertState *iistate,
 									   LOCKMODE lock_held,
 									   struct timeval *must_complete);
+extern void process_concurrent_changes_pipelined(LogicalDecodingContext **ctx_p,
+												 XLogRecPtr end_of_wal,
+												 CatalogState *cat_state,
+												 Relation rel_dst,
+												 ScanKey ident_key,
+												 int ident_key_nentries,
+												 IndexInsertState *iistate);
+extern void set_relfilenode_filter(DecodingOutputState *dstate,
+								   Relation rel);
 extern bool decode_concurrent_changes(LogicalDecodingContext *ctx,
 									  XLogRecPtr end_of_wal,
 									  struct timeval *must_complete);
+extern LogicalDecodingContext *create_decoding_context(void);
 extern void _PG_output_plugin_init(OutputPluginCallbacks *cb);
 
 extern int	squeeze_workers_per_database;
+extern int	squeeze_slot_pool_size;
+extern int	squeeze_slot_pool_max_age;
+extern int	squeeze_max_batch_tables;
+extern int	squeeze_batch_table_max_size;
 
 /*
  * Connection information the squeeze worker needs to connect to database if
@@ -269,21 +379,101 @@ typedef struct WorkerConInteractive
 	int			task_idx;
 } WorkerConInteractive;
 
-/* Progress tracking. */
+/*
+ * Progress tracking.
+ *
+ * Only the worker that owns the slot updates the counters, so it does not
+ * need atomic read-modify-write operations, see progress_add(). The atomics
+ * ensure that the monitoring functions do not see torn values.
+ */
 typedef struct WorkerProgress
 {
 	/* Tuples inserted during the initial load. */
-	int64		ins_initial;
+	pg_atomic_uint64 ins_initial;
 
 	/*
 	 * Tuples inserted, updated and deleted after the initial load (i.e.
 	 * during the catch-up phase).
 	 */
-	int64		ins;
-	int64		upd;
-	int64		del;
+	pg_atomic_uint64 ins;
+	pg_atomic_uint64 upd;
+	pg_atomic_uint64 del;
+
+	/*
+	 * Rounds of the catch-up performed w/o the exclusive lock, and the number
+	 * of times the exclusive lock was acquired to finish the processing.
+	 */
+	pg_atomic_uint64 catch_up_rounds;
+	pg_atomic_uint64 xlock_attempts;
+
+	/*
+	 * Time (in microseconds) spent in the individual phases. The time of all
+	 * the final merge attempts is summed up, the part spent waiting for the
+	 * exclusive lock is accounted separately.
+	 */
+	pg_atomic_uint64 setup_time;
+	pg_atomic_uint64 initial_load_time;
+	pg_atomic_uint64 index_build_time;
+	pg_atomic_uint64 catch_up_time;
+	pg_atomic_uint64 lock_wait_time;
+	pg_atomic_uint64 final_merge_time;
+	pg_atomic_uint64 swap_time;
+
+	/*
+	 * Bytes of WAL decoded, and bytes written to temporary files by the
+	 * reorder buffer, by the buffer of the decoded changes and by the sort
+	 * of the initial load.
+	 */
+	pg_atomic_uint64 wal_decoded;
+	pg_atomic_uint64 reorder_spill;
+	pg_atomic_uint64 change_spill;
+	pg_atomic_uint64 sort_spill;
+
+	/* The maximum memory allocated, see progress_sample_memory(). */
+	pg_atomic_uint64 peak_memory;
 } WorkerProgress;
 
+#define progress_add(counter, n) \
+	pg_atomic_write_u64((counter), pg_atomic_read_u64(counter) + (n))
+
+/* Add the time elapsed since 'start' (TimestampTz). */
+#define progress_add_elapsed(counter, start) \
+	progress_add((counter), GetCurrentTimestamp() - (start))
+
+extern void progress_sample_memory(void);
+
+/*
+ * Custom wait events, so that pg_stat_activity shows what the worker is
+ * doing. Only PG >= 17 can tell them from other extensions' events.
+ */
+typedef enum SqueezeWaitEvent
+{
+	SQUEEZE_WAIT_DECODING = 0,
+	SQUEEZE_WAIT_DECODING_WORKER,
+	SQUEEZE_WAIT_COST_DELAY
+} SqueezeWaitEvent;
+
+#define SQUEEZE_WAIT_EVENTS		(SQUEEZE_WAIT_COST_DELAY + 1)
+
+extern uint32 squeeze_wait_event(SqueezeWaitEvent event);
+
+/*
+ * Besides WorkerProgress, the squeeze worker reports its progress via
+ * pgstat_progress_update_param(), as if it was running the CLUSTER
+ * command. Thus the parameters known to pg_stat_progress_cluster have the
+ * same meaning here. The additional parameters must not collide with those
+ * that index_build() reports (see commands/progress.h).
+ */
+#define PROGRESS_SQUEEZE_BYTES_WRITTEN		8
+#define PROGRESS_SQUEEZE_CHANGES_PENDING	13
+#define PROGRESS_SQUEEZE_INDEXES_TOTAL		14
+#define PROGRESS_SQUEEZE_LSN_DECODED		17
+#define PROGRESS_SQUEEZE_LSN_TARGET			18
+
+/* Phases that CLUSTER does not have. */
+#define PROGRESS_SQUEEZE_PHASE_CATCH_UP		8
+#define PROGRESS_SQUEEZE_PHASE_FINAL_MERGE	9
+
 /*
  * Shared memory structures to keep track of the status of squeeze workers.
  */
@@ -297,6 +487,17 @@ typedef struct WorkerSlot
 								 * worker" */
 	WorkerProgress progress;	/* progress tracking information */
 
+	/*
+	 * Replication origin the worker uses to mark its own WAL records, and the
+	 * WAL insert position at the time the origin was created. Other workers
+	 * use these to skip decoding of the data this worker writes into its
+	 * transient table. (The LSN is needed because origin IDs can be reused:
+	 * records of the same origin written before 'origin_lsn' do not belong
+	 * to this worker.)
+	 */
+	RepOriginId origin;
+	XLogRecPtr	origin_lsn;
+
 	/*
 	 * Use this when setting / clearing the fields above.
 	 *
@@ -306,14 +507,12 @@ typedef struct WorkerSlot
 	 * concurrently. On the other hand, the spinlock is sufficient to clear
 	 * the fields.
 	 *
-	 * Note that we use MemSet() to reset 'progress', which is hopefully
-	 * o.k. to do under spinlock. XXX Consider using atomics for the
-	 * 'progress' counters rather than the spinlock. In theory, the absence of
-	 * spinlock could allow the new worker to see the values not yet cleared
-	 * by the old worker (or cleared after the new worker already had
-	 * increased the counters), but not sure if this a serious issue.
-	 * (Likewise: is it a problem if the monitoring functions get an
-	 * inconsistent view of the counters?)
+	 * The 'progress' counters are reset under the spinlock, but updated
+	 * w/o it. In theory, this could allow the new worker to see the values
+	 * not yet cleared by the old one, but the slot is only handed over to
+	 * another worker after the old one has cleared the fields. (The
+	 * monitoring functions can get an inconsistent view of the counters, but
+	 * that should not be a serious issue.)
 	 */
 	slock_t		mutex;
 } WorkerSlot;
@@ -350,6 +549,27 @@ typedef enum
 	WTS_IN_PROGRESS,	/* worker is working on the task */
 } WorkerTaskState;
 
+/*
+ * Values of the configuration variables that the squeeze worker should use
+ * for the task. The requester takes them from its own session (see
+ * get_squeeze_settings()), the scheduler also from squeeze.tables.
+ */
+typedef struct SqueezeSettings
+{
+	int		max_xlock_time;
+	int		initial_load_workers;	/* parallel workers for the initial
+									 * load */
+	int		cluster_sort_min_size;	/* see squeeze_cluster_sort_min_size */
+	int		parallel_index_workers; /* see
+									 * squeeze_max_parallel_index_workers */
+	bool	coalesce_changes;	/* see squeeze_coalesce_changes */
+	bool	pipelined_decoding; /* see squeeze_pipelined_decoding */
+	int		spill_compression;	/* see squeeze_spill_compression */
+	double	tail_percent;		/* see squeeze_tail_percent */
+	int		cost_limit;			/* see squeeze_cost_limit */
+	double	cost_delay;			/* see squeeze_cost_delay */
+} SqueezeSettings;
+
 /*
  * This structure represents a task assigned to the worker via shared memory.
  */
@@ -394,7 +614,7 @@ typedef struct WorkerTask
 
 	NameData	indname;		/* clustering index */
 	NameData	tbspname;		/* destination tablespace */
-	int		max_xlock_time;
+	SqueezeSettings	settings;
 
 	/*
 	 * Fields of the squeeze.tasks table.
@@ -407,6 +627,12 @@ typedef struct WorkerTask
 	bool		last_try;
 	bool		skip_analyze;
 
+	/*
+	 * Position of the next task in the array of tasks if the scheduler
+	 * assigned a batch of tasks to the same worker, -1 otherwise.
+	 */
+	int			batch_next;
+
 	/*
 	 * Index destination tablespaces.
 	 *
@@ -441,8 +667,15 @@ extern void squeeze_save_prev_shmem_request_hook(void);
 extern void squeeze_worker_shmem_request(void);
 extern void squeeze_save_prev_shmem_startup_hook(void);
 extern void squeeze_worker_shmem_startup(void);
+extern void set_worker_origin(RepOriginId origin);
+extern bool is_worker_origin(RepOriginId origin, XLogRecPtr lsn);
 
 extern PGDLLEXPORT void squeeze_worker_main(Datum main_arg);
+extern PGDLLEXPORT void squeeze_initial_load_worker_main(dsm_segment *seg,
+														 shm_toc *toc);
+extern PGDLLEXPORT void squeeze_cluster_sort_worker_main(dsm_segment *seg,
+														 shm_toc *toc);
+extern PGDLLEXPORT void squeeze_decoding_worker_main(Datum main_arg);
 
 extern void exit_if_requested(void);
 extern bool squeeze_table_impl(Name relschema, Name relname, Name indname,
@@ -22,6 +22,8 @@
  */
 #include "postgres.h"
 
+#include <math.h>
+
 #include "pg_squeeze.h"
 
 #include "access/heapam.h"
@@ -39,9 +41,15 @@
 #include "storage/procarray.h"
 #include "storage/lmgr.h"
 #include "utils/builtins.h"
+#include "utils/float.h"
 #include "commands/vacuum.h"
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#endif
+#include "utils/sampling.h"
 
 PG_FUNCTION_INFO_V1(squeeze_pgstattuple_approx);
+PG_FUNCTION_INFO_V1(squeeze_pgstattuple_sample);
 
 typedef struct output_type
 {
@@ -58,6 +66,155 @@ typedef struct output_type
 } output_type;
 
 #define NUM_OUTPUT_COLUMNS 10
+#define NUM_SAMPLE_OUTPUT_COLUMNS 5
+
+/*
+ * Sampling: the number of blocks to read before checking whether the
+ * estimate is accurate enough, the minimum number of blocks to check before
+ * we stop early, and the number of standard errors that makes the error
+ * bound.
+ */
+#define SAMPLE_BATCH_BLOCKS		64
+#define SAMPLE_MIN_BLOCKS		256
+#define SAMPLE_ERROR_Z			3.0
+
+/*
+ * Account for block 'blkno' of 'rel' in 'stat'.
+ *
+ * If the page has only visible tuples, the free space is retrieved from the
+ * FSM and the page is not read. Otherwise the page is read and the dead
+ * tuples etc. are counted exactly. Returns true iff the page was read.
+ */
+static bool
+statapprox_page(Relation rel, BlockNumber blkno, Buffer *vmbuffer,
+				BufferAccessStrategy bstrategy, TransactionId OldestXmin,
+				output_type *stat)
+{
+	Buffer		buf;
+	Page		page;
+	OffsetNumber offnum,
+				maxoff;
+	Size		freespace;
+
+	/*
+	 * If the page has only visible tuples, then we can find out the free
+	 * space from the FSM and move on.
+	 */
+	if (VM_ALL_VISIBLE(rel, blkno, vmbuffer))
+	{
+		freespace = GetRecordedFreeSpace(rel, blkno);
+		stat->tuple_len += BLCKSZ - freespace;
+		stat->free_space += freespace;
+		return false;
+	}
+
+	buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno,
+							 RBM_NORMAL, bstrategy);
+
+	LockBuffer(buf, BUFFER_LOCK_SHARE);
+
+	page = BufferGetPage(buf);
+
+	/*
+	 * It's not safe to call PageGetHeapFreeSpace() on new pages, so we
+	 * treat them as being free space for our purposes.
+	 */
+	if (!PageIsNew(page))
+		stat->free_space += PageGetHeapFreeSpace(page);
+	else
+		stat->free_space += BLCKSZ - SizeOfPageHeaderData;
+
+	if (PageIsNew(page) || PageIsEmpty(page))
+	{
+		UnlockReleaseBuffer(buf);
+		return true;
+	}
+
+	/*
+	 * Look at each tuple on the page and decide whether it's live or
+	 * dead, then count it and its size. Unlike lazy_scan_heap, we can
+	 * afford to ignore problems and special cases.
+	 */
+	maxoff = PageGetMaxOffsetNumber(page);
+
+	for (offnum = FirstOffsetNumber;
+		 offnum <= maxoff;
+		 offnum = OffsetNumberNext(offnum))
+	{
+		ItemId		itemid;
+		HeapTupleData tuple;
+
+		itemid = PageGetItemId(page, offnum);
+
+		if (!ItemIdIsUsed(itemid) || ItemIdIsRedirected(itemid) ||
+			ItemIdIsDead(itemid))
+		{
+			continue;
+		}
+
+		Assert(ItemIdIsNormal(itemid));
+
+		ItemPointerSet(&(tuple.t_self), blkno, offnum);
+
+		tuple.t_data = (HeapTupleHeader) PageGetItem(page, itemid);
+		tuple.t_len = ItemIdGetLength(itemid);
+		tuple.t_tableOid = RelationGetRelid(rel);
+
+		/*
+		 * We follow VACUUM's lead in counting INSERT_IN_PROGRESS tuples
+		 * as "dead" while DELETE_IN_PROGRESS tuples are "live".  We don't
+		 * bother distinguishing tuples inserted/deleted by our own
+		 * transaction.
+		 */
+		switch (HeapTupleSatisfiesVacuum(&tuple, OldestXmin, buf))
+		{
+			case HEAPTUPLE_LIVE:
+			case HEAPTUPLE_DELETE_IN_PROGRESS:
+				stat->tuple_len += tuple.t_len;
+				stat->tuple_count++;
+				break;
+			case HEAPTUPLE_DEAD:
+			case HEAPTUPLE_RECENTLY_DEAD:
+			case HEAPTUPLE_INSERT_IN_PROGRESS:
+				stat->dead_tuple_len += tuple.t_len;
+				stat->dead_tuple_count++;
+				break;
+			default:
+				elog(ERROR, "unexpected HeapTupleSatisfiesVacuum result");
+				break;
+		}
+	}
+
+	UnlockReleaseBuffer(buf);
+
+	return true;
+}
+
+static TransactionId
+statapprox_oldest_xmin(Relation rel)
+{
+#if PG_VERSION_NUM >= 140000
+	return GetOldestNonRemovableTransactionId(rel);
+#else
+	return GetOldestXmin(rel, PROCARRAY_FLAGS_VACUUM);
+#endif
+}
+
+/*
+ * Calculate percentages if the relation has one or more pages.
+ */
+static void
+statapprox_percentages(output_type *stat, BlockNumber nblocks,
+					   BlockNumber scanned)
+{
+	if (nblocks != 0)
+	{
+		stat->scanned_percent = 100.0 * scanned / nblocks;
+		stat->tuple_percent = 100.0 * stat->tuple_len / stat->table_len;
+		stat->dead_tuple_percent = 100.0 * stat->dead_tuple_len / stat->table_len;
+		stat->free_percent = 100.0 * stat->free_space / stat->table_len;
+	}
+}
 
 /*
  * This function takes an already open relation and scans its pages,
@@ -79,11 +236,7 @@ statapprox_heap(Relation rel, output_type *stat)
 	BufferAccessStrategy bstrategy;
 	TransactionId OldestXmin;
 
-#if PG_VERSION_NUM >= 140000
-	OldestXmin = GetOldestNonRemovableTransactionId(rel);
-#else
-	OldestXmin = GetOldestXmin(rel, PROCARRAY_FLAGS_VACUUM);
-#endif
+	OldestXmin = statapprox_oldest_xmin(rel);
 	bstrategy = GetAccessStrategy(BAS_BULKREAD);
 
 	nblocks = RelationGetNumberOfBlocks(rel);
@@ -91,105 +244,10 @@ statapprox_heap(Relation rel, output_type *stat)
 
 	for (blkno = 0; blkno < nblocks; blkno++)
 	{
-		Buffer		buf;
-		Page		page;
-		OffsetNumber offnum,
-					maxoff;
-		Size		freespace;
-
-		/*
-		 * If the page has only visible tuples, then we can find out the free
-		 * space from the FSM and move on.
-		 */
-		if (VM_ALL_VISIBLE(rel, blkno, &vmbuffer))
-		{
-			freespace = GetRecordedFreeSpace(rel, blkno);
-			stat->tuple_len += BLCKSZ - freespace;
-			stat->free_space += freespace;
-			continue;
-		}
-
-		buf = ReadBufferExtended(rel, MAIN_FORKNUM, blkno,
-								 RBM_NORMAL, bstrategy);
-
-		LockBuffer(buf, BUFFER_LOCK_SHARE);
-
-		page = BufferGetPage(buf);
-
-		/*
-		 * It's not safe to call PageGetHeapFreeSpace() on new pages, so we
-		 * treat them as being free space for our purposes.
-		 */
-		if (!PageIsNew(page))
-			stat->free_space += PageGetHeapFreeSpace(page);
-		else
-			stat->free_space += BLCKSZ - SizeOfPageHeaderData;
-
 		/* We may count the page as scanned even if it's new/empty */
-		scanned++;
-
-		if (PageIsNew(page) || PageIsEmpty(page))
-		{
-			UnlockReleaseBuffer(buf);
-			continue;
-		}
-
-		/*
-		 * Look at each tuple on the page and decide whether it's live or
-		 * dead, then count it and its size. Unlike lazy_scan_heap, we can
-		 * afford to ignore problems and special cases.
-		 */
-		maxoff = PageGetMaxOffsetNumber(page);
-
-		for (offnum = FirstOffsetNumber;
-			 offnum <= maxoff;
-			 offnum = OffsetNumberNext(offnum))
-		{
-			ItemId		itemid;
-			HeapTupleData tuple;
-
-			itemid = PageGetItemId(page, offnum);
-
-			if (!ItemIdIsUsed(itemid) || ItemIdIsRedirected(itemid) ||
-				ItemIdIsDead(itemid))
-			{
-				continue;
-			}
-
-			Assert(ItemIdIsNormal(itemid));
-
-			ItemPointerSet(&(tuple.t_self), blkno, offnum);
-
-			tuple.t_data = (HeapTupleHeader) PageGetItem(page, itemid);
-			tuple.t_len = ItemIdGetLength(itemid);
-			tuple.t_tableOid = RelationGetRelid(rel);
-
-			/*
-			 * We follow VACUUM's lead in counting INSERT_IN_PROGRESS tuples
-			 * as "dead" while DELETE_IN_PROGRESS tuples are "live".  We don't
-			 * bother distinguishing tuples inserted/deleted by our own
-			 * transaction.
-			 */
-			switch (HeapTupleSatisfiesVacuum(&tuple, OldestXmin, buf))
-			{
-				case HEAPTUPLE_LIVE:
-				case HEAPTUPLE_DELETE_IN_PROGRESS:
-					stat->tuple_len += tuple.t_len;
-					stat->tuple_count++;
-					break;
-				case HEAPTUPLE_DEAD:
-				case HEAPTUPLE_RECENTLY_DEAD:
-				case HEAPTUPLE_INSERT_IN_PROGRESS:
-					stat->dead_tuple_len += tuple.t_len;
-					stat->dead_tuple_count++;
-					break;
-				default:
-					elog(ERROR, "unexpected HeapTupleSatisfiesVacuum result");
-					break;
-			}
-		}
-
-		UnlockReleaseBuffer(buf);
+		if (statapprox_page(rel, blkno, &vmbuffer, bstrategy, OldestXmin,
+							stat))
+			scanned++;
 	}
 
 	stat->table_len = (uint64) nblocks * BLCKSZ;
@@ -210,16 +268,7 @@ statapprox_heap(Relation rel, output_type *stat)
 	/* It's not clear if we could get -1 here, but be safe. */
 	stat->tuple_count = Max(stat->tuple_count, 0);
 
-	/*
-	 * Calculate percentages if the relation has one or more pages.
-	 */
-	if (nblocks != 0)
-	{
-		stat->scanned_percent = 100.0 * scanned / nblocks;
-		stat->tuple_percent = 100.0 * stat->tuple_len / stat->table_len;
-		stat->dead_tuple_percent = 100.0 * stat->dead_tuple_len / stat->table_len;
-		stat->free_percent = 100.0 * stat->free_space / stat->table_len;
-	}
+	statapprox_percentages(stat, nblocks, scanned);
 
 	if (BufferIsValid(vmbuffer))
 	{
@@ -228,32 +277,170 @@ statapprox_heap(Relation rel, output_type *stat)
 	}
 }
 
+static int
+blkno_cmp(const void *a, const void *b)
+{
+	BlockNumber ba = *(const BlockNumber *) a;
+	BlockNumber bb = *(const BlockNumber *) b;
+
+	if (ba < bb)
+		return -1;
+	else if (ba > bb)
+		return 1;
+	return 0;
+}
+
 /*
- * Returns estimated live/dead tuple statistics for the given relid.
+ * Like statapprox_heap(), but only check a random sample of 'sample_blocks'
+ * blocks and extrapolate the results to the whole table.
+ *
+ * The sample is processed in batches of SAMPLE_BATCH_BLOCKS. Each batch is
+ * a random subset of the sample, so the estimate is unbiased whenever we
+ * stop at a batch boundary. Within a batch, the blocks are prefetched and
+ * read in physical order.
+ *
+ * If 'threshold' is not NaN, stop as soon as the estimated percentage of
+ * free space (including dead tuples) is further than the error bound from
+ * it, i.e. when it's clear whether the table needs to be squeezed or not.
+ *
+ * '*error' receives the error bound of the free space percentage.
  */
-Datum
-squeeze_pgstattuple_approx(PG_FUNCTION_ARGS)
+static void
+statsample_heap(Relation rel, int sample_blocks, double threshold,
+				output_type *stat, double *error)
 {
-	Oid			relid = PG_GETARG_OID(0);
-	Relation	rel;
-	output_type stat = {0};
-	TupleDesc	tupdesc;
-	bool		nulls[NUM_OUTPUT_COLUMNS];
-	Datum		values[NUM_OUTPUT_COLUMNS];
-	HeapTuple	ret;
-	int			i = 0;
+	BlockNumber nblocks,
+				targblocks,
+				nsampled,
+				nchecked;
+	BlockNumber *blknos;
+	BlockSamplerData bs;
+	Buffer		vmbuffer = InvalidBuffer;
+	BufferAccessStrategy bstrategy;
+	TransactionId OldestXmin;
+	double		sum = 0.0,
+				sum_sq = 0.0,
+				mean = 0.0,
+				se = 0.0,
+				factor;
+	BlockNumber i;
+
+	*error = 0.0;
+	nblocks = RelationGetNumberOfBlocks(rel);
+	stat->table_len = (uint64) nblocks * BLCKSZ;
+	if (nblocks == 0)
+		return;
 
-	if (!superuser() && !has_rolreplication(GetUserId()))
-		ereport(ERROR,
-				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
-				 (errmsg("must be superuser or replication role to run this function"))));
+	Assert(sample_blocks > 0);
+	targblocks = Min((BlockNumber) sample_blocks, nblocks);
+#if PG_VERSION_NUM >= 150000
+	BlockSampler_Init(&bs, nblocks, targblocks,
+					  pg_prng_uint32(&pg_global_prng_state));
+#else
+	BlockSampler_Init(&bs, nblocks, targblocks, random());
+#endif
+	blknos = (BlockNumber *) palloc(targblocks * sizeof(BlockNumber));
+	nsampled = 0;
+	while (BlockSampler_HasMore(&bs))
+		blknos[nsampled++] = BlockSampler_Next(&bs);
 
+	/* The sampler returns the blocks in ascending order, so shuffle them. */
+	for (i = nsampled; i > 1; i--)
+	{
+		BlockNumber j,
+					tmp;
 
-	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
-		elog(ERROR, "return type must be a row type");
+#if PG_VERSION_NUM >= 150000
+		j = (BlockNumber) (sampler_random_fract(&bs.randstate) * i);
+#else
+		j = (BlockNumber) (sampler_random_fract(bs.randstate) * i);
+#endif
+		j = Min(j, i - 1);
+		tmp = blknos[i - 1];
+		blknos[i - 1] = blknos[j];
+		blknos[j] = tmp;
+	}
 
-	if (tupdesc->natts != NUM_OUTPUT_COLUMNS)
-		elog(ERROR, "incorrect number of output arguments");
+	OldestXmin = statapprox_oldest_xmin(rel);
+	bstrategy = GetAccessStrategy(BAS_BULKREAD);
+	nchecked = 0;
+
+	while (nchecked < nsampled)
+	{
+		BlockNumber batch_end = Min(nchecked + SAMPLE_BATCH_BLOCKS, nsampled);
+		BlockNumber n;
+
+		qsort(&blknos[nchecked], batch_end - nchecked, sizeof(BlockNumber),
+			  blkno_cmp);
+		for (i = nchecked; i < batch_end; i++)
+			PrefetchBuffer(rel, MAIN_FORKNUM, blknos[i]);
+
+		for (i = nchecked; i < batch_end; i++)
+		{
+			uint64		unused_before,
+						unused;
+			double		x;
+
+			CHECK_FOR_INTERRUPTS();
+
+			unused_before = stat->free_space + stat->dead_tuple_len;
+			statapprox_page(rel, blknos[i], &vmbuffer, bstrategy, OldestXmin,
+							stat);
+			unused = stat->free_space + stat->dead_tuple_len - unused_before;
+
+			/* The percentage of unused space in this block. */
+			x = 100.0 * unused / BLCKSZ;
+			sum += x;
+			sum_sq += x * x;
+		}
+		nchecked = batch_end;
+
+		/*
+		 * The standard error of the mean, including the finite population
+		 * correction.
+		 */
+		n = nchecked;
+		mean = sum / n;
+		if (n > 1 && n < nblocks)
+		{
+			double		var;
+
+			var = (sum_sq - n * mean * mean) / (n - 1);
+			var = Max(var, 0.0);
+			se = sqrt(var / n * (1.0 - (double) n / nblocks));
+		}
+		else
+			se = 0.0;
+
+		if (!isnan(threshold) && nchecked >= SAMPLE_MIN_BLOCKS &&
+			fabs(mean - threshold) > SAMPLE_ERROR_Z * se)
+			break;
+	}
+
+	/* Extrapolate. */
+	factor = (double) nblocks / nchecked;
+	stat->free_space = (uint64) (stat->free_space * factor);
+	stat->tuple_len = (uint64) (stat->tuple_len * factor);
+	stat->tuple_count = (uint64) (stat->tuple_count * factor);
+	stat->dead_tuple_len = (uint64) (stat->dead_tuple_len * factor);
+	stat->dead_tuple_count = (uint64) (stat->dead_tuple_count * factor);
+
+	statapprox_percentages(stat, nblocks, nchecked);
+
+	*error = SAMPLE_ERROR_Z * se;
+
+	if (BufferIsValid(vmbuffer))
+		ReleaseBuffer(vmbuffer);
+	pfree(blknos);
+}
+
+/*
+ * Open the relation and check that it can be examined.
+ */
+static Relation
+statapprox_open(Oid relid)
+{
+	Relation	rel;
 
 	rel = relation_open(relid, AccessShareLock);
 
@@ -290,6 +477,38 @@ squeeze_pgstattuple_approx(PG_FUNCTION_ARGS)
 		ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
 						errmsg("only heap AM is supported")));
 
+	return rel;
+}
+
+/*
+ * Returns estimated live/dead tuple statistics for the given relid.
+ */
+Datum
+squeeze_pgstattuple_approx(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	Relation	rel;
+	output_type stat = {0};
+	TupleDesc	tupdesc;
+	bool		nulls[NUM_OUTPUT_COLUMNS];
+	Datum		values[NUM_OUTPUT_COLUMNS];
+	HeapTuple	ret;
+	int			i = 0;
+
+	if (!superuser() && !has_rolreplication(GetUserId()))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser or replication role to run this function"))));
+
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != NUM_OUTPUT_COLUMNS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	rel = statapprox_open(relid);
+
 	statapprox_heap(rel, &stat);
 
 	relation_close(rel, AccessShareLock);
@@ -310,3 +529,63 @@ squeeze_pgstattuple_approx(PG_FUNCTION_ARGS)
 	ret = heap_form_tuple(tupdesc, values, nulls);
 	return HeapTupleGetDatum(ret);
 }
+
+/*
+ * Like squeeze_pgstattuple_approx(), but only examine a random sample of
+ * blocks, see statsample_heap().
+ */
+Datum
+squeeze_pgstattuple_sample(PG_FUNCTION_ARGS)
+{
+	Oid			relid;
+	int			sample_blocks;
+	double		threshold;
+	Relation	rel;
+	output_type stat = {0};
+	double		error;
+	TupleDesc	tupdesc;
+	bool		nulls[NUM_SAMPLE_OUTPUT_COLUMNS];
+	Datum		values[NUM_SAMPLE_OUTPUT_COLUMNS];
+	HeapTuple	ret;
+	int			i = 0;
+
+	if (!superuser() && !has_rolreplication(GetUserId()))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 (errmsg("must be superuser or replication role to run this function"))));
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		PG_RETURN_NULL();
+	relid = PG_GETARG_OID(0);
+	sample_blocks = PG_GETARG_INT32(1);
+	/* No threshold means that the whole sample should be checked. */
+	threshold = PG_ARGISNULL(2) ? get_float8_nan() : PG_GETARG_FLOAT8(2);
+
+	if (sample_blocks <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("sample size must be greater than zero")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (tupdesc->natts != NUM_SAMPLE_OUTPUT_COLUMNS)
+		elog(ERROR, "incorrect number of output arguments");
+
+	rel = statapprox_open(relid);
+
+	statsample_heap(rel, sample_blocks, threshold, &stat, &error);
+
+	relation_close(rel, AccessShareLock);
+
+	memset(nulls, 0, sizeof(nulls));
+
+	values[i++] = Int64GetDatum(stat.table_len);
+	values[i++] = Float8GetDatum(stat.scanned_percent);
+	values[i++] = Float8GetDatum(stat.dead_tuple_percent);
+	values[i++] = Float8GetDatum(stat.free_percent);
+	values[i++] = Float8GetDatum(error);
+
+	ret = heap_form_tuple(tupdesc, values, nulls);
+	return HeapTupleGetDatum(ret);
+}
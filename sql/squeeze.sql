@@ -32,3 +32,89 @@ SELECT b.t = b_copy.t
 FROM   b, b_copy
 WHERE  b.i = b_copy.i;
 
+-- Parallel initial load.
+SET squeeze.max_initial_load_workers TO 2;
+SELECT squeeze.squeeze_table('public', 'b', NULL);
+SELECT b.t = b_copy.t
+FROM   b, b_copy
+WHERE  b.i = b_copy.i;
+-- Clustering by sort, with the work split among the workers.
+SET squeeze.cluster_sort_min_size TO 0;
+SELECT squeeze.squeeze_table('public', 'a', 'a_pkey');
+SELECT * FROM a;
+RESET squeeze.cluster_sort_min_size;
+RESET squeeze.max_initial_load_workers;
+
+-- Estimate the bloat from a sample. If the sample covers the whole table,
+-- the estimate is exact.
+SELECT scanned_percent, error_percent
+FROM squeeze.pgstattuple_sample('b', 1000);
+SELECT squeeze.pgstattuple_sample('b', 0);
+
+-- A table this small only has one FSM leaf page, so it's always read.
+SELECT squeeze.get_heap_freespace('b'::regclass, 1) IS NOT DISTINCT FROM
+	squeeze.get_heap_freespace('b'::regclass);
+SELECT squeeze.get_heap_freespace('b'::regclass, 0);
+
+-- Only move the rows out of the tail of the table.
+CREATE TABLE c(i int PRIMARY KEY, t text);
+INSERT INTO c(i, t)
+SELECT x, repeat('x', 200)
+FROM generate_series(1, 200) AS g(x);
+DELETE FROM c WHERE i <= 150;
+VACUUM c;
+SELECT pg_relation_size('c') AS size_before \gset
+SET squeeze.tail_percent TO 50;
+SELECT squeeze.squeeze_table('public', 'c', NULL);
+RESET squeeze.tail_percent;
+VACUUM c;
+SELECT pg_relation_size('c') < :size_before AS truncated;
+SELECT count(*), min(i), max(i) FROM c;
+SET enable_seqscan TO off;
+SELECT count(*) FROM c WHERE i BETWEEN 160 AND 169;
+RESET enable_seqscan;
+
+-- A partitioned table gets one task per leaf partition.
+CREATE TABLE p(i int PRIMARY KEY, j int) PARTITION BY RANGE (i);
+CREATE TABLE p_1 PARTITION OF p FOR VALUES FROM (0) TO (10);
+CREATE TABLE p_2 PARTITION OF p FOR VALUES FROM (10) TO (20)
+PARTITION BY RANGE (i);
+CREATE TABLE p_2_1 PARTITION OF p_2 FOR VALUES FROM (10) TO (15);
+CREATE INDEX p_j_idx ON p(j);
+INSERT INTO squeeze.tables(tabschema, tabname, clustering_index, schedule)
+VALUES ('public', 'p', 'p_j_idx', (NULL, NULL, NULL, NULL, NULL));
+SELECT squeeze.check_schedule();
+SELECT tabschema, tabname, clustering_index
+FROM squeeze.task_tables
+ORDER BY tabname;
+-- Ranking of the tasks. Both partitions have the same size and free space,
+-- but the extra indexes make the processing of p_2_1 more expensive.
+INSERT INTO p(i, j) SELECT x, x FROM generate_series(0, 14) AS g(x)
+WHERE x % 10 < 5;
+CREATE INDEX ON p_2_1(i, j);
+CREATE INDEX ON p_2_1(j, i);
+UPDATE squeeze.tables SET deadline = '1 day';
+UPDATE squeeze.tasks SET free_space = 50;
+SELECT tt.tabname, r.benefit > 0 AS has_benefit,
+	r.latest_start > now() AS in_time, r.window_end
+FROM squeeze.task_ranking r JOIN squeeze.task_tables tt USING (task_id)
+ORDER BY tt.tabname;
+SELECT r1.benefit = r2.benefit AS same_benefit,
+	r1.priority > r2.priority AS cheaper_first
+FROM squeeze.task_ranking r1
+	JOIN squeeze.task_tables t1 ON t1.task_id = r1.task_id,
+	squeeze.task_ranking r2
+	JOIN squeeze.task_tables t2 ON t2.task_id = r2.task_id
+WHERE t1.tabname = 'p_1' AND t2.tabname = 'p_2_1';
+DELETE FROM squeeze.tables;
+SELECT squeeze.squeeze_table('public', 'p', NULL);
+
+-- The next time the schedule matches.
+SELECT squeeze.next_check_time(('{30}', '{22}', NULL, NULL, '{3, 5}'),
+	'2024-01-01 12:00') = '2024-01-03 22:30';
+SELECT squeeze.next_check_time(('{30}', '{22}', NULL, NULL, '{3, 5}'),
+	'2024-01-03 22:31') = '2024-01-05 22:30';
+SELECT squeeze.next_check_time(('{0}', NULL, '{29}', '{2}', NULL),
+	'2025-03-01') = '2028-02-29 00:00';
+SELECT squeeze.next_check_time(('{0}', '{0}', '{30}', '{2}', NULL),
+	'2025-03-01') = 'infinity';
@@ -0,0 +1,2 @@
+\set k random(1, :rows)
+INSERT INTO bench(k, payload) VALUES (:k, repeat('x', :width));
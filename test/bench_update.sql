@@ -0,0 +1,3 @@
+\set id random(1, :rows)
+\set k random(1, :rows)
+UPDATE bench SET k = :k WHERE id = :id;
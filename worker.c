@@ -9,14 +9,19 @@
  */
 #include "c.h"
 #include "postgres.h"
+
+#include <math.h>
+
 #include "fmgr.h"
 #include "funcapi.h"
 #include "miscadmin.h"
 #include "pgstat.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "catalog/pg_extension.h"
 #include "catalog/pg_type.h"
 #include "commands/dbcommands.h"
+#include "commands/trigger.h"
 #include "executor/spi.h"
 #include "nodes/makefuncs.h"
 #include "replication/slot.h"
@@ -24,6 +29,7 @@
 #include "storage/latch.h"
 #include "storage/lock.h"
 #include "storage/proc.h"
+#include "storage/procarray.h"
 #if PG_VERSION_NUM >= 160000
 #include "utils/backend_status.h"
 #endif
@@ -32,6 +38,7 @@
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
 
 #include "pg_squeeze.h"
 
@@ -120,18 +127,42 @@ typedef struct WorkerData
 	 */
 	LWLock	   *lock;
 
+	/*
+	 * Incremented each time a worker sets or clears WorkerSlot.origin, so
+	 * that is_worker_origin() can tell whether its copy is still valid.
+	 */
+	pg_atomic_uint32 origins_version;
+
 	int			nslots;			/* size of the array */
 	WorkerSlot	slots[FLEXIBLE_ARRAY_MEMBER];
 } WorkerData;
 
 static WorkerData *workerData = NULL;
 
+/*
+ * Local copy of the replication origins advertised by the squeeze workers,
+ * see is_worker_origin().
+ */
+typedef struct WorkerOrigin
+{
+	RepOriginId origin;
+	XLogRecPtr	origin_lsn;
+} WorkerOrigin;
+
+static WorkerOrigin *workerOrigins = NULL;
+static int	workerOriginCount = 0;
+static uint32 workerOriginsVersion = 0;
+static bool workerOriginsValid = false;
+
 /* Local pointer to the slot in the shared memory. */
 WorkerSlot *MyWorkerSlot = NULL;
 
 /* Local pointer to the task in the shared memory. */
 WorkerTask *MyWorkerTask = NULL;
 
+/* The first task of the batch MyWorkerTask belongs to. */
+static WorkerTask *MyBatchHead = NULL;
+
 /*
  * The "squeeze worker" (i.e. one that performs the actual squeezing, as
  * opposed to the "scheduler worker"). The scheduler worker uses this
@@ -152,12 +183,29 @@ static int	squeezeWorkerCount = 0;
 static ReplSlotStatus	*squeezeWorkerSlots = NULL;
 static int	squeezeWorkerSlotCount = 0;
 
+/*
+ * Slots the scheduler created in advance, see fill_slot_pool(). The array
+ * has squeeze_workers_per_database elements, ordered by creation time.
+ */
+static ReplSlotStatus	*slotPool = NULL;
+static TimestampTz	*slotPoolCreated = NULL;
+static int	slotPoolCount = 0;
+
+/*
+ * The pool slots live across the scheduler iterations, so the slot names
+ * cannot be derived from the position in squeezeWorkerSlots.
+ */
+static uint32 nextSlotNr = 0;
+
 #define	REPL_SLOT_PREFIX	"pg_squeeze_slot_"
 #define	REPL_PLUGIN_NAME	"pg_squeeze"
 
 static void interrupt_worker(WorkerTask *task);
 static void clear_task(WorkerTask *task);
+static void reset_progress(WorkerProgress *progress);
 static void release_task(WorkerTask *task);
+static WorkerTask *next_batch_task(WorkerTask *task);
+static void release_batch(WorkerTask *task);
 static void squeeze_handle_error_app(ErrorData *edata, WorkerTask *task);
 
 static WorkerTask *get_unused_task(Oid dbid, char *relschema, char *relname,
@@ -165,7 +213,9 @@ static WorkerTask *get_unused_task(Oid dbid, char *relschema, char *relname,
 static void initialize_worker_task(WorkerTask *task, int task_id, Name indname,
 								   Name tbspname, ArrayType *ind_tbsps,
 								   bool last_try, bool skip_analyze,
-								   int max_xlock_time);
+								   SqueezeSettings *settings);
+static void get_squeeze_settings(SqueezeSettings *settings);
+static void set_squeeze_settings(SqueezeSettings *settings);
 static bool start_worker_internal(bool scheduler, int task_idx,
 								  BackgroundWorkerHandle **handle);
 
@@ -173,11 +223,18 @@ static void worker_sighup(SIGNAL_ARGS);
 static void worker_sigterm(SIGNAL_ARGS);
 
 static void scheduler_worker_loop(void);
+static bool task_needs_slot(WorkerTask *task);
+static long get_scheduler_delay(void);
+static void wake_scheduler_callback(XactEvent event, void *arg);
 static void cleanup_workers_and_tasks(bool interrupt);
 static void wait_for_worker_shutdown(SqueezeWorker *worker);
 static void process_task(void);
 static void create_replication_slots(int nslots, MemoryContext mcxt);
+static void create_replication_slot(ReplSlotStatus *res_ptr);
 static void drop_replication_slots(void);
+static void drop_replication_slot(ReplSlotStatus *slot);
+static void fill_slot_pool(void);
+static void drop_slot_pool(void);
 static void cleanup_after_server_start(void);
 static void cleanup_repl_origins(void);
 static void cleanup_repl_slots(void);
@@ -185,6 +242,7 @@ static void start_cleanup_worker(MemoryContext task_cxt);
 static Snapshot build_historic_snapshot(SnapBuild *builder);
 static void process_task_internal(MemoryContext task_cxt);
 
+static void append_log_interval(StringInfo query, pg_atomic_uint64 *counter);
 static uint64 run_command(char *command, int rc);
 
 static Size
@@ -262,6 +320,7 @@ squeeze_worker_shmem_startup(void)
 
 		workerData->lock = &locks->lock;
 		workerData->cleanup_done = false;
+		pg_atomic_init_u32(&workerData->origins_version, 0);
 		workerData->nslots = max_squeeze_workers();
 
 		for (i = 0; i < workerData->nslots; i++)
@@ -271,8 +330,27 @@ squeeze_worker_shmem_startup(void)
 			slot->dbid = InvalidOid;
 			slot->relid = InvalidOid;
 			SpinLockInit(&slot->mutex);
-			MemSet(&slot->progress, 0, sizeof(WorkerProgress));
+			pg_atomic_init_u64(&slot->progress.ins_initial, 0);
+			pg_atomic_init_u64(&slot->progress.ins, 0);
+			pg_atomic_init_u64(&slot->progress.upd, 0);
+			pg_atomic_init_u64(&slot->progress.del, 0);
+			pg_atomic_init_u64(&slot->progress.catch_up_rounds, 0);
+			pg_atomic_init_u64(&slot->progress.xlock_attempts, 0);
+			pg_atomic_init_u64(&slot->progress.setup_time, 0);
+			pg_atomic_init_u64(&slot->progress.initial_load_time, 0);
+			pg_atomic_init_u64(&slot->progress.index_build_time, 0);
+			pg_atomic_init_u64(&slot->progress.catch_up_time, 0);
+			pg_atomic_init_u64(&slot->progress.lock_wait_time, 0);
+			pg_atomic_init_u64(&slot->progress.final_merge_time, 0);
+			pg_atomic_init_u64(&slot->progress.swap_time, 0);
+			pg_atomic_init_u64(&slot->progress.wal_decoded, 0);
+			pg_atomic_init_u64(&slot->progress.reorder_spill, 0);
+			pg_atomic_init_u64(&slot->progress.change_spill, 0);
+			pg_atomic_init_u64(&slot->progress.sort_spill, 0);
+			pg_atomic_init_u64(&slot->progress.peak_memory, 0);
 			slot->pid = InvalidPid;
+			slot->origin = InvalidRepOriginId;
+			slot->origin_lsn = InvalidXLogRecPtr;
 		}
 	}
 
@@ -295,26 +373,37 @@ worker_shmem_shutdown(int code, Datum arg)
 		MyWorkerSlot->dbid = InvalidOid;
 		MyWorkerSlot->relid = InvalidOid;
 		MyWorkerSlot->pid = InvalidPid;
-		MemSet(&MyWorkerSlot->progress, 0, sizeof(WorkerProgress));
+		MyWorkerSlot->origin = InvalidRepOriginId;
+		MyWorkerSlot->origin_lsn = InvalidXLogRecPtr;
+		reset_progress(&MyWorkerSlot->progress);
 		SpinLockRelease(&MyWorkerSlot->mutex);
+		pg_atomic_fetch_add_u32(&workerData->origins_version, 1);
 
 		/* This shouldn't be necessary, but ... */
 		MyWorkerSlot = NULL;
 	}
 
-	if (MyWorkerTask)
-		release_task(MyWorkerTask);
+	/*
+	 * The tasks of the batch processed so far are only released now, see
+	 * squeeze_worker_main().
+	 */
+	if (MyBatchHead)
+		release_batch(MyBatchHead);
 
 	if (am_i_scheduler)
+	{
 		/*
 		 * Cleanup. Here, instead of just waiting for workers to finish, we
 		 * ask them to exit as soon as possible.
 		 */
 		cleanup_workers_and_tasks(true);
+		drop_slot_pool();
+	}
 	else if (am_i_standalone)
 		/*
-		 * Note that the worker launched by the squeeze_table() function needs
-		 * to do the cleanup on its own.
+		 * Note that the worker which created its slot (e.g. the one launched
+		 * by the squeeze_table() function) needs to do the cleanup on its
+		 * own. process_task() does that unless the task ended with FATAL.
 		 */
 		drop_replication_slots();
 
@@ -327,6 +416,93 @@ worker_shmem_shutdown(int code, Datum arg)
 	LWLockReleaseAll();
 }
 
+/*
+ * Advertise the replication origin of this worker (or clear it if 'origin' is
+ * InvalidRepOriginId), see is_worker_origin().
+ */
+void
+set_worker_origin(RepOriginId origin)
+{
+	/* Not running as a squeeze worker? */
+	if (MyWorkerSlot == NULL)
+		return;
+
+	SpinLockAcquire(&MyWorkerSlot->mutex);
+	MyWorkerSlot->origin = origin;
+	MyWorkerSlot->origin_lsn = origin != InvalidRepOriginId ?
+		GetXLogInsertRecPtr() : InvalidXLogRecPtr;
+	SpinLockRelease(&MyWorkerSlot->mutex);
+
+	/* Let the other workers refresh their copies. */
+	pg_atomic_fetch_add_u32(&workerData->origins_version, 1);
+}
+
+/*
+ * Does WAL record at position 'lsn', marked with 'origin', belong to any
+ * squeeze worker?
+ *
+ * The caller should have created the origin in a committed transaction
+ * before calling set_worker_origin(), so that records of another owner of
+ * the same origin ID (i.e. the owner prior to the last drop of the origin)
+ * are all located below 'origin_lsn'.
+ *
+ * This is called for each decoded record that has an origin, so the slots
+ * are only scanned when some worker has changed its origin since the last
+ * call.
+ */
+bool
+is_worker_origin(RepOriginId origin, XLogRecPtr lsn)
+{
+	uint32		version;
+	int			i;
+
+	if (origin == InvalidRepOriginId)
+		return false;
+
+	version = pg_atomic_read_u32(&workerData->origins_version);
+	if (!workerOriginsValid || version != workerOriginsVersion)
+	{
+		if (workerOrigins == NULL)
+			workerOrigins = (WorkerOrigin *)
+				MemoryContextAlloc(TopMemoryContext,
+								   workerData->nslots * sizeof(WorkerOrigin));
+
+		/*
+		 * Read the slots only after the version. If a worker changes its
+		 * origin meanwhile, the version changes again and the next call
+		 * reads the slots again.
+		 */
+		pg_read_barrier();
+
+		workerOriginCount = 0;
+		for (i = 0; i < workerData->nslots; i++)
+		{
+			WorkerSlot *slot = &workerData->slots[i];
+
+			SpinLockAcquire(&slot->mutex);
+			if (slot->origin != InvalidRepOriginId)
+			{
+				workerOrigins[workerOriginCount].origin = slot->origin;
+				workerOrigins[workerOriginCount].origin_lsn =
+					slot->origin_lsn;
+				workerOriginCount++;
+			}
+			SpinLockRelease(&slot->mutex);
+		}
+		workerOriginsVersion = version;
+		workerOriginsValid = true;
+	}
+
+	for (i = 0; i < workerOriginCount; i++)
+	{
+		if (workerOrigins[i].origin == origin &&
+			lsn >= workerOrigins[i].origin_lsn)
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Start the scheduler worker.
  */
@@ -390,6 +566,83 @@ squeeze_stop_worker(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
+/* Should the scheduler be woken up when the current transaction commits? */
+static bool wake_scheduler_at_commit = false;
+
+/*
+ * Trigger on squeeze.tables and squeeze.tasks which lets the scheduler of
+ * the current database react to the change immediately, rather than sleeping
+ * until the next scheduled check.
+ */
+PG_FUNCTION_INFO_V1(squeeze_wake_scheduler);
+Datum
+squeeze_wake_scheduler(PG_FUNCTION_ARGS)
+{
+	static bool callback_registered = false;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "squeeze_wake_scheduler() was not called by trigger manager");
+
+	/* The scheduler checks the tables and tasks itself. */
+	if (MyWorkerSlot && MyWorkerSlot->scheduler)
+		PG_RETURN_POINTER(NULL);
+
+	/*
+	 * The scheduler would not see the changes until the transaction
+	 * commits, so only set the flag now.
+	 */
+	if (!callback_registered)
+	{
+		RegisterXactCallback(wake_scheduler_callback, NULL);
+		callback_registered = true;
+	}
+	wake_scheduler_at_commit = true;
+
+	PG_RETURN_POINTER(NULL);
+}
+
+static void
+wake_scheduler_callback(XactEvent event, void *arg)
+{
+	int			i;
+
+	if (!wake_scheduler_at_commit)
+		return;
+
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+	{
+		wake_scheduler_at_commit = false;
+		return;
+	}
+	if (event != XACT_EVENT_COMMIT)
+		return;
+	wake_scheduler_at_commit = false;
+
+	for (i = 0; i < workerData->nslots; i++)
+	{
+		WorkerSlot *slot = &workerData->slots[i];
+		Oid		dbid;
+		bool	scheduler;
+		pid_t	pid;
+
+		SpinLockAcquire(&slot->mutex);
+		dbid = slot->dbid;
+		scheduler = slot->scheduler;
+		pid = slot->pid;
+		SpinLockRelease(&slot->mutex);
+
+		if (dbid == MyDatabaseId && scheduler)
+		{
+			PGPROC	*proc = BackendPidGetProc(pid);
+
+			/* The scheduler might have exited meanwhile. */
+			if (proc)
+				SetLatch(&proc->procLatch);
+			break;
+		}
+	}
+}
+
 /*
  * Submit a task for a squeeze worker and wait for its completion.
  *
@@ -407,6 +660,7 @@ squeeze_table_new(PG_FUNCTION_ARGS)
 	Name		indname = NULL;
 	Name		tbspname = NULL;
 	ArrayType  *ind_tbsps = NULL;
+	SqueezeSettings settings;
 	int		task_idx;
 	WorkerTask *task = NULL;
 	BackgroundWorkerHandle *handle;
@@ -453,8 +707,9 @@ squeeze_table_new(PG_FUNCTION_ARGS)
 	}
 
 	/* Fill-in the remaining task information. */
+	get_squeeze_settings(&settings);
 	initialize_worker_task(task, -1, indname, tbspname, ind_tbsps, false,
-						   true, squeeze_max_xlock_time);
+						   true, &settings);
 	/*
 	 * Unlike scheduler_worker_loop() we cannot build the snapshot here, the
 	 * worker will do. (It will also create the replication slot.) This is
@@ -511,6 +766,17 @@ squeeze_table_new(PG_FUNCTION_ARGS)
 	if (error_msg)
 		ereport(ERROR, (errmsg("%s", error_msg)));
 
+	/*
+	 * The snapshot of our transaction still sees the tuples moved out of the
+	 * tail, so the worker could not truncate the table, see
+	 * compact_table_tail().
+	 */
+	if (settings.tail_percent > 0.0)
+		ereport(NOTICE,
+				(errmsg("tuples were moved out of the tail of table \"%s\".\"%s\", but the table was not truncated",
+						NameStr(*relschema), NameStr(*relname)),
+				 errhint("Run VACUUM on the table to truncate it.")));
+
 	PG_RETURN_VOID();
 }
 
@@ -679,7 +945,7 @@ done:
 static void
 initialize_worker_task(WorkerTask *task, int task_id, Name indname,
 					   Name tbspname, ArrayType *ind_tbsps, bool last_try,
-					   bool skip_analyze, int max_xlock_time)
+					   bool skip_analyze, SqueezeSettings *settings)
 {
 	StringInfoData	buf;
 
@@ -720,7 +986,44 @@ initialize_worker_task(WorkerTask *task, int task_id, Name indname,
 	task->error_msg[0] = '\0';
 	task->last_try = last_try;
 	task->skip_analyze = skip_analyze;
-	task->max_xlock_time = max_xlock_time;
+	task->settings = *settings;
+	task->batch_next = -1;
+}
+
+/*
+ * Retrieve the settings of the current session.
+ */
+static void
+get_squeeze_settings(SqueezeSettings *settings)
+{
+	settings->max_xlock_time = squeeze_max_xlock_time;
+	settings->initial_load_workers = squeeze_max_initial_load_workers;
+	settings->cluster_sort_min_size = squeeze_cluster_sort_min_size;
+	settings->parallel_index_workers = squeeze_max_parallel_index_workers;
+	settings->coalesce_changes = squeeze_coalesce_changes;
+	settings->pipelined_decoding = squeeze_pipelined_decoding;
+	settings->spill_compression = squeeze_spill_compression;
+	settings->tail_percent = squeeze_tail_percent;
+	settings->cost_limit = squeeze_cost_limit;
+	settings->cost_delay = squeeze_cost_delay;
+}
+
+/*
+ * Make the settings of a task effective in the squeeze worker.
+ */
+static void
+set_squeeze_settings(SqueezeSettings *settings)
+{
+	squeeze_max_xlock_time = settings->max_xlock_time;
+	squeeze_max_initial_load_workers = settings->initial_load_workers;
+	squeeze_cluster_sort_min_size = settings->cluster_sort_min_size;
+	squeeze_max_parallel_index_workers = settings->parallel_index_workers;
+	squeeze_coalesce_changes = settings->coalesce_changes;
+	squeeze_pipelined_decoding = settings->pipelined_decoding;
+	squeeze_spill_compression = settings->spill_compression;
+	squeeze_tail_percent = settings->tail_percent;
+	squeeze_cost_limit = settings->cost_limit;
+	squeeze_cost_delay = settings->cost_delay;
 }
 
 /*
@@ -860,10 +1163,10 @@ static volatile sig_atomic_t got_sigterm = false;
 /*
  * Sleep time (in seconds) of the scheduler worker.
  *
- * If there are no tables eligible for squeezing, the worker sleeps this
- * amount of seconds and then try again. The value should be low enough to
- * ensure that no scheduled table processing is missed, while the schedule
- * granularity is one minute.
+ * If some tasks could not be started yet, the worker sleeps this amount of
+ * seconds and then tries again. Otherwise it sleeps until the next table is
+ * due for the check or a slot of the pool expires (see
+ * get_scheduler_delay()), or until the tables or tasks are changed.
  *
  * So far there seems to be no reason to have separate variables for the
  * scheduler and the squeeze worker.
@@ -922,6 +1225,7 @@ squeeze_worker_main(Datum main_arg)
 		Assert(task_idx < NUM_WORKER_TASKS);
 
 		MyWorkerTask = &workerData->tasks[task_idx];
+		MyBatchHead = MyWorkerTask;
 	}
 
 	found_scheduler = false;
@@ -1026,7 +1330,7 @@ squeeze_worker_main(Datum main_arg)
 		Assert(slot->pid == InvalidPid);
 		slot->pid = MyProcPid;
 		slot->scheduler = am_i_scheduler;
-		MemSet(&slot->progress, 0, sizeof(WorkerProgress));
+		reset_progress(&slot->progress);
 		SpinLockRelease(&slot->mutex);
 	}
 	LWLockRelease(workerData->lock);
@@ -1043,7 +1347,21 @@ squeeze_worker_main(Datum main_arg)
 	if (am_i_scheduler)
 		scheduler_worker_loop();
 	else
-		process_task();
+	{
+		/* Process the task and the others of the batch, if any. */
+		for (;;)
+		{
+			process_task();
+
+			if (MyWorkerTask->batch_next < 0)
+				break;
+
+			/* Do not start the next task if the scheduler wants us to exit. */
+			exit_if_requested();
+
+			MyWorkerTask = next_batch_task(MyWorkerTask);
+		}
+	}
 
 done:
 	proc_exit(0);
@@ -1075,6 +1393,7 @@ static void
 scheduler_worker_loop(void)
 {
 	long		delay = 0L;
+	bool		first = true;
 	int		i;
 	MemoryContext	sched_cxt, old_cxt;
 	bool	cleanup_done;
@@ -1108,6 +1427,9 @@ scheduler_worker_loop(void)
 		ListCell	*lc;
 		int		nslots;
 		List	*task_idxs = NIL;
+		List	*batch_heads = NIL;
+		int		batch_tail = -1;
+		int		batch_len = 0;
 
 		/*
 		 * Make sure all the workers we launched in the previous loop and
@@ -1117,8 +1439,21 @@ scheduler_worker_loop(void)
 		/* Free the corresponding memory. */
 		MemoryContextReset(sched_cxt);
 
+		/*
+		 * Prepare slots for the next tasks while there are none, so that
+		 * the wait for the running transactions does not delay the start of
+		 * the workers.
+		 */
+		fill_slot_pool();
+
+		/* The first time, check the schedule immediately. */
+		if (!first)
+			delay = get_scheduler_delay();
+		first = false;
+
 		rc = WaitLatch(MyLatch,
-					   WL_LATCH_SET | WL_TIMEOUT | WL_POSTMASTER_DEATH, delay,
+					   WL_LATCH_SET | WL_POSTMASTER_DEATH |
+					   (delay >= 0 ? WL_TIMEOUT : 0), delay,
 					   PG_WAIT_EXTENSION);
 		ResetLatch(MyLatch);
 
@@ -1141,19 +1476,40 @@ scheduler_worker_loop(void)
 
 		/*
 		 * Are there some tasks with no worker assigned?
+		 *
+		 * Tasks that need to start now to meet their deadline go first, then
+		 * those expected to reclaim the most space, with the overhead of the
+		 * processing taken into account (see the squeeze.task_ranking
+		 * view). Do not start tasks which probably cannot finish within their
+		 * maintenance window. The index-to-tablespace mapping only applies to
+		 * non-partitioned tables because the partitions of the indexes have
+		 * different names.
+		 *
+		 * Each worker can process up to squeeze_max_batch_tables small
+		 * tables, see below.
 		 */
 		initStringInfo(&query);
 		appendStringInfo(
 			&query,
-			"SELECT t.id, tb.tabschema, tb.tabname, tb.clustering_index, "
-			"tb.rel_tablespace, tb.ind_tablespaces, t.tried >= tb.max_retry, "
-			"tb.skip_analyze "
-			"FROM squeeze.tasks t, squeeze.tables tb "
+			"SELECT t.id, tt.tabschema, tt.tabname, tt.clustering_index, "
+			"tb.rel_tablespace, "
+			"CASE WHEN t.partname ISNULL THEN tb.ind_tablespaces END, "
+			"t.tried >= tb.max_retry, "
+			"tb.skip_analyze, tb.initial_load_workers, tb.tail_percent, "
+			"tb.cost_limit, tb.cost_delay, pg_table_size(tt.relid) "
+			"FROM squeeze.tasks t "
+			"JOIN squeeze.tables tb ON t.table_id = tb.id "
+			"JOIN squeeze.task_tables tt ON tt.task_id = t.id "
+			"JOIN squeeze.task_ranking r ON r.task_id = t.id "
 			"LEFT JOIN squeeze.get_active_workers() AS w "
-			"ON (tb.tabschema, tb.tabname) = (w.tabschema, w.tabname) "
-			"WHERE w.tabname ISNULL AND t.state = 'ready' AND t.table_id = tb.id "
-			"ORDER BY t.id "
-			"LIMIT %d", squeeze_workers_per_database);
+			"ON (tt.tabschema, tt.tabname) = (w.tabschema, w.tabname) "
+			"WHERE w.tabname ISNULL AND t.state = 'ready' AND "
+			"(r.window_end ISNULL OR "
+			"now() + coalesce(r.duration, interval '0') <= r.window_end) "
+			"ORDER BY CASE WHEN r.latest_start <= now() THEN r.latest_start END "
+			"NULLS LAST, r.priority DESC NULLS LAST, t.id "
+			"LIMIT %d",
+			squeeze_workers_per_database * squeeze_max_batch_tables);
 
 		StartTransactionCommand();
 		PushActiveSnapshot(GetTransactionSnapshot());
@@ -1193,6 +1549,9 @@ scheduler_worker_loop(void)
 			ArrayType *ind_tbsps;
 			bool		last_try;
 			bool		skip_analyze;
+			SqueezeSettings settings;
+			bool		small;
+			bool		join_batch;
 			bool		task_exists = false;
 
 			cl_index = NULL;
@@ -1216,6 +1575,21 @@ scheduler_worker_loop(void)
 			Assert(!isnull);
 			relname = DatumGetName(datum);
 
+			/*
+			 * A small table joins the current batch unless the batch is
+			 * full. Any other task needs a new worker. (The table can be
+			 * dropped concurrently, so the size can be NULL.)
+			 */
+			datum = slot_getattr(slot, 13, &isnull);
+			small = squeeze_max_batch_tables > 1 && !isnull &&
+				DatumGetInt64(datum) <=
+				(int64) squeeze_batch_table_max_size * 1024 * 1024;
+			join_batch = small && batch_tail >= 0 &&
+				batch_len < squeeze_max_batch_tables;
+			if (!join_batch &&
+				list_length(batch_heads) >= squeeze_workers_per_database)
+				continue;
+
 			task = get_unused_task(MyDatabaseId, NameStr(*relschema),
 								   NameStr(*relname), &idx, &task_exists);
 			if (task == NULL)
@@ -1260,16 +1634,53 @@ scheduler_worker_loop(void)
 			Assert(!isnull);
 			skip_analyze = DatumGetBool(datum);
 
+			get_squeeze_settings(&settings);
+			/* XXX Should max_xlock_time be added to squeeze.tables ? */
+			settings.max_xlock_time = 0;
+
+			/* The configuration variable is the upper limit. */
+			datum = slot_getattr(slot, 9, &isnull);
+			Assert(!isnull);
+			settings.initial_load_workers =
+				Min(DatumGetInt32(datum), squeeze_max_initial_load_workers);
+
+			/* Unlike the cost settings, NULL means no tail compaction. */
+			datum = slot_getattr(slot, 10, &isnull);
+			settings.tail_percent = isnull ? 0.0 : DatumGetFloat4(datum);
+
+			/* NULL means that the configuration variable applies. */
+			datum = slot_getattr(slot, 11, &isnull);
+			if (!isnull)
+				settings.cost_limit = DatumGetInt32(datum);
+
+			datum = slot_getattr(slot, 12, &isnull);
+			if (!isnull)
+				settings.cost_delay = DatumGetFloat4(datum);
+
 			/* Fill the task. */
 			initialize_worker_task(task, task_id, cl_index, rel_tbsp,
 								   ind_tbsps, last_try, skip_analyze,
-								   /* XXX Should max_xlock_time be added to
-									* squeeze.tables ? */
-								   0);
+								   &settings);
 
-			/* The list must survive SPI_finish(). */
+			/* The lists must survive SPI_finish(). */
 			old_cxt = MemoryContextSwitchTo(sched_cxt);
 			task_idxs = lappend_int(task_idxs, idx);
+			if (join_batch)
+			{
+				workerData->tasks[batch_tail].batch_next = idx;
+				batch_tail = idx;
+				batch_len++;
+			}
+			else
+			{
+				batch_heads = lappend_int(batch_heads, idx);
+				if (small)
+				{
+					/* Start a new batch. */
+					batch_tail = idx;
+					batch_len = 1;
+				}
+			}
 			MemoryContextSwitchTo(old_cxt);
 		}
 
@@ -1286,8 +1697,23 @@ scheduler_worker_loop(void)
 		CommitTransactionCommand();
 		pgstat_report_stat(false);
 
-		/* Initialize the array to track the workers we start. */
-		squeezeWorkerCount = nslots = list_length(task_idxs);
+		/*
+		 * Initialize the array to track the workers we start. Only the
+		 * first task of each batch gets its slot here: the worker creates
+		 * the slot of each following task just before it starts the task
+		 * (see process_task_internal()), so that a table queued later in
+		 * the batch does not hold back WAL and the xmin horizon meanwhile.
+		 * Tail compaction does not use logical decoding, so it needs no
+		 * slot.
+		 */
+		nslots = 0;
+		foreach(lc, batch_heads)
+		{
+			if (!task_needs_slot(&workerData->tasks[lfirst_int(lc)]))
+				continue;
+			nslots++;
+		}
+		squeezeWorkerCount = list_length(batch_heads);
 
 		if (squeezeWorkerCount > 0)
 		{
@@ -1302,7 +1728,8 @@ scheduler_worker_loop(void)
 			/* Create and initialize the replication slot for each worker. */
 			PG_TRY();
 			{
-				create_replication_slots(nslots, sched_cxt);
+				if (nslots > 0)
+					create_replication_slots(nslots, sched_cxt);
 			}
 			PG_CATCH();
 			{
@@ -1326,13 +1753,23 @@ scheduler_worker_loop(void)
 			}
 			PG_END_TRY();
 
+			i = 0;
+			foreach(lc, batch_heads)
+			{
+				WorkerTask *task = &workerData->tasks[lfirst_int(lc)];
+
+				if (task_needs_slot(task))
+					task->repl_slot = squeezeWorkerSlots[i++];
+			}
+			Assert(i == nslots);
+
 			/*
 			 * Now that the transaction has committed, we can start the
 			 * workers. (start_worker_internal() needs to run in a transaction
 			 * because it does access the system catalog.)
 			 */
 			i = 0;
-			foreach(lc, task_idxs)
+			foreach(lc, batch_heads)
 			{
 				SqueezeWorker	*worker;
 				int	task_idx;
@@ -1342,7 +1779,6 @@ scheduler_worker_loop(void)
 				worker->handle = NULL;
 				task_idx = lfirst_int(lc);
 				worker->task = &workerData->tasks[task_idx];
-				worker->task->repl_slot = squeezeWorkerSlots[i];
 
 				SetCurrentStatementStartTimestamp();
 				StartTransactionCommand();
@@ -1359,10 +1795,10 @@ scheduler_worker_loop(void)
 				{
 					/*
 					 * The worker could not even get registered, so it won't
-					 * set its status to WTS_UNUSED. Make sure the task does
+					 * set its status to WTS_UNUSED. Make sure the tasks do
 					 * not leak.
 					 */
-					release_task(worker->task);
+					release_batch(worker->task);
 
 					ereport(ERROR,
 							(errmsg("squeeze worker could not start")),
@@ -1374,9 +1810,6 @@ scheduler_worker_loop(void)
 				i++;
 			}
 		}
-
-		/* Check later if any table meets the schedule. */
-		delay = worker_naptime * 1000L;
 	}
 
 	/*
@@ -1385,6 +1818,97 @@ scheduler_worker_loop(void)
 	 */
 }
 
+/*
+ * Does the task need a replication slot?
+ */
+static bool
+task_needs_slot(WorkerTask *task)
+{
+	return task->settings.tail_percent <= 0.0;
+}
+
+/*
+ * How long (in milliseconds) the scheduler can sleep, or -1 if it only needs
+ * to wake up when the tables or tasks are changed.
+ */
+static long
+get_scheduler_delay(void)
+{
+	char	   *query;
+	int			ret;
+	bool		pending;
+	bool		isnull;
+	Datum		datum;
+	long		result;
+
+	query =
+		"SELECT EXISTS (SELECT * FROM squeeze.tasks "
+		"WHERE state IN ('new', 'ready')), "
+		"EXTRACT(epoch FROM min(coalesce(next_check, now())) - now())::float8 "
+		"FROM squeeze.tables_internal "
+		"WHERE next_check ISNULL OR next_check < 'infinity'";
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, query);
+	ret = SPI_execute(query, true, 0);
+	pgstat_report_activity(STATE_IDLE, NULL);
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "command failed: %s", query);
+
+	datum = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1,
+						  &isnull);
+	Assert(!isnull);
+	pending = DatumGetBool(datum);
+
+	datum = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2,
+						  &isnull);
+	if (isnull)
+		result = -1;
+	else
+	{
+		double		secs = DatumGetFloat8(datum);
+
+		/* Do not let the timeout overflow. */
+		secs = Min(secs, SECS_PER_DAY);
+		result = (long) ceil(Max(secs, 0.0) * 1000.0);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_stat(false);
+
+	/* The tasks which could not be started yet are retried periodically. */
+	if (pending && (result < 0 || result > worker_naptime * 1000L))
+		result = worker_naptime * 1000L;
+
+	/*
+	 * Wake up when the oldest slot of the pool expires, so that
+	 * fill_slot_pool() can replace it. Otherwise the slot would hold WAL and
+	 * the xmin horizon until the next table is due.
+	 */
+	if (slotPoolCount > 0)
+	{
+		TimestampTz expires;
+		long		secs;
+		int			usecs;
+		long		pool_delay;
+
+		expires = TimestampTzPlusMilliseconds(slotPoolCreated[0],
+											  squeeze_slot_pool_max_age * 1000L);
+		TimestampDifference(GetCurrentTimestamp(), expires, &secs, &usecs);
+		/* Round up so that the slot is really considered expired then. */
+		pool_delay = secs * 1000L + (usecs + 999) / 1000;
+		if (result < 0 || result > pool_delay)
+			result = pool_delay;
+	}
+
+	return result;
+}
+
 static void
 cleanup_workers_and_tasks(bool interrupt)
 {
@@ -1396,9 +1920,15 @@ cleanup_workers_and_tasks(bool interrupt)
 		/* Notify the tasks that they should exit. */
 		for (i = 0; i < squeezeWorkerCount; i++)
 		{
+			WorkerTask	*task;
+
 			worker = &squeezeWorkers[i];
-			if (worker->task)
-				interrupt_worker(worker->task);
+			/*
+			 * The worker does not release any task of the batch until it
+			 * exits, so the chain is still valid.
+			 */
+			for (task = worker->task; task; task = next_batch_task(task))
+				interrupt_worker(task);
 		}
 	}
 
@@ -1462,7 +1992,7 @@ process_task(void)
 									 "pg_squeeze task context",
 									 ALLOCSET_DEFAULT_SIZES);
 
-	squeeze_max_xlock_time = MyWorkerTask->max_xlock_time;
+	set_squeeze_settings(&MyWorkerTask->settings);
 
 	/* Process the assigned task. */
 	PG_TRY();
@@ -1481,6 +2011,25 @@ process_task(void)
 	}
 	PG_END_TRY();
 
+	/*
+	 * If we created the slot ourselves, drop it now so that it does not
+	 * retain WAL while the next task of the batch (if any) is processed.
+	 */
+	if (squeezeWorkerSlots != NULL)
+	{
+		ReplSlotStatus *slots = squeezeWorkerSlots;
+
+		Assert(am_i_standalone && squeezeWorkerSlotCount == 1);
+
+		if (slots[0].snap_private)
+		{
+			pfree(slots[0].snap_private);
+			MyWorkerTask->repl_slot.snap_private = NULL;
+		}
+		drop_replication_slots();
+		pfree(slots);
+	}
+
 	MemoryContextDelete(task_cxt);
 }
 
@@ -1493,12 +2042,13 @@ process_task(void)
  * complete. If each worker had to initialize its slot, it'd have wait until
  * the other worker(s) are done with their current job (which usually takes
  * some time), so the workers wouldn't actually do their work in parallel.
+ *
+ * Slots prepared by fill_slot_pool() are used first.
  */
 static void
 create_replication_slots(int nslots, MemoryContext mcxt)
 {
 	uint32		i;
-	ReplSlotStatus	*res_ptr;
 	MemoryContext	old_cxt;
 
 	Assert(squeezeWorkerSlots == NULL && squeezeWorkerSlotCount == 0);
@@ -1522,8 +2072,6 @@ create_replication_slots(int nslots, MemoryContext mcxt)
 	squeezeWorkerSlots = (ReplSlotStatus *) palloc0(nslots *
 													sizeof(ReplSlotStatus));
 
-	res_ptr = squeezeWorkerSlots;
-
 	/*
 	 * XXX It might be faster if we created one slot using the API and the
 	 * other ones by copying, however pg_copy_logical_replication_slot()
@@ -1531,143 +2079,167 @@ create_replication_slots(int nslots, MemoryContext mcxt)
 	 */
 	for (i = 0; i < nslots; i++)
 	{
-		char	name[NAMEDATALEN];
-		LogicalDecodingContext *ctx;
-		ReplicationSlot *slot;
-		Snapshot	snapshot;
-		Size		snap_size;
-		char		*snap_dst;
-		int		slot_nr;
+		ReplSlotStatus	*res_ptr = &squeezeWorkerSlots[i];
+
+		/*
+		 * Count the slot early so that it gets cleaned up if the creation
+		 * throws ERROR. (drop_replication_slots() skips the slot until it has
+		 * a name.)
+		 */
+		squeezeWorkerSlotCount++;
 
-		if (am_i_standalone)
+		/* The most recent slot of the pool needs the least decoding. */
+		if (slotPoolCount > 0)
 		{
-			/*
-			 * squeeze_table() can be called concurrently (for different
-			 * tables), so make sure that each call generates an unique slot
-			 * name.
-			 */
-			Assert(nslots == 1);
-			/*
-			 * Try to minimize the probability of collision with a
-			 * "non-standalone" worker.
-			 */
-			slot_nr = Min(MyProcPid, MyProcPid + 1024);
+			*res_ptr = slotPool[--slotPoolCount];
+			continue;
 		}
-		else
-			slot_nr = i;
 
-		snprintf(name, NAMEDATALEN, REPL_SLOT_PREFIX "%u_%u", MyDatabaseId,
-				 slot_nr);
+		create_replication_slot(res_ptr);
+	}
 
-#if PG_VERSION_NUM >= 170000
-		ReplicationSlotCreate(name, true, RS_PERSISTENT, false, false, false);
-#elif PG_VERSION_NUM >= 140000
-		ReplicationSlotCreate(name, true, RS_PERSISTENT, false);
-#else
-		ReplicationSlotCreate(name, true, RS_PERSISTENT);
-#endif
-		slot = MyReplicationSlot;
+	MemoryContextSwitchTo(old_cxt);
+	CommitTransactionCommand();
+
+	Assert(squeezeWorkerSlotCount == nslots);
+}
 
+/*
+ * Create a single slot, find the start point for logical decoding and store
+ * the initial snapshot. The caller is responsible for the transaction and for
+ * the memory context.
+ */
+static void
+create_replication_slot(ReplSlotStatus *res_ptr)
+{
+	char	name[NAMEDATALEN];
+	LogicalDecodingContext *ctx;
+	ReplicationSlot *slot;
+	Snapshot	snapshot;
+	Size		snap_size;
+	char		*snap_dst;
+	int		slot_nr;
+
+	if (am_i_standalone)
+	{
 		/*
-		 * Save the name early so that the slot gets cleaned up if the steps
-		 * below throw ERROR.
+		 * squeeze_table() can be called concurrently (for different
+		 * tables), so make sure that each call generates an unique slot
+		 * name.
 		 */
-		namestrcpy(&res_ptr->name, slot->data.name.data);
-		squeezeWorkerSlotCount++;
-
+		Assert(squeezeWorkerSlotCount == 1);
 		/*
-		 * Neither prepare_write nor do_write callback nor update_progress is
-		 * useful for us.
-		 *
-		 * Regarding the value of need_full_snapshot, we pass true to protect
-		 * its data from VACUUM. Otherwise the historical snapshot we use for
-		 * the initial load could miss some data. (Unlike logical decoding, we
-		 * need the historical snapshot for non-catalog tables.)
+		 * Try to minimize the probability of collision with a
+		 * "non-standalone" worker.
 		 */
-		ctx = CreateInitDecodingContext(REPL_PLUGIN_NAME,
-										NIL,
-										true,
-										InvalidXLogRecPtr,
-#if PG_VERSION_NUM >= 130000
-										XL_ROUTINE(.page_read = read_local_xlog_page,
-												   .segment_open = wal_segment_open,
-												   .segment_close = wal_segment_close),
+		slot_nr = Min(MyProcPid, MyProcPid + 1024);
+	}
+	else
+		slot_nr = nextSlotNr++;
+
+	snprintf(name, NAMEDATALEN, REPL_SLOT_PREFIX "%u_%u", MyDatabaseId,
+			 slot_nr);
+
+#if PG_VERSION_NUM >= 170000
+	ReplicationSlotCreate(name, true, RS_PERSISTENT, false, false, false);
+#elif PG_VERSION_NUM >= 140000
+	ReplicationSlotCreate(name, true, RS_PERSISTENT, false);
 #else
-										logical_read_local_xlog_page,
+	ReplicationSlotCreate(name, true, RS_PERSISTENT);
 #endif
-										NULL, NULL, NULL);
+	slot = MyReplicationSlot;
 
+	/*
+	 * Save the name early so that the slot gets cleaned up if the steps
+	 * below throw ERROR.
+	 */
+	namestrcpy(&res_ptr->name, slot->data.name.data);
 
-		/*
-		 * We don't have control on setting fast_forward, so at least check
-		 * it.
-		 */
-		Assert(!ctx->fast_forward);
+	/*
+	 * Neither prepare_write nor do_write callback nor update_progress is
+	 * useful for us.
+	 *
+	 * Regarding the value of need_full_snapshot, we pass true to protect
+	 * its data from VACUUM. Otherwise the historical snapshot we use for
+	 * the initial load could miss some data. (Unlike logical decoding, we
+	 * need the historical snapshot for non-catalog tables.)
+	 */
+	ctx = CreateInitDecodingContext(REPL_PLUGIN_NAME,
+									NIL,
+									true,
+									InvalidXLogRecPtr,
+#if PG_VERSION_NUM >= 130000
+									XL_ROUTINE(.page_read = read_local_xlog_page,
+											   .segment_open = wal_segment_open,
+											   .segment_close = wal_segment_close),
+#else
+									logical_read_local_xlog_page,
+#endif
+									NULL, NULL, NULL);
 
-		/*
-		 * Bring the snapshot builder into the SNAPBUILD_CONSISTENT state so
-		 * that the worker can get its snapshot and start decoding
-		 * immediately. This is where we might need to wait for other
-		 * transactions to finish, so it should not be done by the workers.
-		 */
-		DecodingContextFindStartpoint(ctx);
 
-		/* Get the values the caller is interested int. */
-		res_ptr->confirmed_flush = slot->data.confirmed_flush;
+	/*
+	 * We don't have control on setting fast_forward, so at least check
+	 * it.
+	 */
+	Assert(!ctx->fast_forward);
 
-		/*
-		 * Unfortunately the API is such that CreateDecodingContext() assumes
-		 * need_full_snapshot=false, so the worker won't be able to create the
-		 * snapshot for the initial load. Therefore we serialize the snapshot
-		 * here and pass it to the worker via shared memory.
-		 */
-		snapshot = build_historic_snapshot(ctx->snapshot_builder);
-		snap_size = EstimateSnapshotSpace(snapshot);
-		if (!am_i_standalone)
-		{
-			res_ptr->snap_seg = dsm_create(snap_size, 0);
-			/*
-			 * The current transaction's commit must not detach the
-			 * segment.
-			 */
-			dsm_pin_mapping(res_ptr->snap_seg);
-			res_ptr->snap_handle = dsm_segment_handle(res_ptr->snap_seg);
-			res_ptr->snap_private = NULL;
-			snap_dst = (char *) dsm_segment_address(res_ptr->snap_seg);
-		}
-		else
-		{
-			res_ptr->snap_seg = NULL;
-			res_ptr->snap_handle = DSM_HANDLE_INVALID;
-			snap_dst = res_ptr->snap_private = (char *) palloc(snap_size);
-		}
-		/*
-		 * XXX Should we care about alignment? The function doesn't seem to
-		 * need that.
-		 */
-		SerializeSnapshot(snapshot, snap_dst);
+	/*
+	 * Bring the snapshot builder into the SNAPBUILD_CONSISTENT state so
+	 * that the worker can get its snapshot and start decoding
+	 * immediately. This is where we might need to wait for other
+	 * transactions to finish, so it should not be done by the workers.
+	 */
+	DecodingContextFindStartpoint(ctx);
 
-		res_ptr++;
+	/* Get the values the caller is interested int. */
+	res_ptr->confirmed_flush = slot->data.confirmed_flush;
 
+	/*
+	 * Unfortunately the API is such that CreateDecodingContext() assumes
+	 * need_full_snapshot=false, so the worker won't be able to create the
+	 * snapshot for the initial load. Therefore we serialize the snapshot
+	 * here and pass it to the worker via shared memory.
+	 */
+	snapshot = build_historic_snapshot(ctx->snapshot_builder);
+	snap_size = EstimateSnapshotSpace(snapshot);
+	if (!am_i_standalone)
+	{
+		res_ptr->snap_seg = dsm_create(snap_size, 0);
 		/*
-		 * Done for now, the worker will have to setup the context on its own.
+		 * The current transaction's commit must not detach the
+		 * segment.
 		 */
-		FreeDecodingContext(ctx);
-
-		/* Prevent ReplicationSlotRelease() from clearing effective_xmin. */
-		SpinLockAcquire(&slot->mutex);
-		Assert(TransactionIdIsValid(slot->effective_xmin) &&
-			   !TransactionIdIsValid(slot->data.xmin));
-		slot->data.xmin = slot->effective_xmin;
-		SpinLockRelease(&slot->mutex);
-
-		ReplicationSlotRelease();
+		dsm_pin_mapping(res_ptr->snap_seg);
+		res_ptr->snap_handle = dsm_segment_handle(res_ptr->snap_seg);
+		res_ptr->snap_private = NULL;
+		snap_dst = (char *) dsm_segment_address(res_ptr->snap_seg);
 	}
+	else
+	{
+		res_ptr->snap_seg = NULL;
+		res_ptr->snap_handle = DSM_HANDLE_INVALID;
+		snap_dst = res_ptr->snap_private = (char *) palloc(snap_size);
+	}
+	/*
+	 * XXX Should we care about alignment? The function doesn't seem to
+	 * need that.
+	 */
+	SerializeSnapshot(snapshot, snap_dst);
 
-	MemoryContextSwitchTo(old_cxt);
-	CommitTransactionCommand();
+	/*
+	 * Done for now, the worker will have to setup the context on its own.
+	 */
+	FreeDecodingContext(ctx);
 
-	Assert(squeezeWorkerSlotCount == nslots);
+	/* Prevent ReplicationSlotRelease() from clearing effective_xmin. */
+	SpinLockAcquire(&slot->mutex);
+	Assert(TransactionIdIsValid(slot->effective_xmin) &&
+		   !TransactionIdIsValid(slot->data.xmin));
+	slot->data.xmin = slot->effective_xmin;
+	SpinLockRelease(&slot->mutex);
+
+	ReplicationSlotRelease();
 }
 
 /*
@@ -1697,24 +2269,7 @@ drop_replication_slots(void)
 		ReplicationSlotRelease();
 
 	for (i = 0; i < squeezeWorkerSlotCount; i++)
-	{
-		ReplSlotStatus	*slot;
-
-		slot = &squeezeWorkerSlots[i];
-		if (strlen(NameStr(slot->name)) > 0)
-		{
-			/* nowait=false, i.e. wait */
-			ReplicationSlotDrop(NameStr(slot->name), false);
-		}
-
-		/* Detach from the shared memory segment. */
-		if (slot->snap_seg)
-		{
-			dsm_detach(slot->snap_seg);
-			slot->snap_seg = NULL;
-			slot->snap_handle = DSM_HANDLE_INVALID;
-		}
-	}
+		drop_replication_slot(&squeezeWorkerSlots[i]);
 
 	squeezeWorkerSlotCount = 0;
 	/*
@@ -1724,6 +2279,120 @@ drop_replication_slots(void)
 	squeezeWorkerSlots = NULL;
 }
 
+static void
+drop_replication_slot(ReplSlotStatus *slot)
+{
+	if (strlen(NameStr(slot->name)) > 0)
+	{
+		/* nowait=false, i.e. wait */
+		ReplicationSlotDrop(NameStr(slot->name), false);
+		/* Do not try again if detaching fails. */
+		NameStr(slot->name)[0] = '\0';
+	}
+
+	/* Detach from the shared memory segment. */
+	if (slot->snap_seg)
+	{
+		dsm_detach(slot->snap_seg);
+		slot->snap_seg = NULL;
+		slot->snap_handle = DSM_HANDLE_INVALID;
+	}
+}
+
+/*
+ * Make sure that the pool contains squeeze_slot_pool_size slots, none of
+ * which is older than squeeze_slot_pool_max_age.
+ *
+ * The slots cannot be advanced: the snapshot for the initial load is only
+ * available when the slot is being created, so the slots that got too old are
+ * replaced. Besides retaining WAL, each slot prevents VACUUM from removing
+ * rows deleted after the slot was created.
+ */
+static void
+fill_slot_pool(void)
+{
+	int		size;
+	TimestampTz	now;
+
+	/* The scheduler does not start more workers at a time. */
+	size = Min(squeeze_slot_pool_size, squeeze_workers_per_database);
+
+	if (slotPool == NULL)
+	{
+		if (size == 0)
+			return;
+
+		slotPool = (ReplSlotStatus *)
+			MemoryContextAlloc(TopMemoryContext,
+							   squeeze_workers_per_database *
+							   sizeof(ReplSlotStatus));
+		slotPoolCreated = (TimestampTz *)
+			MemoryContextAlloc(TopMemoryContext,
+							   squeeze_workers_per_database *
+							   sizeof(TimestampTz));
+	}
+
+	/* Drop the old slots, as well as those exceeding the current size. */
+	now = GetCurrentTimestamp();
+	while (slotPoolCount > 0 &&
+		   (slotPoolCount > size ||
+			TimestampDifferenceExceeds(slotPoolCreated[0], now,
+									   squeeze_slot_pool_max_age * 1000)))
+	{
+		drop_replication_slot(&slotPool[0]);
+		slotPoolCount--;
+		memmove(&slotPool[0], &slotPool[1],
+				slotPoolCount * sizeof(ReplSlotStatus));
+		memmove(&slotPoolCreated[0], &slotPoolCreated[1],
+				slotPoolCount * sizeof(TimestampTz));
+	}
+
+	if (slotPoolCount >= size)
+		return;
+
+	/* See create_replication_slots() for the transaction and the checks. */
+	StartTransactionCommand();
+#if PG_VERSION_NUM >= 150000
+	CheckSlotPermissions();
+#endif
+	CheckLogicalDecodingRequirements();
+
+	while (slotPoolCount < size)
+	{
+		ReplSlotStatus	*res_ptr = &slotPool[slotPoolCount];
+
+		/* Again, make sure that drop_slot_pool() sees the slot. */
+		memset(res_ptr, 0, sizeof(ReplSlotStatus));
+		slotPoolCreated[slotPoolCount] = now;
+		slotPoolCount++;
+
+		create_replication_slot(res_ptr);
+
+		/* The snapshot is as old as the end of the wait. */
+		slotPoolCreated[slotPoolCount - 1] = GetCurrentTimestamp();
+	}
+
+	CommitTransactionCommand();
+}
+
+/*
+ * Drop the slots of the pool, e.g. when the scheduler is exiting.
+ */
+static void
+drop_slot_pool(void)
+{
+	int		i;
+
+	/* ERROR in fill_slot_pool() can leave us with one of the slots acquired. */
+	if (MyReplicationSlot)
+		ReplicationSlotRelease();
+
+	for (i = 0; i < slotPoolCount; i++)
+		drop_replication_slot(&slotPool[i]);
+
+	slotPoolCount = 0;
+}
+
 /*
  * The first squeeze worker launched after server start calls this function to
  * make sure that no replication slots / origins exist.
@@ -1873,6 +2542,7 @@ start_cleanup_worker(MemoryContext task_cxt)
 	bool	task_exists;
 	int		task_idx;
 	NameData	dummy_name;
+	SqueezeSettings settings;
 	SqueezeWorker	*worker;
 	MemoryContext	old_cxt;
 	bool	registered;
@@ -1904,8 +2574,9 @@ start_cleanup_worker(MemoryContext task_cxt)
 	 * seem a good practice though.
 	 */
 	NameStr(dummy_name)[0] = '\0';
+	get_squeeze_settings(&settings);
 	initialize_worker_task(task, -1, &dummy_name, &dummy_name, NULL,
-						   false, false, 0);
+						   false, false, &settings);
 
 	worker = squeezeWorkers;
 	StartTransactionCommand();
@@ -2020,17 +2691,15 @@ process_task_internal(MemoryContext task_cxt)
 	 * worker is started by the squeeze_table() function, which is run by the
 	 * PG executor and therefore cannot build the historic snapshot (due to
 	 * the commit 240e0dbacd in PG core). (And the scheduler worker, which
-	 * usually creates the slots, is not involved here.)
+	 * usually creates the slots, is not involved here.) The scheduler also
+	 * leaves the slot to us for each task of a batch but the first one.
 	 */
-	if (task->repl_slot.snap_handle == DSM_HANDLE_INVALID)
+	if (task->repl_slot.snap_handle == DSM_HANDLE_INVALID &&
+		task_needs_slot(task))
+	{
 		am_i_standalone = true;
 
-	if (am_i_standalone)
-	{
-		/*
-		 * TopMemoryContext is o.k. here, this worker only processes a single
-		 * task and then exists.
-		 */
+		/* process_task() drops the slot when the task is done. */
 		create_replication_slots(1, TopMemoryContext);
 		task->repl_slot = squeezeWorkerSlots[0];
 	}
@@ -2076,7 +2745,7 @@ process_task_internal(MemoryContext task_cxt)
 	SpinLockAcquire(&MyWorkerSlot->mutex);
 	Assert(MyWorkerSlot->dbid == MyDatabaseId);
 	MyWorkerSlot->relid = relid;
-	MemSet(&MyWorkerSlot->progress, 0, sizeof(WorkerProgress));
+	reset_progress(&MyWorkerSlot->progress);
 	SpinLockRelease(&MyWorkerSlot->mutex);
 
 	/*
@@ -2133,6 +2802,7 @@ process_task_internal(MemoryContext task_cxt)
 		char	   *start_ts_str;
 		StringInfoData	query;
 		MemoryContext oldcxt;
+		WorkerProgress *progress;
 
 		initStringInfo(&query);
 		StartTransactionCommand();
@@ -2147,19 +2817,48 @@ process_task_internal(MemoryContext task_cxt)
 
 		resetStringInfo(&query);
 		/*
-		 * No one should change the progress fields now, so we can access
-		 * them w/o the spinlock below.
+		 * No one should change the progress fields now.
 		 */
+		progress = &MyWorkerSlot->progress;
 		appendStringInfo(&query,
-						 "INSERT INTO squeeze.log(tabschema, tabname, started, finished, ins_initial, ins, upd, del) \
-VALUES ('%s', '%s', '%s', clock_timestamp(), %ld, %ld, %ld, %ld)",
+						 "INSERT INTO squeeze.log(tabschema, tabname, started, finished, ins_initial, ins, upd, del, catch_up_rounds, xlock_attempts, \
+setup_time, initial_load_time, index_build_time, catch_up_time, lock_wait_time, final_merge_time, swap_time, \
+wal_decoded, reorder_spill, change_spill, sort_spill, peak_memory) \
+VALUES ('%s', '%s', '%s', clock_timestamp(), %ld, %ld, %ld, %ld, %ld, %ld",
 						 NameStr(*relschema),
 						 NameStr(*relname),
 						 start_ts_str,
-						 MyWorkerSlot->progress.ins_initial,
-						 MyWorkerSlot->progress.ins,
-						 MyWorkerSlot->progress.upd,
-						 MyWorkerSlot->progress.del);
+						 (int64) pg_atomic_read_u64(&progress->ins_initial),
+						 (int64) pg_atomic_read_u64(&progress->ins),
+						 (int64) pg_atomic_read_u64(&progress->upd),
+						 (int64) pg_atomic_read_u64(&progress->del),
+						 (int64) pg_atomic_read_u64(&progress->catch_up_rounds),
+						 (int64) pg_atomic_read_u64(&progress->xlock_attempts));
+		append_log_interval(&query, &progress->setup_time);
+		append_log_interval(&query, &progress->initial_load_time);
+		append_log_interval(&query, &progress->index_build_time);
+		append_log_interval(&query, &progress->catch_up_time);
+		append_log_interval(&query, &progress->lock_wait_time);
+		append_log_interval(&query, &progress->final_merge_time);
+		append_log_interval(&query, &progress->swap_time);
+		appendStringInfo(&query, ", %ld",
+						 (int64) pg_atomic_read_u64(&progress->wal_decoded));
+		/* Older versions do not let us find out these values. */
+#if PG_VERSION_NUM >= 150000
+		appendStringInfo(&query, ", %ld",
+						 (int64) pg_atomic_read_u64(&progress->reorder_spill));
+#else
+		appendStringInfoString(&query, ", NULL");
+#endif
+		appendStringInfo(&query, ", %ld, %ld",
+						 (int64) pg_atomic_read_u64(&progress->change_spill),
+						 (int64) pg_atomic_read_u64(&progress->sort_spill));
+#if PG_VERSION_NUM >= 130000
+		appendStringInfo(&query, ", %ld)",
+						 (int64) pg_atomic_read_u64(&progress->peak_memory));
+#else
+		appendStringInfoString(&query, ", NULL)");
+#endif
 		run_command(query.data, SPI_OK_INSERT);
 
 		if (task->task_id >= 0)
@@ -2173,14 +2872,16 @@ VALUES ('%s', '%s', '%s', clock_timestamp(), %ld, %ld, %ld, %ld)",
 			if (!task->skip_analyze)
 			{
 				/*
-				 * Analyze the new table, unless user rejects it
-				 * explicitly.
+				 * Analyze the new table if the user asked for it.
 				 *
-				 * XXX Besides updating planner statistics in general,
-				 * this sets pg_class(relallvisible) to 0, so that planner
-				 * is not too optimistic about this figure. The
-				 * preferrable solution would be to run (lazy) VACUUM
-				 * (with the ANALYZE option) to initialize visibility map.
+				 * The squeezing does not change the logical contents of
+				 * the table, so the existing pg_statistic entries remain
+				 * valid, and swap_relation_files() has already set
+				 * relpages and reltuples. Thus ANALYZE is not necessary
+				 * by default.
+				 *
+				 * XXX The preferrable way to initialize the visibility map
+				 * (and thus relallvisible) would be to run (lazy) VACUUM.
 				 * However, to make the effort worthwile, we shouldn't do
 				 * it until all transactions can see all the changes done
 				 * by squeeze_table() function. What's the most suitable
@@ -2199,7 +2900,7 @@ VALUES ('%s', '%s', '%s', clock_timestamp(), %ld, %ld, %ld, %ld)",
 	/* Clear the relid field of this worker's slot. */
 	SpinLockAcquire(&MyWorkerSlot->mutex);
 	MyWorkerSlot->relid = InvalidOid;
-	MemSet(&MyWorkerSlot->progress, 0, sizeof(WorkerProgress));
+	reset_progress(&MyWorkerSlot->progress);
 	SpinLockRelease(&MyWorkerSlot->mutex);
 }
 
@@ -2251,7 +2952,7 @@ VALUES ('%s', '%s', '%s', %s, %s)",
 		/* Clear the relid field of this worker's slot. */
 		SpinLockAcquire(&MyWorkerSlot->mutex);
 		MyWorkerSlot->relid = InvalidOid;
-		MemSet(&MyWorkerSlot->progress, 0, sizeof(WorkerProgress));
+		reset_progress(&MyWorkerSlot->progress);
 		SpinLockRelease(&MyWorkerSlot->mutex);
 	}
 }
@@ -2266,6 +2967,32 @@ interrupt_worker(WorkerTask *task)
 	SpinLockRelease(&task->mutex);
 }
 
+/*
+ * Caller should hold the spinlock of the slot the progress belongs to.
+ */
+static void
+reset_progress(WorkerProgress *progress)
+{
+	pg_atomic_write_u64(&progress->ins_initial, 0);
+	pg_atomic_write_u64(&progress->ins, 0);
+	pg_atomic_write_u64(&progress->upd, 0);
+	pg_atomic_write_u64(&progress->del, 0);
+	pg_atomic_write_u64(&progress->catch_up_rounds, 0);
+	pg_atomic_write_u64(&progress->xlock_attempts, 0);
+	pg_atomic_write_u64(&progress->setup_time, 0);
+	pg_atomic_write_u64(&progress->initial_load_time, 0);
+	pg_atomic_write_u64(&progress->index_build_time, 0);
+	pg_atomic_write_u64(&progress->catch_up_time, 0);
+	pg_atomic_write_u64(&progress->lock_wait_time, 0);
+	pg_atomic_write_u64(&progress->final_merge_time, 0);
+	pg_atomic_write_u64(&progress->swap_time, 0);
+	pg_atomic_write_u64(&progress->wal_decoded, 0);
+	pg_atomic_write_u64(&progress->reorder_spill, 0);
+	pg_atomic_write_u64(&progress->change_spill, 0);
+	pg_atomic_write_u64(&progress->sort_spill, 0);
+	pg_atomic_write_u64(&progress->peak_memory, 0);
+}
+
 static void
 clear_task(WorkerTask *task)
 {
@@ -2276,10 +3003,11 @@ clear_task(WorkerTask *task)
 	NameStr(task->relname)[0] = '\0';
 	NameStr(task->indname)[0] = '\0';
 	NameStr(task->tbspname)[0] = '\0';
-	task->max_xlock_time = 0;
+	memset(&task->settings, 0, sizeof(SqueezeSettings));
 	task->task_id = -1;
 	task->last_try = false;
 	task->skip_analyze = false;
+	task->batch_next = -1;
 	memset(task->ind_tbsps, 0, sizeof(task->ind_tbsps));
 
 	NameStr(task->repl_slot.name)[0] = '\0';
@@ -2300,7 +3028,8 @@ release_task(WorkerTask *task)
 	SpinLockAcquire(&task->mutex);
 
 	task->worker_state = WTS_UNUSED;
-	Assert(task == MyWorkerTask || MyWorkerTask == NULL);
+	Assert(task == MyWorkerTask || MyWorkerTask == NULL ||
+		   MyBatchHead != NULL);
 
 	/*
 	 * The "standalone" worker might have used its private memory for the
@@ -2321,11 +3050,50 @@ release_task(WorkerTask *task)
 	 * that transaction will take care.
 	 */
 
-	MyWorkerTask = NULL;
+	if (task == MyWorkerTask)
+		MyWorkerTask = NULL;
 	/* Let others to see the WTS_UNUSED state. */
 	SpinLockRelease(&task->mutex);
 }
 
+static WorkerTask *
+next_batch_task(WorkerTask *task)
+{
+	if (task->batch_next < 0)
+		return NULL;
+
+	Assert(task->batch_next < NUM_WORKER_TASKS);
+	return &workerData->tasks[task->batch_next];
+}
+
+/*
+ * Release the task and the tasks following it in the batch.
+ */
+static void
+release_batch(WorkerTask *task)
+{
+	while (task)
+	{
+		/* Once released, the task can be reused by others. */
+		WorkerTask *next = next_batch_task(task);
+
+		release_task(task);
+		task = next;
+	}
+	MyBatchHead = NULL;
+}
+
+/*
+ * Append a time counter of WorkerProgress (in microseconds) to the VALUES
+ * clause of the squeeze.log query.
+ */
+static void
+append_log_interval(StringInfo query, pg_atomic_uint64 *counter)
+{
+	appendStringInfo(query, ", %ld * interval '1 microsecond'",
+					 (int64) pg_atomic_read_u64(counter));
+}
+
 /*
  * Run an SQL command that does not return any value.
  *
@@ -2368,6 +3136,15 @@ run_command(char *command, int rc)
 
 #define	ACTIVE_WORKERS_RES_ATTRS	7
 
+/* The counters of WorkerProgress, as seen by squeeze_get_active_workers(). */
+typedef struct WorkerProgressData
+{
+	int64		ins_initial;
+	int64		ins;
+	int64		upd;
+	int64		del;
+} WorkerProgressData;
+
 /* Get information on squeeze workers on the current database. */
 PG_FUNCTION_INFO_V1(squeeze_get_active_workers);
 Datum
@@ -2375,6 +3152,7 @@ squeeze_get_active_workers(PG_FUNCTION_ARGS)
 {
 	WorkerSlot *slots,
 			   *dst;
+	WorkerProgressData *progress_all;
 	int			i,
 				nslots = 0;
 #if PG_VERSION_NUM >= 150000
@@ -2393,6 +3171,8 @@ squeeze_get_active_workers(PG_FUNCTION_ARGS)
 	 * locked for longer time than necessary.
 	 */
 	slots = (WorkerSlot *) palloc(workerData->nslots * sizeof(WorkerSlot));
+	progress_all = (WorkerProgressData *)
+		palloc(workerData->nslots * sizeof(WorkerProgressData));
 	dst = slots;
 	LWLockAcquire(workerData->lock, LW_SHARED);
 	for (i = 0; i < workerData->nslots; i++)
@@ -2403,7 +3183,14 @@ squeeze_get_active_workers(PG_FUNCTION_ARGS)
 			slot->pid != InvalidPid &&
 			slot->dbid == MyDatabaseId)
 		{
+			WorkerProgressData *progress = &progress_all[nslots];
+
 			memcpy(dst, slot, sizeof(WorkerSlot));
+			/* The atomics must be read from the shared memory. */
+			progress->ins_initial = pg_atomic_read_u64(&slot->progress.ins_initial);
+			progress->ins = pg_atomic_read_u64(&slot->progress.ins);
+			progress->upd = pg_atomic_read_u64(&slot->progress.upd);
+			progress->del = pg_atomic_read_u64(&slot->progress.del);
 			dst++;
 			nslots++;
 		}
@@ -2414,7 +3201,7 @@ squeeze_get_active_workers(PG_FUNCTION_ARGS)
 	for (i = 0; i < nslots; i++)
 	{
 		WorkerSlot *slot = &slots[i];
-		WorkerProgress *progress = &slot->progress;
+		WorkerProgressData *progress = &progress_all[i];
 		Datum		values[ACTIVE_WORKERS_RES_ATTRS];
 		bool		isnull[ACTIVE_WORKERS_RES_ATTRS];
 		char	   *relnspc = NULL;
@@ -2482,7 +3269,7 @@ squeeze_get_active_workers(PG_FUNCTION_ARGS)
 		for (i = 0; i < nslots; i++)
 		{
 			WorkerSlot *slot = &slots[i];
-			WorkerProgress *progress = &slot->progress;
+			WorkerProgressData *progress = &progress_all[i];
 			char	   *relnspc = NULL;
 			char	   *relname = NULL;
 			NameData	tabname,